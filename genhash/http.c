@@ -59,6 +59,28 @@
  *   finalize    /     epilog
  */
 
+/* CRC32, as the crc32 keyword of HTTP_GET/SSL_GET */
+static void
+crc32_init(hash_context_t *context)
+{
+	context->crc32 = 0;
+}
+
+static void
+crc32_update_ctx(hash_context_t *context, const void *buf, unsigned long len)
+{
+	context->crc32 = crc32_update(context->crc32, buf, len);
+}
+
+static void
+crc32_final(unsigned char *digest, hash_context_t *context)
+{
+	digest[0] = context->crc32 >> 24;
+	digest[1] = context->crc32 >> 16;
+	digest[2] = context->crc32 >> 8;
+	digest[3] = context->crc32;
+}
+
 const hash_t hashes[hash_guard] = {
 	[hash_md5] = {
 		(hash_init_f) MD5_Init,
@@ -76,8 +98,16 @@ const hash_t hashes[hash_guard] = {
 		SHA_DIGEST_LENGTH,
 		"SHA1",
 		"SHA1SUM",
-	}
+	},
 #endif
+	[hash_crc32] = {
+		crc32_init,
+		crc32_update_ctx,
+		crc32_final,
+		4,
+		"CRC32",
+		"CRC32SUM",
+	},
 };
 
 #define HASH_LENGTH(sock)	((sock)->hash->length)
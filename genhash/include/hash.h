@@ -26,6 +26,7 @@
 #define _HASH_H
 
 /* system includes */
+#include <stdint.h>
 #include <openssl/md5.h>
 #ifdef FEAT_SHA1
 #include <openssl/sha.h>
@@ -38,6 +39,7 @@ enum feat_hashes {
 #ifdef FEAT_SHA1
 	hash_sha1,
 #endif
+	hash_crc32,
 	hash_guard,
 	hash_default = hash_md5,
 };
@@ -47,6 +49,7 @@ typedef union {
 #ifdef FEAT_SHA1
 	SHA_CTX         	sha;
 #endif
+	uint32_t		crc32;
 	/* this is due to poor C standard/draft wording (wrapped):
 	   https://groups.google.com/forum/#!msg/comp.lang.c/
 	   1kQMGXhgn4I/0VBEYG_ji44J */
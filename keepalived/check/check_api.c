@@ -34,6 +34,9 @@
 #include "check_tcp.h"
 #include "check_http.h"
 #include "check_ssl.h"
+#include "check_worker.h"
+#include "ipwrapper.h"
+#include "smtp.h"
 
 /* Global vars */
 static checker_id_t ncheckers = 0;
@@ -73,6 +76,7 @@ dump_conn_opts (conn_opts_t *conn)
 void
 queue_checker(void (*free_func) (void *), void (*dump_func) (void *)
 	      , int (*launch) (thread_t *)
+	      , int (*compare_func) (checker_t *, checker_t *)
 	      , void *data
 	      , conn_opts_t *co)
 {
@@ -89,6 +93,7 @@ queue_checker(void (*free_func) (void *), void (*dump_func) (void *)
 	checker->free_func = free_func;
 	checker->dump_func = dump_func;
 	checker->launch = launch;
+	checker->compare_func = compare_func;
 	checker->vs = vs;
 	checker->rs = rs;
 	checker->data = data;
@@ -112,6 +117,21 @@ queue_checker(void (*free_func) (void *), void (*dump_func) (void *)
 	}
 }
 
+/* Same connection options, hence the same probe */
+int
+checker_co_equal(conn_opts_t *a, conn_opts_t *b)
+{
+	if (!a || !b)
+		return a == b;
+
+	return sockstorage_equal(&a->dst, &b->dst) &&
+	       sockstorage_equal(&a->bindto, &b->bindto) &&
+#ifdef _WITH_SO_MARK_
+	       a->fwmark == b->fwmark &&
+#endif
+	       a->connection_to == b->connection_to;
+}
+
 /* Set dst */
 void
 checker_set_dst(struct sockaddr_storage *dst)
@@ -234,32 +254,585 @@ free_checkers_queue(void)
 	ncheckers = 0;
 }
 
+/*
+ * Two checkers can share a probe when they would send the very same
+ * one at the same pace, and currently agree on the server state.
+ * Checkers suspended along with their VIP (ha_suspend) are left alone.
+ */
+static int
+checker_can_share(checker_t *a, checker_t *b)
+{
+	return a->launch == b->launch &&
+	       a->compare_func == b->compare_func &&
+	       a->vs->delay_loop == b->vs->delay_loop &&
+	       a->vs->delay_loop_min == b->vs->delay_loop_min &&
+	       a->vs->delay_loop_max == b->vs->delay_loop_max &&
+	       a->vs->delay_success_factor == b->vs->delay_success_factor &&
+	       a->vs->delay_failure_factor == b->vs->delay_failure_factor &&
+	       a->warmup == b->warmup &&
+	       a->is_up == b->is_up &&
+	       checker_co_equal(a->co, b->co) &&
+	       (*a->compare_func) (a, b);
+}
+
+/* FNV-1a of the probed address, and of the check type if asked */
+static unsigned int
+checker_share_hash(checker_t *checker, int with_launch)
+{
+	struct sockaddr_storage *addr = (checker->co) ? &checker->co->dst :
+							&checker->rs->addr;
+	unsigned int hash = 2166136261U;
+	unsigned char *p;
+	int i, len;
+
+	if (addr->ss_family == AF_INET6) {
+		p = (unsigned char *) &((struct sockaddr_in6 *) addr)->sin6_addr;
+		len = sizeof (struct in6_addr);
+	} else {
+		p = (unsigned char *) &((struct sockaddr_in *) addr)->sin_addr;
+		len = sizeof (struct in_addr);
+	}
+	for (i = 0; i < len; i++)
+		hash = (hash ^ p[i]) * 16777619U;
+	hash = (hash ^ inet_sockaddrport(addr)) * 16777619U;
+
+	/* The function address changes between runs of a PIE binary */
+	if (with_launch)
+		hash ^= (unsigned long) checker->launch;
+	return hash;
+}
+
+/*
+ * The same real server and check are often declared in many virtual
+ * servers, one per VIP, fwmark or protocol. Only the first of such
+ * checkers probes the server, the result is fanned out to the others
+ * by checker_update_state(). Leaders are indexed in an open addressing
+ * table so that large configurations are grouped in linear time.
+ */
+static void
+checker_share_probes(void)
+{
+	checker_t **table, *checker, *leader;
+	unsigned int size = 16, i;
+	int shared = 0;
+	element e;
+
+	while (size < 2 * LIST_SIZE(checkers_queue))
+		size <<= 1;
+	table = (checker_t **) MALLOC(size * sizeof (checker_t *));
+
+	for (e = LIST_HEAD(checkers_queue); e; ELEMENT_NEXT(e)) {
+		checker = ELEMENT_DATA(e);
+		if (!checker->launch || !checker->compare_func ||
+		    CHECKER_HA_SUSPEND(checker))
+			continue;
+
+		for (i = checker_share_hash(checker, 1) & (size - 1); table[i];
+		     i = (i + 1) & (size - 1)) {
+			if (checker_can_share(table[i], checker))
+				break;
+		}
+
+		leader = table[i];
+		if (!leader) {
+			table[i] = checker;
+			continue;
+		}
+
+		checker->probe = leader;
+		checker->worker = leader->worker;
+		checker->next_shared = leader->next_shared;
+		leader->next_shared = checker;
+		shared++;
+	}
+
+	FREE(table);
+	if (shared)
+		log_message(LOG_INFO, "%d healthcheckers share the probe of another"
+				    , shared);
+}
+
+/*
+ * Slot of a checker in its interval, from what it probes and its rank
+ * among the checks of its real server. Neither depends on the rest of
+ * the configuration, so a checker keeps its slot across reloads while
+ * the checks of a real server get distinct ones.
+ */
+static void
+checker_phase_init(checker_t *checker, unsigned int rank)
+{
+	unsigned int hash = checker_share_hash(checker, 0);
+
+	hash = (hash ^ rank) * 16777619U;
+
+	/* Final avalanche, FNV alone leaves close addresses close */
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6bU;
+	hash ^= hash >> 13;
+	checker->phase = hash;
+}
+
+/*
+ * Time until the first slot of a checker at least min from now. Slots
+ * are aligned on the monotonic clock, which a reload or a restart of
+ * the daemon does not reset.
+ */
+static long
+checker_phase_timer(checker_t *checker, long min, long period)
+{
+	long offset, elapsed;
+
+	if (period <= 0)
+		return min;
+
+	offset = ((unsigned long long) checker->phase * period) >> 32;
+	elapsed = (timer_long(time_now) + min - offset) % period;
+	if (elapsed < 0)
+		elapsed += period;
+	return min + period - elapsed;
+}
+
+/*
+ * Delay before the first probe of a checker, spread over its interval
+ * either at random, up to warmup, or at its slot.
+ */
+long
+checker_start_delay(checker_t *checker, unsigned int *seed)
+{
+	long warmup = checker->warmup;
+
+	if (global_data->checker_phase_spread)
+		return checker_phase_timer(checker, BOOTSTRAP_DELAY,
+					   checker->vs->delay_loop);
+
+	/* wait for a random timeout to begin checker thread.
+	   It helps avoiding multiple simultaneous checks to
+	   the same RS.
+	*/
+	if (warmup)
+		warmup = warmup * ((seed) ? rand_r(seed) : rand()) / RAND_MAX;
+	return BOOTSTRAP_DELAY + warmup;
+}
+
 /* register checkers to the global I/O scheduler */
 void
 register_checkers_thread(void)
 {
 	checker_t *checker;
+	real_server_t *rs = NULL;
+	unsigned int rank = 0;
 	element e;
-	long warmup;
 
+	checker_limit_init(checker_workers_init(global_data->checker_threads));
+
+	for (e = LIST_HEAD(checkers_queue); e; ELEMENT_NEXT(e)) {
+		checker = ELEMENT_DATA(e);
+		CHECKER_ENABLE(checker);
+		checker->is_up = svr_checker_up(checker->id, checker->rs);
+		checker->worker = checker_worker_assign(checker);
+		rank = (checker->rs == rs) ? rank + 1 : 0;
+		rs = checker->rs;
+		checker_phase_init(checker, rank);
+	}
+
+	checker_share_probes();
+
+	/* Start delays align on time_now, parsing may have made it stale */
+	set_time_now();
 	for (e = LIST_HEAD(checkers_queue); e; ELEMENT_NEXT(e)) {
 		checker = ELEMENT_DATA(e);
 		log_message(LOG_INFO, "Activating healthchecker for service %s"
 				    , FMT_CHK(checker));
-		CHECKER_ENABLE(checker);
-		if (checker->launch)
-		{
-			/* wait for a random timeout to begin checker thread.
-			   It helps avoiding multiple simultaneous checks to
-			   the same RS.
-			*/
-			warmup = checker->warmup;
-			if (warmup)
-				warmup = warmup * rand() / RAND_MAX;
+		if (checker->probe)
+			log_message(LOG_INFO, "Healthchecker for service %s shares"
+					      " the probe of VS %s"
+					    , FMT_CHK(checker)
+					    , FMT_VS(checker->probe->vs));
+		if (CHECKER_LAUNCHED(checker) && checker->worker < 0)
 			thread_add_timer(master, checker->launch, checker,
-					 BOOTSTRAP_DELAY + warmup);
+					 checker_start_delay(checker, NULL));
+	}
+
+	/* Worker threads schedule their own shard */
+	checker_workers_start();
+}
+
+/*
+ * Record a checker result, IPVS is only updated from the main thread.
+ * The checkers sharing its probe get the same result.
+ */
+void
+checker_update_state(checker_t *checker, int alive)
+{
+	int worker = checker->worker;
+
+	for (; checker; checker = checker->next_shared) {
+		checker->is_up = alive;
+		if (worker >= 0)
+			checker_worker_post(CHECKER_MSG_STATE, checker, alive, NULL, NULL);
+		else
+			update_svr_checker_state(alive, checker->id, checker->vs, checker->rs);
+	}
+}
+
+/*
+ * Interval before the next probe, from the state the last one left.
+ * It is the delay_loop unless delay_loop_min or delay_loop_max are set.
+ * Then a down server gets it shrunk by the failure factor, to confirm
+ * failures and flaps quickly, and a server up for two intervals gets
+ * it stretched by the success factor, to back off while stable. A
+ * server just back up keeps its interval, its recovery is confirmed
+ * as quickly. With checker_phase_spread the timer returned ends at the
+ * checker slot, so probes do not drift by their own duration.
+ */
+long
+checker_delay(checker_t *checker)
+{
+	virtual_server_t *vs = checker->vs;
+	long min = (vs->delay_loop_min) ? vs->delay_loop_min : vs->delay_loop;
+	long max = (vs->delay_loop_max) ? vs->delay_loop_max : vs->delay_loop;
+	long delay = (checker->delay) ? checker->delay : vs->delay_loop;
+
+	if (!checker->is_up)
+		delay *= vs->delay_failure_factor;
+	else if (checker->was_up)
+		delay *= vs->delay_success_factor;
+	checker->was_up = checker->is_up;
+
+	if (delay < min)
+		delay = min;
+	if (delay > max)
+		delay = max;
+
+	if (delay != checker->delay && checker->delay)
+		DBG("Check interval of %s now %ld ms.", FMT_CHK(checker)
+		    , delay / (TIMER_HZ / 1000));
+	checker->delay = delay;
+
+	/* Back to the slot, whatever the last probe lasted */
+	if (global_data->checker_phase_spread)
+		return checker_phase_timer(checker, 0, delay);
+	return delay;
+}
+
+/* Send a checker alert, from the main thread as well */
+void
+checker_alert(checker_t *checker, const char *subject, const char *body)
+{
+	int worker = checker->worker;
+
+	for (; checker; checker = checker->next_shared) {
+		if (worker >= 0)
+			checker_worker_post(CHECKER_MSG_ALERT, checker, 0, subject, body);
+		else
+			smtp_alert(checker->rs, NULL, NULL, subject, body);
+	}
+}
+
+/*
+ * Connect admission. Limiters exist only when a limit is set, index 0
+ * is the main thread and i + 1 the worker i. With workers, the main
+ * thread only runs MISC_CHECK, which never connects : it gets no share
+ * of the limits until a worker fails to start and hands its own over.
+ */
+static checker_limit_t *checker_limits;
+static int nlimits;
+static __thread checker_limit_t *checker_limit;
+
+/* Share of a global limit for each of n threads, rounded up */
+static long
+checker_limit_share(long limit, int n)
+{
+	return (limit + n - 1) / n;
+}
+
+void
+checker_limit_init(int nworkers)
+{
+	long rate = global_data->checker_connect_rate;
+	long burst = (global_data->checker_connect_burst) ?
+		     global_data->checker_connect_burst : rate;
+	int n = (nworkers) ? nworkers : 1;
+	checker_limit_t *limit;
+	int i;
+
+	if (!global_data->checker_max_inflight && !rate)
+		return;
+
+	nlimits = nworkers + 1;
+	checker_limits = (checker_limit_t *) MALLOC(nlimits * sizeof (checker_limit_t));
+	for (i = (nworkers) ? 1 : 0; i < nlimits; i++) {
+		limit = &checker_limits[i];
+		limit->max_inflight = checker_limit_share(global_data->checker_max_inflight, n);
+		limit->rate = checker_limit_share(rate, n);
+		limit->burst = checker_limit_share(burst, n);
+		limit->tokens = limit->burst * TIMER_HZ;
+	}
+	checker_limit_attach(master, 0);
+}
+
+/* The checkers of worker index run from the main thread, its share too */
+void
+checker_limit_handover(int index)
+{
+	checker_limit_t *main_limit, *limit;
+
+	if (!index || index >= nlimits)
+		return;
+
+	main_limit = &checker_limits[0];
+	limit = &checker_limits[index];
+	main_limit->max_inflight += limit->max_inflight;
+	main_limit->rate += limit->rate;
+	main_limit->burst += limit->burst;
+	main_limit->tokens += limit->tokens;
+	limit->max_inflight = limit->rate = limit->burst = limit->tokens = 0;
+}
+
+/* Make a limiter the one of the calling thread */
+void
+checker_limit_attach(thread_master_t *m, int index)
+{
+	if (index >= nlimits)
+		return;
+
+	checker_limit = &checker_limits[index];
+	checker_limit->master = m;
+	checker_limit->refill = timer_now();
+}
+
+/* Once the checker threads and their masters are gone */
+void
+checker_limit_destroy(void)
+{
+	int i;
+
+	for (i = 0; i < nlimits; i++)
+		FREE_PTR(checker_limits[i].wait);
+	FREE_PTR(checker_limits);
+	checker_limits = NULL;
+	checker_limit = NULL;
+	nlimits = 0;
+}
+
+static void
+checker_limit_refill(checker_limit_t *limit)
+{
+	long max = limit->burst * TIMER_HZ;
+	long elapsed;
+
+	if (!limit->rate)
+		return;
+
+	elapsed = timer_long(timer_sub(time_now, limit->refill));
+	if (elapsed <= 0)
+		return;
+	limit->refill = time_now;
+
+	if (elapsed < max / limit->rate)
+		limit->tokens += elapsed * limit->rate;
+	if (elapsed >= max / limit->rate || limit->tokens > max)
+		limit->tokens = max;
+}
+
+static int
+checker_limit_ready(checker_limit_t *limit)
+{
+	if (limit->max_inflight && limit->inflight >= limit->max_inflight)
+		return 0;
+	return !limit->rate || limit->tokens >= TIMER_HZ;
+}
+
+static void
+checker_limit_take(checker_limit_t *limit, checker_t *checker)
+{
+	checker->admitted = 1;
+	limit->inflight++;
+	if (limit->rate)
+		limit->tokens -= TIMER_HZ;
+	__atomic_add_fetch(&limit->admitted, 1, __ATOMIC_RELAXED);
+}
+
+/* Deferred connect threads, earliest deadline on top */
+static int
+checker_wait_less(checker_wait_t *a, checker_wait_t *b)
+{
+	return timer_cmp(a->deadline, b->deadline) < 0;
+}
+
+static void
+checker_wait_push(checker_limit_t *limit, checker_wait_t *w)
+{
+	checker_wait_t *wait;
+	int i, parent;
+
+	if (limit->depth == limit->size) {
+		limit->size = (limit->size) ? limit->size * 2 : 64;
+		limit->wait = (limit->wait) ?
+			      REALLOC(limit->wait, limit->size * sizeof (checker_wait_t)) :
+			      MALLOC(limit->size * sizeof (checker_wait_t));
+	}
+	wait = limit->wait;
+
+	for (i = limit->depth++; i; i = parent) {
+		parent = (i - 1) / 2;
+		if (!checker_wait_less(w, &wait[parent]))
+			break;
+		wait[i] = wait[parent];
+	}
+	wait[i] = *w;
+}
+
+static void
+checker_wait_pop(checker_limit_t *limit, checker_wait_t *w)
+{
+	checker_wait_t *wait = limit->wait;
+	checker_wait_t *last = &wait[--limit->depth];
+	int i = 0, child;
+
+	*w = wait[0];
+	while ((child = 2 * i + 1) < limit->depth) {
+		if (child + 1 < limit->depth &&
+		    checker_wait_less(&wait[child + 1], &wait[child]))
+			child++;
+		if (!checker_wait_less(&wait[child], last))
+			break;
+		wait[i] = wait[child];
+		i = child;
+	}
+	wait[i] = *last;
+}
+
+static int checker_limit_thread(thread_t *);
+
+/* Admit deferred connect threads as long as the limits allow */
+static void
+checker_limit_run(checker_limit_t *limit)
+{
+	checker_wait_t w;
+	long wait;
+
+	checker_limit_refill(limit);
+	while (limit->depth && checker_limit_ready(limit)) {
+		checker_wait_pop(limit, &w);
+		wait = timer_long(timer_sub(time_now, w.deadline));
+		__atomic_add_fetch(&limit->wait_total, wait, __ATOMIC_RELAXED);
+		if (wait > limit->wait_max)
+			__atomic_store_n(&limit->wait_max, wait, __ATOMIC_RELAXED);
+
+		/* Disabled meanwhile, it only re-arms its timer */
+		if (!CHECKER_ENABLED(w.checker)) {
+			thread_add_event(limit->master, w.func, w.checker, 0);
+			continue;
 		}
+		checker_limit_take(limit, w.checker);
+		thread_add_event(limit->master, w.func, w.checker, CHECKER_ADMITTED);
+	}
+
+	/* Out of tokens, releases wake us up for in flight ones */
+	if (limit->depth && limit->rate && limit->tokens < TIMER_HZ && !limit->timer)
+		limit->timer = thread_add_timer(limit->master, checker_limit_thread, limit,
+						(TIMER_HZ - limit->tokens + limit->rate - 1) /
+						limit->rate);
+}
+
+static int
+checker_limit_thread(thread_t *thread)
+{
+	checker_limit_t *limit = THREAD_ARG(thread);
+
+	limit->timer = NULL;
+	checker_limit_run(limit);
+	return 0;
+}
+
+/*
+ * Called by a connect thread before it opens its socket. Returns 0 when
+ * the connect is deferred, the thread is then called again once
+ * admitted. Deferred ones are admitted by deadline, the time their
+ * probe was due, so that no checker starves behind the others.
+ */
+int
+checker_admit(thread_t *thread)
+{
+	checker_limit_t *limit = checker_limit;
+	checker_wait_t w;
+
+	if (!limit || thread->u.val == CHECKER_ADMITTED)
+		return 1;
+
+	checker_limit_refill(limit);
+	if (!limit->depth && checker_limit_ready(limit)) {
+		checker_limit_take(limit, THREAD_ARG(thread));
+		return 1;
 	}
+
+	w.deadline = (timer_isnull(thread->sands)) ? time_now : thread->sands;
+	w.func = thread->func;
+	w.checker = THREAD_ARG(thread);
+	checker_wait_push(limit, &w);
+	__atomic_add_fetch(&limit->deferred, 1, __ATOMIC_RELAXED);
+	if (limit->depth > limit->depth_max)
+		__atomic_store_n(&limit->depth_max, limit->depth, __ATOMIC_RELAXED);
+
+	checker_limit_run(limit);
+	return 0;
+}
+
+/*
+ * The probe of a checker is over, whatever its result. Kept alive
+ * connections are idle until the next probe, they hold no slot.
+ */
+void
+checker_release(checker_t *checker)
+{
+	checker_limit_t *limit = checker_limit;
+
+	if (!checker->admitted)
+		return;
+	checker->admitted = 0;
+
+	if (!limit || !limit->inflight)
+		return;
+	limit->inflight--;
+	if (limit->depth)
+		checker_limit_run(limit);
+}
+
+void
+checker_limit_dump(void)
+{
+	unsigned long admitted = 0, deferred = 0, wait_total = 0;
+	long wait_max = 0, inflight = 0, max;
+	int depth = 0, depth_max = 0, i;
+	checker_limit_t *limit;
+
+	if (!nlimits)
+		return;
+
+	for (i = 0; i < nlimits; i++) {
+		limit = &checker_limits[i];
+		admitted += __atomic_load_n(&limit->admitted, __ATOMIC_RELAXED);
+		deferred += __atomic_load_n(&limit->deferred, __ATOMIC_RELAXED);
+		wait_total += __atomic_load_n(&limit->wait_total, __ATOMIC_RELAXED);
+		inflight += __atomic_load_n(&limit->inflight, __ATOMIC_RELAXED);
+		depth += __atomic_load_n(&limit->depth, __ATOMIC_RELAXED);
+		depth_max += __atomic_load_n(&limit->depth_max, __ATOMIC_RELAXED);
+		max = __atomic_load_n(&limit->wait_max, __ATOMIC_RELAXED);
+		if (max > wait_max)
+			wait_max = max;
+	}
+
+	/* Average over the deferred ones admitted since */
+	log_message(LOG_INFO, "Checker admission : %lu connects, %lu deferred"
+			      ", wait %.1f ms average, %ld ms max"
+			    , admitted, deferred
+			    , (deferred > depth) ?
+			      (double) wait_total / (deferred - depth) / 1000 : 0
+			    , wait_max / 1000);
+	log_message(LOG_INFO, "Checker admission : %ld in flight, %d queued"
+			      ", %d queued at most"
+			    , inflight, depth, depth_max);
 }
 
 /* Sync checkers activity with netlink kernel reflection */
@@ -27,6 +27,9 @@
 #include "check_data.h"
 #include "check_ssl.h"
 #include "check_api.h"
+#include "check_worker.h"
+#include "check_misc.h"
+#include "layer4.h"
 #include "global_data.h"
 #include "ipwrapper.h"
 #include "ipvswrapper.h"
@@ -52,7 +55,13 @@ stop_check(void)
 {
 	/* Destroy master thread */
 	signal_handler_destroy();
+	checker_workers_stop();
+	misc_exec_unregister();
 	thread_destroy_master(master);
+	checker_limit_destroy();
+	if (debug & 4)
+		thread_pool_dump();
+	thread_pool_destroy();
 	free_checkers_queue();
 	free_ssl();
 	if (!(debug & 16))
@@ -145,8 +154,13 @@ start_check(void)
 	init_interface_linkbeat();
 #endif
 
+	/* Batch size between two scheduler polls, timers coalescing */
+	thread_set_budget(master, global_data->sched_budget);
+	thread_set_slack(master, global_data->checker_timer_slack);
+
 	/* Register checkers thread */
 	register_checkers_thread();
+	misc_exec_register();
 }
 
 /* Reload handler */
@@ -165,6 +179,17 @@ sigend_check(void *v, int sig)
 		thread_add_terminate_event(master);
 }
 
+/* Scheduler and SSL statistics */
+static void
+sigusr1_check(void *v, int sig)
+{
+	thread_stats_handler(v, sig);
+	ssl_stats_dump();
+	checker_syscalls_dump();
+	checker_limit_dump();
+	checker_workers_dump();
+}
+
 /* CHECK Child signal handling */
 void
 check_signal_init(void)
@@ -173,6 +198,7 @@ check_signal_init(void)
 	signal_set(SIGHUP, sighup_check, NULL);
 	signal_set(SIGINT, sigend_check, NULL);
 	signal_set(SIGTERM, sigend_check, NULL);
+	signal_set(SIGUSR1, sigusr1_check, NULL);
 	signal_ignore(SIGPIPE);
 }
 
@@ -193,7 +219,10 @@ reload_check_thread(thread_t * thread)
 #ifdef _WITH_VRRP_
 	kernel_netlink_close();
 #endif
+	checker_workers_stop();
+	misc_exec_unregister();
 	thread_destroy_master(master);
+	checker_limit_destroy();
 	master = thread_make_master();
 	free_global_data(global_data);
 	free_checkers_queue();
@@ -303,6 +332,9 @@ start_check_child(void)
 	 */
 	UNSET_RELOAD;
 
+	/* MISC_CHECK scripts executor, forked while we are still small */
+	misc_exec_start();
+
 	/* Signal handling initialization */
 	check_signal_init();
 
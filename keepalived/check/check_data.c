@@ -37,6 +37,7 @@ ssl_data_t *
 alloc_ssl(void)
 {
 	ssl_data_t *ssl = (ssl_data_t *) MALLOC(sizeof(ssl_data_t));
+	ssl->session_ttl = SSL_SESSION_TTL;
 	return ssl;
 }
 void
@@ -65,6 +66,7 @@ dump_ssl(void)
 		log_message(LOG_INFO, " Certificate file : %s", ssl->certfile);
 	if (ssl->keyfile)
 		log_message(LOG_INFO, " Key file : %s", ssl->keyfile);
+	log_message(LOG_INFO, " Session TTL : %lu", ssl->session_ttl / TIMER_HZ);
 	if (!ssl->password && !ssl->cafile && !ssl->certfile && !ssl->keyfile)
 		log_message(LOG_INFO, " Using autogen SSL context");
 }
@@ -179,6 +181,11 @@ dump_vs(void *data)
 	       (vs->delay_loop >= TIMER_MAX_SEC) ? vs->delay_loop/TIMER_HZ :
 						   vs->delay_loop,
 	       vs->sched);
+	if (vs->delay_loop_min || vs->delay_loop_max)
+		log_message(LOG_INFO, "   adaptive delay = %lu-%lu, factors = %.2f/%.2f",
+		       (vs->delay_loop_min ? vs->delay_loop_min : vs->delay_loop)/TIMER_HZ,
+		       (vs->delay_loop_max ? vs->delay_loop_max : vs->delay_loop)/TIMER_HZ,
+		       vs->delay_success_factor, vs->delay_failure_factor);
 	if (atoi(vs->timeout_persistence) > 0)
 		log_message(LOG_INFO, "   persistence timeout = %s",
 		       vs->timeout_persistence);
@@ -239,6 +246,8 @@ alloc_vs(char *ip, char *port)
 	}
 
 	new->delay_loop = KEEPALIVED_DEFAULT_DELAY;
+	new->delay_success_factor = KEEPALIVED_DEFAULT_SUCCESS_FACTOR;
+	new->delay_failure_factor = KEEPALIVED_DEFAULT_FAILURE_FACTOR;
 	strncpy(new->timeout_persistence, "0", 1);
 	new->virtualhost = NULL;
 	new->alpha = 0;
@@ -360,7 +369,7 @@ char *
 format_vs (virtual_server_t *vs)
 {
 	/* alloc large buffer because of unknown length of vs->vsgname */
-	static char ret[512];
+	static __thread char ret[512];
 
 	if (vs->vsgname)
 		snprintf (ret, sizeof (ret) - 1, "[%s]:%d"
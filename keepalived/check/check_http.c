@@ -21,6 +21,7 @@
  * Copyright (C) 2001-2012 Alexandre Cassen, <acassen@gmail.com>
  */
 
+#include <ctype.h>
 #include <openssl/err.h>
 #include "check_http.h"
 #include "check_ssl.h"
@@ -32,6 +33,7 @@
 #include "html.h"
 
 int http_connect_thread(thread_t *);
+int http_read_thread(thread_t *);
 
 /* Configuration stream handling */
 void
@@ -39,7 +41,15 @@ free_url(void *data)
 {
 	url_t *url = data;
 	FREE(url->path);
+	FREE_PTR(url->request);
 	FREE(url->digest);
+	FREE_PTR(url->expect);
+	FREE_PTR(url->expect_next);
+	FREE_PTR(url->expect_regex);
+	if (url->regex) {
+		regfree(url->regex);
+		FREE(url->regex);
+	}
 	FREE(url);
 }
 
@@ -51,15 +61,35 @@ dump_url(void *data)
 	if (url->digest)
 		log_message(LOG_INFO, "           digest = %s",
 		       url->digest);
+	if (url->crc32_set)
+		log_message(LOG_INFO, "           crc32 = %08x", url->crc32);
+	if (url->expect)
+		log_message(LOG_INFO, "           expect = %s", url->expect);
+	if (url->expect_regex)
+		log_message(LOG_INFO, "           expect regex = %s",
+		       url->expect_regex);
 	if (url->status_code)
 		log_message(LOG_INFO, "           HTTP Status Code = %d",
 		       url->status_code);
+	if (url->status_only)
+		log_message(LOG_INFO, "           Status only = yes");
 }
 
 void
 free_http_get_check(void *data)
 {
 	http_checker_t *http_get_chk = CHECKER_DATA(data);
+	http_t *http = HTTP_ARG(http_get_chk);
+
+	/* Kept connection */
+	if (http->connected) {
+		if (http->ssl)
+			SSL_free(http->ssl);
+		CHECKER_CLOSE(http->fd);
+	}
+	ssl_session_flush(http);
+	FREE_PTR(http->buffer);
+	FREE_PTR(http->regex_line);
 
 	free_list(http_get_chk->url);
 	FREE(http_get_chk->arg);
@@ -81,8 +111,45 @@ dump_http_get_check(void *data)
 	log_message(LOG_INFO, "   Nb get retry = %d", http_get_chk->nb_get_retry);
 	log_message(LOG_INFO, "   Delay before retry = %lu",
 	       http_get_chk->delay_before_retry/TIMER_HZ);
+	if (http_get_chk->keepalive)
+		log_message(LOG_INFO, "   HTTP keepalive = yes");
 	dump_list(http_get_chk->url);
 }
+
+/* Same requests checked the same way, probes can be shared */
+static int
+compare_http_get_check(checker_t *a, checker_t *b)
+{
+	http_checker_t *http_a = CHECKER_ARG(a);
+	http_checker_t *http_b = CHECKER_ARG(b);
+	element e_a, e_b;
+	url_t *url_a, *url_b;
+
+	/* The Host header comes from the virtual server */
+	if (http_a->proto != http_b->proto ||
+	    http_a->nb_get_retry != http_b->nb_get_retry ||
+	    http_a->delay_before_retry != http_b->delay_before_retry ||
+	    http_a->keepalive != http_b->keepalive ||
+	    !string_equal(CHECKER_VHOST(a), CHECKER_VHOST(b)))
+		return 0;
+
+	for (e_a = LIST_HEAD(http_a->url), e_b = LIST_HEAD(http_b->url);
+	     e_a && e_b; ELEMENT_NEXT(e_a), ELEMENT_NEXT(e_b)) {
+		url_a = ELEMENT_DATA(e_a);
+		url_b = ELEMENT_DATA(e_b);
+		if (!string_equal(url_a->path, url_b->path) ||
+		    !string_equal(url_a->digest, url_b->digest) ||
+		    url_a->status_code != url_b->status_code ||
+		    url_a->status_only != url_b->status_only ||
+		    url_a->crc32_set != url_b->crc32_set ||
+		    url_a->crc32 != url_b->crc32 ||
+		    !string_equal(url_a->expect, url_b->expect) ||
+		    !string_equal(url_a->expect_regex, url_b->expect_regex))
+			return 0;
+	}
+
+	return !e_a && !e_b;
+}
 static http_checker_t *
 alloc_http_get(char *proto)
 {
@@ -108,7 +175,8 @@ http_get_handler(vector_t *strvec)
 	/* queue new checker */
 	http_get_chk = alloc_http_get(str);
 	queue_checker(free_http_get_check, dump_http_get_check,
-		      http_connect_thread, http_get_chk, CHECKER_NEW_CO());
+		      http_connect_thread, compare_http_get_check,
+		      http_get_chk, CHECKER_NEW_CO());
 }
 
 void
@@ -125,6 +193,13 @@ delay_before_retry_handler(vector_t *strvec)
 	http_get_chk->delay_before_retry = CHECKER_VALUE_INT(strvec) * TIMER_HZ;
 }
 
+void
+http_keepalive_handler(vector_t *strvec)
+{
+	http_checker_t *http_get_chk = CHECKER_GET();
+	http_get_chk->keepalive = 1;
+}
+
 void
 url_handler(vector_t *strvec)
 {
@@ -146,13 +221,109 @@ path_handler(vector_t *strvec)
 	url->path = CHECKER_VALUE_STRING(strvec);
 }
 
+static int
+hex_value(int c)
+{
+	return isdigit(c) ? c - '0' : tolower(c) - 'a' + 10;
+}
+
 void
 digest_handler(vector_t *strvec)
 {
 	http_checker_t *http_get_chk = CHECKER_GET();
 	url_t *url = LIST_TAIL_DATA(http_get_chk->url);
+	char *str = vector_slot(strvec, 1);
+	int i;
 
 	url->digest = CHECKER_VALUE_STRING(strvec);
+
+	/* Compared binary, no formatting per check */
+	for (i = 0; i < 2 * MD5_DIGEST_LENGTH; i++)
+		if (!isxdigit(str[i]))
+			break;
+	if (i != 2 * MD5_DIGEST_LENGTH || str[i]) {
+		log_message(LOG_INFO, "Invalid MD5 digest %s, can never match", str);
+		return;
+	}
+	for (i = 0; i < MD5_DIGEST_LENGTH; i++)
+		url->digest_bin[i] = hex_value(str[2 * i]) << 4 |
+				     hex_value(str[2 * i + 1]);
+}
+
+void
+crc32_handler(vector_t *strvec)
+{
+	http_checker_t *http_get_chk = CHECKER_GET();
+	url_t *url = LIST_TAIL_DATA(http_get_chk->url);
+	char *str = vector_slot(strvec, 1);
+	char *end;
+	unsigned long crc;
+
+	crc = strtoul(str, &end, 16);
+	if (!*str || *end || crc > 0xffffffffUL) {
+		log_message(LOG_INFO, "Invalid CRC32 %s, ignoring", str);
+		return;
+	}
+	url->crc32 = crc;
+	url->crc32_set = 1;
+}
+
+void
+expect_handler(vector_t *strvec)
+{
+	http_checker_t *http_get_chk = CHECKER_GET();
+	url_t *url = LIST_TAIL_DATA(http_get_chk->url);
+	char *str = CHECKER_VALUE_STRING(strvec);
+	int i, k = 0;
+
+	if (!*str) {
+		FREE(str);
+		return;
+	}
+
+	/* KMP failure table, body is searched in a single pass */
+	url->expect = str;
+	url->expect_len = strlen(str);
+	url->expect_next = (int *) MALLOC(url->expect_len * sizeof (int));
+	for (i = 1; i < url->expect_len; i++) {
+		while (k && str[i] != str[k])
+			k = url->expect_next[k - 1];
+		if (str[i] == str[k])
+			k++;
+		url->expect_next[i] = k;
+	}
+}
+
+void
+expect_regex_handler(vector_t *strvec)
+{
+	http_checker_t *http_get_chk = CHECKER_GET();
+	url_t *url = LIST_TAIL_DATA(http_get_chk->url);
+	char *str = CHECKER_VALUE_STRING(strvec);
+	char errbuf[128];
+	int ret;
+
+	url->regex = (regex_t *) MALLOC(sizeof (regex_t));
+	ret = regcomp(url->regex, str, REG_EXTENDED | REG_NOSUB | REG_NEWLINE);
+	if (ret) {
+		regerror(ret, url->regex, errbuf, sizeof (errbuf));
+		log_message(LOG_INFO, "Invalid expect_regex %s : %s, ignoring",
+		       str, errbuf);
+		FREE(url->regex);
+		url->regex = NULL;
+		FREE(str);
+		return;
+	}
+	url->expect_regex = str;
+}
+
+void
+status_only_handler(vector_t *strvec)
+{
+	http_checker_t *http_get_chk = CHECKER_GET();
+	url_t *url = LIST_TAIL_DATA(http_get_chk->url);
+
+	url->status_only = 1;
 }
 
 void
@@ -173,11 +344,16 @@ install_http_check_keyword(void)
 	install_keyword("warmup", &warmup_handler);
 	install_keyword("nb_get_retry", &nb_get_retry_handler);
 	install_keyword("delay_before_retry", &delay_before_retry_handler);
+	install_keyword("http_keepalive", &http_keepalive_handler);
 	install_keyword("url", &url_handler);
 	install_sublevel();
 	install_keyword("path", &path_handler);
 	install_keyword("digest", &digest_handler);
+	install_keyword("crc32", &crc32_handler);
+	install_keyword("expect", &expect_handler);
+	install_keyword("expect_regex", &expect_regex_handler);
 	install_keyword("status_code", &status_code_handler);
+	install_keyword("status_only", &status_only_handler);
 	install_sublevel_end();
 	install_sublevel_end();
 }
@@ -192,11 +368,16 @@ install_ssl_check_keyword(void)
 	install_keyword("warmup", &warmup_handler);
 	install_keyword("nb_get_retry", &nb_get_retry_handler);
 	install_keyword("delay_before_retry", &delay_before_retry_handler);
+	install_keyword("http_keepalive", &http_keepalive_handler);
 	install_keyword("url", &url_handler);
 	install_sublevel();
 	install_keyword("path", &path_handler);
 	install_keyword("digest", &digest_handler);
+	install_keyword("crc32", &crc32_handler);
+	install_keyword("expect", &expect_handler);
+	install_keyword("expect_regex", &expect_regex_handler);
 	install_keyword("status_code", &status_code_handler);
+	install_keyword("status_only", &status_only_handler);
 	install_sublevel_end();
 	install_sublevel_end();
 }
@@ -256,17 +437,15 @@ epilog(thread_t * thread, int method, int t, int c)
 	 * servers.
 	 */
 	if (http->retry_it > http_get_check->nb_get_retry-1) {
-		if (svr_checker_up(checker->id, checker->rs)) {
+		if (CHECKER_IS_UP(checker)) {
 			log_message(LOG_INFO, "Check on service %s failed after %d retry."
 			       , FMT_HTTP_RS(checker)
 			       , http->retry_it);
-			smtp_alert(checker->rs, NULL, NULL,
-				   "DOWN",
-				   "=> CHECK failed on service"
-				   " : MD5 digest mismatch <=");
-			update_svr_checker_state(DOWN, checker->id
-						     , checker->vs
-						     , checker->rs);
+			checker_alert(checker,
+				      "DOWN",
+				      "=> CHECK failed on service"
+				      " : MD5 digest mismatch <=");
+			checker_update_state(checker, DOWN);
 		}
 
 		/* Reset it counters */
@@ -277,15 +456,19 @@ epilog(thread_t * thread, int method, int t, int c)
 	/* register next timer thread */
 	switch (method) {
 	case 1:
-		if (req)
-			delay = checker->vs->delay_loop;
+		/* The interval only adapts once all urls are checked */
+		if (req && http->url_it == 0)
+			delay = checker_delay(checker);
+		else if (req)
+			delay = (checker->delay) ? checker->delay :
+						   checker->vs->delay_loop;
 		else
 			delay =
 			    http_get_check->delay_before_retry;
 		break;
 	case 2:
 		if (http->url_it == 0 && http->retry_it == 0)
-			delay = checker->vs->delay_loop;
+			delay = checker_delay(checker);
 		else
 			delay = http_get_check->delay_before_retry;
 		break;
@@ -293,16 +476,21 @@ epilog(thread_t * thread, int method, int t, int c)
 
 	/* If req == NULL, fd is not created */
 	if (req) {
-		if (req->ssl)
-			SSL_free(req->ssl);
-		if (req->buffer)
-			FREE(req->buffer);
-		FREE(req);
+		if (HTTP_PARSE_REUSABLE(&req->parser)) {
+			/* Keep the connection for next request */
+			http->connected = 1;
+			http->fd = thread->u.fd;
+			http->ssl = req->ssl;
+		} else {
+			if (req->ssl)
+				ssl_release(http, req->ssl);
+			CHECKER_CLOSE(thread->u.fd);
+		}
 		http->req = NULL;
-		close(thread->u.fd);
 	}
 
 	/* Register next checker thread */
+	checker_release(checker);
 	thread_add_timer(thread->master, http_connect_thread, checker, delay);
 	return 0;
 }
@@ -317,17 +505,52 @@ timeout_epilog(thread_t * thread, char *smtp_msg, char *debug_msg)
 			    , FMT_HTTP_RS(checker));
 
 	/* check if server is currently alive */
-	if (svr_checker_up(checker->id, checker->rs)) {
-		smtp_alert(checker->rs, NULL, NULL,
-			   "DOWN", smtp_msg);
-		update_svr_checker_state(DOWN, checker->id
-					     , checker->vs
-					     , checker->rs);
+	if (CHECKER_IS_UP(checker)) {
+		checker_alert(checker,
+			      "DOWN", smtp_msg);
+		checker_update_state(checker, DOWN);
 	}
 
 	return epilog(thread, 1, 0, 0);
 }
 
+/*
+ * A kept connection was closed by the server before it answered.
+ * That is not a failure, connect again right now.
+ */
+int
+http_reconnect(thread_t * thread)
+{
+	checker_t *checker = THREAD_ARG(thread);
+	http_checker_t *http_get_check = CHECKER_ARG(checker);
+	http_t *http = HTTP_ARG(http_get_check);
+	request_t *req = HTTP_REQ(http);
+
+	DBG("Kept connection to %s closed, reconnecting.", FMT_HTTP_RS(checker));
+
+	if (req->ssl)
+		ssl_release(http, req->ssl);
+	http->req = NULL;
+	CHECKER_CLOSE(thread->u.fd);
+	checker_release(checker);
+
+	thread_add_event(thread->master, http_connect_thread, checker, 0);
+	return 0;
+}
+
+/* Start a request, in the storage of the checker */
+static request_t *
+http_request_init(http_checker_t * http_get_check)
+{
+	http_t *http = HTTP_ARG(http_get_check);
+	request_t *req = &http->request;
+
+	memset(req, 0, sizeof (request_t));
+	req->framed = http_get_check->keepalive;
+	http->req = req;
+	return req;
+}
+
 /* return the url pointer of the current url iterator  */
 url_t *
 fetch_next_url(http_checker_t * http_get_check)
@@ -337,23 +560,56 @@ fetch_next_url(http_checker_t * http_get_check)
 	return list_element(http_get_check->url, http->url_it);
 }
 
+/* A body or status check failed on the current url */
+static int
+http_check_failed(thread_t * thread, const char *what, const char *label,
+		  const char *value, const char *mismatch)
+{
+	checker_t *checker = THREAD_ARG(thread);
+	http_checker_t *http_get_check = CHECKER_ARG(checker);
+	http_t *http = HTTP_ARG(http_get_check);
+	url_t *fetched_url = fetch_next_url(http_get_check);
+	char alert[64];
+
+	/* check if server is currently alive */
+	if (CHECKER_IS_UP(checker)) {
+		log_message(LOG_INFO, "%s error to %s url[%s], %s [%s]."
+				    , what
+				    , FMT_HTTP_RS(checker)
+				    , fetched_url->path
+				    , label, value);
+		snprintf(alert, sizeof (alert), "=> CHECK failed on service"
+			 " : HTTP %s mismatch <=", mismatch);
+		checker_alert(checker, "DOWN", alert);
+		checker_update_state(checker, DOWN);
+	} else {
+		DBG("%s to %s url(%d) = [%s]."
+		    , label
+		    , FMT_HTTP_RS(checker)
+		    , http->url_it + 1
+		    , value);
+		/*
+		 * We set retry iterator to max value to not retry
+		 * when service is already know as die.
+		 */
+		http->retry_it = http_get_check->nb_get_retry;
+	}
+	return epilog(thread, 2, 0, 1);
+}
+
 /* Handle response */
 int
-http_handle_response(thread_t * thread, unsigned char digest[16]
-		     , int empty_buffer)
+http_handle_response(thread_t * thread, int empty_buffer)
 {
 	checker_t *checker = THREAD_ARG(thread);
 	http_checker_t *http_get_check = CHECKER_ARG(checker);
 	http_t *http = HTTP_ARG(http_get_check);
 	request_t *req = HTTP_REQ(http);
-	int r, di = 0;
-	char *digest_tmp;
 	url_t *fetched_url = fetch_next_url(http_get_check);
-	enum {
-		none,
-		on_status,
-		on_digest
-	} last_success = none; /* the source of last considered success */
+	unsigned char digest[MD5_DIGEST_LENGTH];
+	char value[MD5_BUFFER_LENGTH + 1];
+	const char *last_success = NULL; /* the source of last considered success */
+	int di;
 
 	/* First check if remote webserver returned data */
 	if (empty_buffer)
@@ -363,131 +619,180 @@ http_handle_response(thread_t * thread, unsigned char digest[16]
 
 	/* Next check the HTTP status code */
 	if (fetched_url->status_code) {
-		if (req->status_code != fetched_url->status_code) {
-			/* check if server is currently alive */
-			if (svr_checker_up(checker->id, checker->rs)) {
-				log_message(LOG_INFO,
-				       "HTTP status code error to %s url(%s)"
-				       ", status_code [%d].",
-				       FMT_HTTP_RS(checker),
-				       fetched_url->path,
-				       req->status_code);
-				smtp_alert(checker->rs, NULL, NULL,
-					   "DOWN",
-					   "=> CHECK failed on service"
-					   " : HTTP status code mismatch <=");
-				update_svr_checker_state(DOWN, checker->id
-							     , checker->vs
-							     , checker->rs);
-			} else {
-				DBG("HTTP Status_code to %s url(%d) = [%d]."
-				    , FMT_HTTP_RS(checker)
-				    , http->url_it + 1
-				    , req->status_code);
-				/*
-				 * We set retry iterator to max value to not retry
-				 * when service is already know as die.
-				 */
-				http->retry_it = http_get_check->nb_get_retry;
-			}
-			return epilog(thread, 2, 0, 1);
-		} else {
-			last_success = on_status;
+		if (req->parser.status_code != fetched_url->status_code) {
+			snprintf(value, sizeof (value), "%d", req->parser.status_code);
+			return http_check_failed(thread, "HTTP status code",
+						 "status_code", value, "status code");
 		}
+		last_success = "HTTP status code";
 	}
 
-	/* Continue with MD5SUM */
+	/* Continue with MD5SUM, binary compared */
 	if (fetched_url->digest) {
-		/* Compute MD5SUM */
-		digest_tmp = (char *) MALLOC(MD5_BUFFER_LENGTH + 1);
-		for (di = 0; di < 16; di++)
-			sprintf(digest_tmp + 2 * di, "%02x", digest[di]);
-
-		r = strcmp(fetched_url->digest, digest_tmp);
-
-		if (r) {
-			/* check if server is currently alive */
-			if (svr_checker_up(checker->id, checker->rs)) {
-				log_message(LOG_INFO,
-				       "MD5 digest error to %s url[%s]"
-				       ", MD5SUM [%s].",
-				       FMT_HTTP_RS(checker),
-				       fetched_url->path,
-				       digest_tmp);
-				smtp_alert(checker->rs, NULL, NULL,
-					   "DOWN",
-					   "=> CHECK failed on service"
-					   " : HTTP MD5SUM mismatch <=");
-				update_svr_checker_state(DOWN, checker->id
-							     , checker->vs
-							     , checker->rs);
-			} else {
-				DBG("MD5SUM to %s url(%d) = [%s]."
-				    , FMT_HTTP_RS(checker)
-				    , http->url_it + 1
-				    , digest_tmp);
-				/*
-				 * We set retry iterator to max value to not retry
-				 * when service is already know as die.
-				 */
-				http->retry_it = http_get_check->nb_get_retry;
-			}
-			FREE(digest_tmp);
-			return epilog(thread, 2, 0, 1);
-		} else {
-			last_success = on_digest;
-			FREE(digest_tmp);
+		MD5_Final(digest, &req->context);
+		if (memcmp(digest, fetched_url->digest_bin, MD5_DIGEST_LENGTH)) {
+			for (di = 0; di < MD5_DIGEST_LENGTH; di++)
+				sprintf(value + 2 * di, "%02x", digest[di]);
+			return http_check_failed(thread, "MD5 digest", "MD5SUM",
+						 value, "MD5SUM");
 		}
+		last_success = "MD5 digest";
 	}
 
-	if (!svr_checker_up(checker->id, checker->rs)) {
-		switch (last_success) {
-			case none:
-				break;
-			case on_status:
-				log_message(LOG_INFO,
-				       "HTTP status code success to %s url(%d)."
-				       , FMT_HTTP_RS(checker)
-				       , http->url_it + 1);
-				return epilog(thread, 1, 1, 0) + 1;
-			case on_digest:
-				if (!svr_checker_up(checker->id, checker->rs))
-					log_message(LOG_INFO, "MD5 digest success to %s url(%d)."
-						   , FMT_HTTP_RS(checker)
-						   , http->url_it + 1);
-				return epilog(thread, 1, 1, 0) + 1;
+	if (fetched_url->crc32_set) {
+		if (req->crc != fetched_url->crc32) {
+			snprintf(value, sizeof (value), "%08x", req->crc);
+			return http_check_failed(thread, "CRC32", "CRC32", value,
+						 "CRC32");
 		}
+		last_success = "CRC32";
+	}
+
+	/* Body without final newline, its last line is still kept */
+	if (fetched_url->regex && !req->regex_matched && req->regex_len) {
+		req->regex_line[req->regex_len] = 0;
+		req->regex_matched = !regexec(fetched_url->regex, req->regex_line,
+					      0, NULL, 0);
+	}
+
+	if ((fetched_url->expect && !req->expect_matched) ||
+	    (fetched_url->regex && !req->regex_matched))
+		return http_check_failed(thread, "Body", "expect",
+					 (fetched_url->expect && !req->expect_matched) ?
+					 fetched_url->expect : fetched_url->expect_regex,
+					 "body");
+	if (fetched_url->expect || fetched_url->regex)
+		last_success = "Body expect";
+
+	if (!CHECKER_IS_UP(checker) && last_success) {
+		log_message(LOG_INFO, "%s success to %s url(%d)."
+				    , last_success
+				    , FMT_HTTP_RS(checker)
+				    , http->url_it + 1);
+		return epilog(thread, 1, 1, 0) + 1;
 	}
 
 	return epilog(thread, 1, 0, 0) + 1;
 }
 
-/* Handle response stream performing MD5 updates */
-int
-http_process_response(request_t *req, int r)
+/* Search the expect string, state kept across reads */
+static void
+http_expect_data(request_t *req, url_t *url, char *buf, int len)
 {
-	req->len += r;
-	if (!req->extracted) {
-		if ((req->extracted =
-		     extract_html(req->buffer, req->len))) {
-			req->status_code = extract_status_code(req->buffer, req->len);
-			r = req->len - (req->extracted - req->buffer);
-			if (r) {
-				memmove(req->buffer, req->extracted, r);
-				MD5_Update(&req->context, req->buffer, r);
-				r = 0;
-			}
-			req->len = r;
+	char *p;
+	int i, k = req->expect_pos;
+
+	for (i = 0; i < len; i++) {
+		/* Nothing matched yet, skip to the first byte */
+		if (!k) {
+			if (!(p = memchr(buf + i, url->expect[0], len - i)))
+				break;
+			i = p - buf;
+		}
+		while (k && buf[i] != url->expect[k])
+			k = url->expect_next[k - 1];
+		if (buf[i] == url->expect[k] && ++k == url->expect_len) {
+			req->expect_matched = 1;
+			return;
 		}
-	} else if (req->len) {
-		MD5_Update(&req->context, req->buffer,
-			   req->len);
-		req->len = 0;
 	}
+	req->expect_pos = k;
+}
 
+/*
+ * Match the regex line by line, as grep. Complete lines are matched
+ * in place, a line cut by the read is kept (up to MAX_BUFFER_LENGTH)
+ * until its end comes.
+ */
+static void
+http_regex_data(request_t *req, url_t *url, char *buf, int len)
+{
+	char *eol;
+	int n;
+
+	while (len > 0 && !req->regex_matched) {
+		eol = memchr(buf, '\n', len);
+		n = (eol) ? eol - buf : len;
+		if (req->regex_len || !eol) {
+			if (n > MAX_BUFFER_LENGTH - req->regex_len)
+				n = MAX_BUFFER_LENGTH - req->regex_len;
+			memcpy(req->regex_line + req->regex_len, buf, n);
+			req->regex_len += n;
+			if (!eol)
+				return;
+			req->regex_line[req->regex_len] = 0;
+			req->regex_matched = !regexec(url->regex, req->regex_line,
+						      0, NULL, 0);
+			req->regex_len = 0;
+			n = eol - buf;
+		} else {
+			*eol = 0;
+			req->regex_matched = !regexec(url->regex, buf, 0, NULL, 0);
+			*eol = '\n';
+		}
+		buf += n + 1;
+		len -= n + 1;
+	}
+}
+
+/*
+ * Body bytes from the response parser, in place in the read buffer.
+ * Checks them against what the url asks for.
+ */
+static int
+http_body_data(void *arg, char *buf, int len)
+{
+	request_t *req = arg;
+	url_t *url = req->url;
+
+	if (url->digest)
+		MD5_Update(&req->context, buf, len);
+	if (url->crc32_set)
+		req->crc = crc32_update(req->crc, buf, len);
+	if (url->expect && !req->expect_matched)
+		http_expect_data(req, url, buf, len);
+	if (url->regex && !req->regex_matched)
+		http_regex_data(req, url, buf, len);
+
+	/* Only matching and all matched, the rest needs no reading */
+	if (!url->digest && !url->crc32_set && (url->expect || url->regex) &&
+	    (!url->expect || req->expect_matched) &&
+	    (!url->regex || req->regex_matched))
+		req->stop = 1;
+
+	return req->stop;
+}
+
+/* Handle response stream performing body checks */
+int
+http_process_response(request_t *req, int r)
+{
+	http_parse(&req->parser, req->buffer, r, http_body_data, req);
+
+	/* Complete, or decided before its end */
+	req->done = req->stop || req->parser.state == HTTP_PARSE_DONE;
 	return 0;
 }
 
+/*
+ * Register the HTTP stream reader. With io_uring the kernel receives
+ * straight into the request buffer, no readiness round trip.
+ */
+static void
+http_read_register(thread_t * thread, checker_t * checker, long timeout)
+{
+	http_checker_t *http_get_check = CHECKER_ARG(checker);
+	request_t *req = HTTP_REQ(HTTP_ARG(http_get_check));
+
+	if (thread_add_recv(thread->master, http_read_thread, checker,
+			    thread->u.fd, req->buffer, MAX_BUFFER_LENGTH,
+			    timeout))
+		return;
+
+	thread_add_read(thread->master, http_read_thread, checker,
+			thread->u.fd, timeout);
+}
+
 /* Asynchronous HTTP stream reader */
 int
 http_read_thread(thread_t * thread)
@@ -497,74 +802,77 @@ http_read_thread(thread_t * thread)
 	http_t *http = HTTP_ARG(http_get_check);
 	request_t *req = HTTP_REQ(http);
 	unsigned timeout = checker->co->connection_to;
-	unsigned char digest[16];
 	int r = 0;
-	int val;
+	int n;
 
 	/* Handle read timeout */
 	if (thread->type == THREAD_READ_TIMEOUT)
 		return timeout_epilog(thread, "=> HTTP CHECK failed on service"
 				      " : recevice data <=\n\n", "HTTP read");
 
-	/* Set descriptor non blocking */
-	val = fcntl(thread->u.fd, F_GETFL, 0);
-	fcntl(thread->u.fd, F_SETFL, val | O_NONBLOCK);
-
-	/* read the HTTP stream */
-	r = read(thread->u.fd, req->buffer + req->len,
-		 MAX_BUFFER_LENGTH - req->len);
-
-	/* restore descriptor flags */
-	fcntl(thread->u.fd, F_SETFL, val);
-
-	/* Test if data are ready */
-	if (r == -1 && (errno == EAGAIN || errno == EINTR)) {
-		log_message(LOG_INFO, "Read error with server %s: %s"
-				    , FMT_HTTP_RS(checker)
-				    , strerror(errno));
-		thread_add_read(thread->master, http_read_thread, checker,
-				thread->u.fd, timeout);
-		return 0;
-	}
+	/*
+	 * Drain the stream while it is ready. A short read means the
+	 * socket is empty, waiting for readiness then saves the read
+	 * that would only return EAGAIN. The batch is bounded so a
+	 * fast server can't starve the other checkers.
+	 */
+	for (n = 0; n < HTTP_READ_BATCH; n++) {
+		if (!n && thread->type == THREAD_IO_DONE) {
+			/* io_uring already received into the buffer */
+			r = THREAD_IO_RESULT(thread);
+			if (r < 0) {
+				errno = -r;
+				r = -1;
+			}
+		} else {
+			CHECKER_SYSCALL(READ);
+			r = read(thread->u.fd, req->buffer, MAX_BUFFER_LENGTH);
+		}
 
-	if (r == -1 || r == 0) {	/* -1:error , 0:EOF */
+		if (r <= 0)
+			break;
 
-		/* All the HTTP stream has been parsed */
-		MD5_Final(digest, &req->context);
+		/* Handle response stream */
+		http_process_response(req, r);
 
-		if (r == -1) {
-			/* We have encourred a real read error */
-			if (svr_checker_up(checker->id, checker->rs)) {
-				log_message(LOG_INFO, "Read error with server %s: %s"
-				       , FMT_HTTP_RS(checker)
-				       , strerror(errno));
-				smtp_alert(checker->rs, NULL, NULL,
-					   "DOWN",
-					   "=> HTTP CHECK failed on service"
-					   " : cannot receive data <=");
-				update_svr_checker_state(DOWN, checker->id
-							     , checker->vs
-							     , checker->rs);
-			}
-			return epilog(thread, 1, 0, 0);
+		/* Response complete or checked, don't wait for the close */
+		if (req->done) {
+			http_handle_response(thread, 0);
+			return 0;
 		}
 
-		/* Handle response stream */
-		http_handle_response(thread, digest, (!req->extracted) ? 1 : 0);
+		if (r < MAX_BUFFER_LENGTH)
+			break;
+	}
 
-	} else {
+	/* Wait for more data */
+	if (r > 0 || (r == -1 && (errno == EAGAIN || errno == EINTR))) {
+		http_read_register(thread, checker, timeout);
+		return 0;
+	}
 
-		/* Handle response stream */
-		http_process_response(req, r);
+	/* Kept connection closed meanwhile by the server */
+	if (req->reused && !HTTP_PARSE_STARTED(&req->parser))
+		return http_reconnect(thread);
 
-		/*
-		 * Register next http stream reader.
-		 * Register itself to not perturbe global I/O multiplexer.
-		 */
-		thread_add_read(thread->master, http_read_thread, checker,
-				thread->u.fd, timeout);
+	/* -1:error , 0:EOF */
+	if (r == -1) {
+		/* We have encourred a real read error */
+		if (CHECKER_IS_UP(checker)) {
+			log_message(LOG_INFO, "Read error with server %s: %s"
+			       , FMT_HTTP_RS(checker)
+			       , strerror(errno));
+			checker_alert(checker,
+				      "DOWN",
+				      "=> HTTP CHECK failed on service"
+				      " : cannot receive data <=");
+			checker_update_state(checker, DOWN);
+		}
+		return epilog(thread, 1, 0, 0);
 	}
 
+	/* All the HTTP stream has been parsed */
+	http_handle_response(thread, !HTTP_PARSE_HEADER_DONE(&req->parser));
 	return 0;
 }
 
@@ -579,28 +887,66 @@ http_response_thread(thread_t * thread)
 	http_checker_t *http_get_check = CHECKER_ARG(checker);
 	http_t *http = HTTP_ARG(http_get_check);
 	request_t *req = HTTP_REQ(http);
-	unsigned timeout = checker->co->connection_to;
 
 	/* Handle read timeout */
 	if (thread->type == THREAD_READ_TIMEOUT)
 		return timeout_epilog(thread, "=> CHECK failed on service"
 				      " : recevice data <=\n\n", "WEB read");
 
-	/* Allocate & clean the get buffer */
-	req->buffer = (char *) MALLOC(MAX_BUFFER_LENGTH);
-	req->extracted = NULL;
-	req->len = 0;
+	/* Buffers are the checker's, allocated on first use */
+	if (!http->buffer)
+		http->buffer = (char *) MALLOC(MAX_BUFFER_LENGTH);
+	req->buffer = http->buffer;
 	req->error = 0;
-	MD5_Init(&req->context);
+	req->url = fetch_next_url(http_get_check);
+	http_parse_init(&req->parser, req->framed, req->url->status_only);
+	if (req->url->digest)
+		MD5_Init(&req->context);
+	if (req->url->regex) {
+		if (!http->regex_line)
+			http->regex_line = (char *) MALLOC(MAX_BUFFER_LENGTH + 1);
+		req->regex_line = http->regex_line;
+	}
 
-	/* Register asynchronous http/ssl read thread */
+	/* The response is ready, read it right away */
 	if (http_get_check->proto == PROTO_SSL)
-		thread_add_read(thread->master, ssl_read_thread, checker,
-				thread->u.fd, timeout);
-	else
-		thread_add_read(thread->master, http_read_thread, checker,
-				thread->u.fd, timeout);
-	return 0;
+		return ssl_read_thread(thread);
+	return http_read_thread(thread);
+}
+
+/*
+ * Render the GET request of an url, once. The host header needs the
+ * virtual server virtualhost, only known when the whole configuration
+ * is read, so this is done on first use rather than by the parser.
+ */
+static void
+http_render_request(checker_t * checker, url_t * url, int framed)
+{
+	struct sockaddr_storage *addr = &checker->co->dst;
+	char *vhost = CHECKER_VHOST(checker);
+	char str_request[GET_BUFFER_LENGTH];
+	char port[7] = "";
+	int len;
+
+	/* If vhost was defined we don't need to override it's port */
+	if (!vhost)
+		snprintf(port, sizeof (port), ":%d", ntohs(inet_sockaddrport(addr)));
+
+	if (addr->ss_family == AF_INET6 && !vhost) {
+		/* if literal ipv6 address, use ipv6 template, see RFC 2732 */
+		len = snprintf(str_request, GET_BUFFER_LENGTH, REQUEST_TEMPLATE_IPV6,
+			       url->path, framed, inet_sockaddrtos(addr), port);
+	} else {
+		len = snprintf(str_request, GET_BUFFER_LENGTH, REQUEST_TEMPLATE,
+			       url->path, framed, (vhost) ? vhost : inet_sockaddrtos(addr),
+			       port);
+	}
+	if (len >= GET_BUFFER_LENGTH)
+		len = GET_BUFFER_LENGTH - 1;
+
+	url->request = (char *) MALLOC(len + 1);
+	memcpy(url->request, str_request, len);
+	url->request_len = len;
 }
 
 /* remote Web server is connected, send it the get url query.  */
@@ -611,15 +957,9 @@ http_request_thread(thread_t * thread)
 	http_checker_t *http_get_check = CHECKER_ARG(checker);
 	http_t *http = HTTP_ARG(http_get_check);
 	request_t *req = HTTP_REQ(http);
-	struct sockaddr_storage *addr = &checker->co->dst;
 	unsigned timeout = checker->co->connection_to;
-	char *vhost = CHECKER_VHOST(checker);
-	char *request_host = 0;
-	char *request_host_port = 0;
-	char *str_request;
 	url_t *fetched_url;
 	int ret = 0;
-	int val;
 
 	/* Handle read timeout */
 	if (thread->type == THREAD_WRITE_TIMEOUT)
@@ -627,71 +967,43 @@ http_request_thread(thread_t * thread)
 				      " : read timeout <=\n\n",
 				      "Web read, timeout");
 
-	/* Allocate & clean the GET string */
-	str_request = (char *) MALLOC(GET_BUFFER_LENGTH);
-
 	fetched_url = fetch_next_url(http_get_check);
-
-	if (vhost) {
-		/* If vhost was defined we don't need to override it's port */
-		request_host = vhost;
-		request_host_port = (char*) MALLOC(1);
-		*request_host_port = 0;
-	} else {
-		request_host = inet_sockaddrtos(addr);
-
-		/* Allocate a buffer for the port string ( ":" [0-9][0-9][0-9][0-9][0-9] "\0" ) */
-		request_host_port = (char*) MALLOC(7);
-		snprintf(request_host_port, 7, ":%d", 
-			 ntohs(inet_sockaddrport(addr)));
-	}
-
-	if(addr->ss_family == AF_INET6 && !vhost){
-		/* if literal ipv6 address, use ipv6 template, see RFC 2732 */
-		snprintf(str_request, GET_BUFFER_LENGTH, REQUEST_TEMPLATE_IPV6,
-			fetched_url->path, request_host, request_host_port);
-	} else {
-		snprintf(str_request, GET_BUFFER_LENGTH, REQUEST_TEMPLATE,
-			fetched_url->path, request_host, request_host_port);
-	}
-
-	FREE(request_host_port);
+	if (!fetched_url->request)
+		http_render_request(checker, fetched_url, req->framed);
 
 	DBG("Processing url(%d) of %s.",
 	    http->url_it + 1
 	    , FMT_HTTP_RS(checker));
-
-	/* Set descriptor non blocking */
-	val = fcntl(thread->u.fd, F_GETFL, 0);
-	fcntl(thread->u.fd, F_SETFL, val | O_NONBLOCK);
-
-	/* Send the GET request to remote Web server */
-	if (http_get_check->proto == PROTO_SSL) {
-		ret = ssl_send_request(req->ssl, str_request,
-				       strlen(str_request));
+	CHECKER_PROBE();
+
+	/* Send the GET request to remote Web server, socket is writable */
+	if (thread->type == THREAD_IO_DONE) {
+		/* io_uring already sent it */
+		ret = (THREAD_IO_RESULT(thread) >= 0) ? 1 : 0;
+	} else if (http_get_check->proto == PROTO_SSL) {
+		CHECKER_SYSCALL(WRITE);
+		ret = ssl_send_request(req->ssl, fetched_url->request,
+				       fetched_url->request_len);
 	} else {
-		ret = (send(thread->u.fd, str_request, strlen(str_request), 0) !=
-		       -1) ? 1 : 0;
+		CHECKER_SYSCALL(WRITE);
+		ret = (send(thread->u.fd, fetched_url->request,
+			    fetched_url->request_len, 0) != -1) ? 1 : 0;
 	}
 
-	/* restore descriptor flags */
-	fcntl(thread->u.fd, F_SETFL, val);
-
-	FREE(str_request);
+	if (!ret && req->reused)
+		return http_reconnect(thread);
 
 	if (!ret) {
 		log_message(LOG_INFO, "Cannot send get request to %s."
 				    , FMT_HTTP_RS(checker));
 
 		/* check if server is currently alive */
-		if (svr_checker_up(checker->id, checker->rs)) {
-			smtp_alert(checker->rs, NULL, NULL,
-				   "DOWN",
-				   "=> CHECK failed on service"
-				   " : cannot send data <=");
-			update_svr_checker_state(DOWN, checker->id
-						     , checker->vs
-						     , checker->rs);
+		if (CHECKER_IS_UP(checker)) {
+			checker_alert(checker,
+				      "DOWN",
+				      "=> CHECK failed on service"
+				      " : cannot send data <=");
+			checker_update_state(checker, DOWN);
 		}
 		return epilog(thread, 1, 0, 0);
 	}
@@ -702,6 +1014,33 @@ http_request_thread(thread_t * thread)
 	return 1;
 }
 
+/*
+ * Register the GET request sender. With io_uring the rendered request
+ * of a plain HTTP url is sent in one submission, without waiting for
+ * writability first.
+ */
+static void
+http_request_register(thread_t * thread, checker_t * checker, int fd)
+{
+	http_checker_t *http_get_check = CHECKER_ARG(checker);
+	request_t *req = HTTP_REQ(HTTP_ARG(http_get_check));
+	long timeout = checker->co->connection_to;
+	url_t *fetched_url;
+
+	if (http_get_check->proto != PROTO_SSL) {
+		fetched_url = fetch_next_url(http_get_check);
+		if (!fetched_url->request)
+			http_render_request(checker, fetched_url, req->framed);
+		if (thread_add_send(thread->master, http_request_thread, checker,
+				    fd, fetched_url->request,
+				    fetched_url->request_len, timeout))
+			return;
+	}
+
+	thread_add_write(thread->master, http_request_thread, checker,
+			 fd, timeout);
+}
+
 /* WEB checkers threads */
 int
 http_check_thread(thread_t * thread)
@@ -722,16 +1061,14 @@ http_check_thread(thread_t * thread)
 	switch (status) {
 	case connect_error:
 		/* check if server is currently alive */
-		if (svr_checker_up(checker->id, checker->rs)) {
+		if (CHECKER_IS_UP(checker)) {
 			log_message(LOG_INFO, "Error connecting server %s."
 					 , FMT_HTTP_RS(checker));
-			smtp_alert(checker->rs, NULL, NULL,
-				   "DOWN",
-				   "=> CHECK failed on service"
-				   " : connection error <=");
-			update_svr_checker_state(DOWN, checker->id
-						 , checker->vs
-						 , checker->rs);
+			checker_alert(checker,
+				      "DOWN",
+				      "=> CHECK failed on service"
+				      " : connection error <=");
+			checker_update_state(checker, DOWN);
 		}
 		return epilog(thread, 1, 0, 0);
 		break;
@@ -744,7 +1081,7 @@ http_check_thread(thread_t * thread)
 
 	case connect_success:{
 			if (!http->req) {
-				http->req = (request_t *) MALLOC(sizeof (request_t));
+				http_request_init(http_get_check);
 				new_req = 1;
 			} else
 				new_req = 0;
@@ -790,10 +1127,7 @@ http_check_thread(thread_t * thread)
 				 * Register the next step thread ssl_request_thread.
 				 */
 				DBG("Remote Web server %s connected.", FMT_HTTP_RS(checker));
-				thread_add_write(thread->master,
-						 http_request_thread, checker,
-						 thread->u.fd,
-						 checker->co->connection_to);
+				http_request_register(thread, checker, thread->u.fd);
 			} else {
 				DBG("Connection trouble to: %s."
 						 , FMT_HTTP_RS(checker));
@@ -803,19 +1137,17 @@ http_check_thread(thread_t * thread)
 						     (req->ssl, ret));
 #endif
 				if ((http_get_check->proto == PROTO_SSL) &&
-				    (svr_checker_up(checker->id, checker->rs))) {
+				    (CHECKER_IS_UP(checker))) {
 					log_message(LOG_INFO, "SSL handshake/communication error"
 							 " connecting to server"
 							 " (openssl errno: %d) %s."
 						       , SSL_get_error (http->req->ssl, ret)
 						       , FMT_HTTP_RS(checker));
-					smtp_alert(checker->rs, NULL, NULL,
-						   "DOWN",
-						   "=> CHECK failed on service"
-						   " : SSL connection error <=");
-					update_svr_checker_state(DOWN, checker->id
-								 , checker->vs
-								 , checker->rs);
+					checker_alert(checker,
+						      "DOWN",
+						      "=> CHECK failed on service"
+						      " : SSL connection error <=");
+					checker_update_state(checker, DOWN);
 				}
 
 				return epilog(thread, 1, 0, 0);
@@ -827,6 +1159,22 @@ http_check_thread(thread_t * thread)
 	return 0;
 }
 
+/*
+ * Kept connection not closed nor reset by the server while idle.
+ * Bytes sent after a complete HTTP response put the connection out
+ * of sync, SSL may have records (tickets) pending.
+ */
+static int
+http_connection_alive(int fd, int ssl)
+{
+	char c;
+	int ret;
+
+	CHECKER_SYSCALL(READ);
+	ret = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+	return ((ret > 0 && ssl) || (ret < 0 && (errno == EAGAIN || errno == EINTR)));
+}
+
 int
 http_connect_thread(thread_t * thread)
 {
@@ -835,7 +1183,7 @@ http_connect_thread(thread_t * thread)
 	http_t *http = HTTP_ARG(http_get_check);
 	conn_opts_t *co = checker->co;
 	url_t *fetched_url;
-	enum connect_result status;
+	request_t *req;
 	int fd;
 
 	/*
@@ -856,21 +1204,38 @@ http_connect_thread(thread_t * thread)
 		 * Check completed.
 		 * check if server is currently alive.
 		 */
-		if (!svr_checker_up(checker->id, checker->rs)) {
+		if (!CHECKER_IS_UP(checker)) {
 			log_message(LOG_INFO, "Remote Web server %s succeed on service."
 					    , FMT_HTTP_RS(checker));
-			smtp_alert(checker->rs, NULL, NULL, "UP",
-				   "=> CHECK succeed on service <=");
-			update_svr_checker_state(UP, checker->id
-						   , checker->vs
-						   , checker->rs);
+			checker_alert(checker, "UP",
+				      "=> CHECK succeed on service <=");
+			checker_update_state(checker, UP);
 		}
 		http->req = NULL;
 		return epilog(thread, 1, 0, 0) + 1;
 	}
 
+	/* Send next request on the kept connection, if still open */
+	if (http->connected) {
+		http->connected = 0;
+		if (http_connection_alive(http->fd, http->ssl != NULL)) {
+			req = http_request_init(http_get_check);
+			req->reused = 1;
+			req->ssl = http->ssl;
+			http_request_register(thread, checker, http->fd);
+			return 0;
+		}
+		if (http->ssl)
+			ssl_release(http, http->ssl);
+		CHECKER_CLOSE(http->fd);
+	}
+
+	if (!checker_admit(thread))
+		return 0;
+
 	/* Create the socket */
-	if ((fd = socket(co->dst.ss_family, SOCK_STREAM, IPPROTO_TCP)) == -1) {
+	if ((fd = CHECKER_SOCKET(co->dst.ss_family)) == -1) {
+		checker_release(checker);
 		log_message(LOG_INFO, "WEB connection fail to create socket. Rescheduling.");
 		thread_add_timer(thread->master, http_connect_thread, checker,
 				checker->vs->delay_loop);
@@ -878,12 +1243,11 @@ http_connect_thread(thread_t * thread)
 		return 0;
 	}
 
-	status = tcp_bind_connect(fd, co);
-
-	/* handle tcp connection status & register check worker thread */
-	if(tcp_connection_state(fd, status, thread, http_check_thread,
-			co->connection_to)) {
-		close(fd);
+	/* connect & register check worker thread */
+	if (tcp_async_connect(fd, co, thread, http_check_thread,
+			      co->connection_to)) {
+		CHECKER_CLOSE(fd);
+		checker_release(checker);
 		log_message(LOG_INFO, "WEB socket bind failed. Rescheduling");
 		thread_add_timer(thread->master, http_connect_thread, checker,
 				checker->vs->delay_loop);
@@ -23,6 +23,8 @@
  * Copyright (C) 2001-2012 Alexandre Cassen, <acassen@gmail.com>
  */
 
+#include <spawn.h>
+#include <sys/socket.h>
 #include "check_misc.h"
 #include "check_api.h"
 #include "memory.h"
@@ -39,6 +41,17 @@ int misc_check_thread(thread_t *);
 int misc_check_child_thread(thread_t *);
 int misc_check_child_timeout_thread(thread_t *);
 
+extern char **environ;
+
+/* Checker side of the executor */
+static int misc_exec_fd = -1;
+static thread_t *misc_exec_thread;
+static unsigned int misc_exec_id;
+static misc_exec_slot_t *misc_exec_slots;
+static int misc_exec_nslots;
+static int misc_exec_free = -1;
+static int misc_exec_send(checker_t *);
+
 /* Configuration stream handling */
 void
 free_misc_check(void *data)
@@ -65,9 +78,9 @@ misc_check_handler(vector_t *strvec)
 {
 	misc_checker_t *misck_checker = (misc_checker_t *) MALLOC(sizeof (misc_checker_t));
 
-	/* queue new checker */
+	/* queue new checker, scripts may have side effects, never shared */
 	queue_checker(free_misc_check, dump_misc_check, misc_check_thread,
-		      misck_checker, NULL);
+		      NULL, misck_checker, NULL);
 }
 
 void
@@ -125,9 +138,13 @@ misc_check_thread(thread_t * thread)
 		return 0;
 	}
 
-	/* Register next timer checker */
+	/* Register next timer checker, the state is the last run's */
 	thread_add_timer(thread->master, misc_check_thread, checker,
-			 checker->vs->delay_loop);
+			 checker_delay(checker));
+
+	/* Run by the executor, forking ourselves is the fallback */
+	if (!misc_exec_send(checker))
+		return 0;
 
 	/* Daemonization to not degrade our scheduling timer */
 	pid = fork();
@@ -173,15 +190,67 @@ misc_check_thread(thread_t * thread)
 	exit(status);
 }
 
+/* The script did not complete in time */
+static void
+misc_check_timeout(checker_t *checker)
+{
+	misc_checker_t *misck_checker = CHECKER_ARG(checker);
+
+	if (CHECKER_IS_UP(checker)) {
+		log_message(LOG_INFO, "Misc check to [%s] for [%s] timed out"
+				    , inet_sockaddrtos(&checker->rs->addr)
+				    , misck_checker->path);
+		checker_alert(checker,
+			      "DOWN",
+			      "=> MISC CHECK script timeout on service <=");
+		checker_update_state(checker, DOWN);
+	}
+}
+
+/* The script exited with status */
+static void
+misc_check_result(checker_t *checker, int status)
+{
+	misc_checker_t *misck_checker = CHECKER_ARG(checker);
+
+	if (status == 0 ||
+	    (misck_checker->dynamic == 1 && status >= 2 && status <= 255)) {
+		/*
+		 * The actual weight set when using misc_dynamic is two less than
+		 * the exit status returned.  Effective range is 0..253.
+		 * Catch legacy case of status being 0 but misc_dynamic being set.
+		 */
+		if (misck_checker->dynamic == 1 && status != 0)
+			update_svr_wgt(status - 2, checker->vs, checker->rs);
+
+		/* everything is good */
+		if (!CHECKER_IS_UP(checker)) {
+			log_message(LOG_INFO, "Misc check to [%s] for [%s] success."
+					    , inet_sockaddrtos(&checker->rs->addr)
+					    , misck_checker->path);
+			checker_alert(checker,
+				      "UP",
+				      "=> MISC CHECK succeed on service <=");
+			checker_update_state(checker, UP);
+		}
+	} else {
+		if (CHECKER_IS_UP(checker)) {
+			log_message(LOG_INFO, "Misc check to [%s] for [%s] failed."
+					    , inet_sockaddrtos(&checker->rs->addr)
+					    , misck_checker->path);
+			checker_alert(checker,
+				      "DOWN",
+				      "=> MISC CHECK failed on service <=");
+			checker_update_state(checker, DOWN);
+		}
+	}
+}
+
 int
 misc_check_child_thread(thread_t * thread)
 {
+	checker_t *checker = THREAD_ARG(thread);
 	int wait_status;
-	checker_t *checker;
-	misc_checker_t *misck_checker;
-
-	checker = THREAD_ARG(thread);
-	misck_checker = CHECKER_ARG(checker);
 
 	if (thread->type == THREAD_CHILD_TIMEOUT) {
 		pid_t pid;
@@ -189,18 +258,7 @@ misc_check_child_thread(thread_t * thread)
 		pid = THREAD_CHILD_PID(thread);
 
 		/* The child hasn't responded. Kill it off. */
-		if (svr_checker_up(checker->id, checker->rs)) {
-			log_message(LOG_INFO, "Misc check to [%s] for [%s] timed out"
-					    , inet_sockaddrtos(&checker->rs->addr)
-					    , misck_checker->path);
-			smtp_alert(checker->rs, NULL, NULL,
-				   "DOWN",
-				   "=> MISC CHECK script timeout on service <=");
-			update_svr_checker_state(DOWN, checker->id
-						     , checker->vs
-						     , checker->rs);
-		}
-
+		misc_check_timeout(checker);
 		kill(pid, SIGTERM);
 		thread_add_child(thread->master, misc_check_child_timeout_thread,
 				 checker, pid, 2);
@@ -209,45 +267,8 @@ misc_check_child_thread(thread_t * thread)
 
 	wait_status = THREAD_CHILD_STATUS(thread);
 
-	if (WIFEXITED(wait_status)) {
-		int status;
-		status = WEXITSTATUS(wait_status);
-		if (status == 0 ||
-                    (misck_checker->dynamic == 1 && status >= 2 && status <= 255)) {
-			/*
-			 * The actual weight set when using misc_dynamic is two less than
-			 * the exit status returned.  Effective range is 0..253.
-			 * Catch legacy case of status being 0 but misc_dynamic being set.
-			 */
-			if (misck_checker->dynamic == 1 && status != 0)
-				update_svr_wgt(status - 2, checker->vs, checker->rs);
-
-			/* everything is good */
-			if (!svr_checker_up(checker->id, checker->rs)) {
-				log_message(LOG_INFO, "Misc check to [%s] for [%s] success."
-						    , inet_sockaddrtos(&checker->rs->addr)
-						    , misck_checker->path);
-				smtp_alert(checker->rs, NULL, NULL,
-					   "UP",
-					   "=> MISC CHECK succeed on service <=");
-				update_svr_checker_state(UP, checker->id
-							   , checker->vs
-							   , checker->rs);
-			}
-		} else {
-			if (svr_checker_up(checker->id, checker->rs)) {
-				log_message(LOG_INFO, "Misc check to [%s] for [%s] failed."
-						    , inet_sockaddrtos(&checker->rs->addr)
-						    , misck_checker->path);
-				smtp_alert(checker->rs, NULL, NULL,
-					   "DOWN",
-					   "=> MISC CHECK failed on service <=");
-				update_svr_checker_state(DOWN, checker->id
-							     , checker->vs
-							     , checker->rs);
-			}
-		}
-	}
+	if (WIFEXITED(wait_status))
+		misc_check_result(checker, WEXITSTATUS(wait_status));
 
 	return 0;
 }
@@ -274,3 +295,358 @@ misc_check_child_timeout_thread(thread_t * thread)
 
 	return 0;
 }
+
+/* Exit code of a script as seen by the checker, as system_call() does */
+static int
+misc_exec_status(int status)
+{
+	if (!WIFEXITED(status))
+		return 0; /* Script errors aren't server errors */
+	if (WEXITSTATUS(status) == 127)
+		log_message(LOG_ALERT, "Couldn't exec MISC_CHECK command");
+	return WEXITSTATUS(status);
+}
+
+/* Executor side, send a result back to the checker process */
+static void
+misc_exec_reply(unsigned int id, unsigned int slot, int type, int status)
+{
+	misc_exec_res_t res = { .id = id, .slot = slot, .type = type, .status = status };
+
+	if (send(MISC_EXEC_FD, &res, sizeof (res), MSG_DONTWAIT) < 0)
+		log_message(LOG_INFO, "MISC_CHECK executor : cannot send result (%s)"
+				    , strerror(errno));
+}
+
+static int
+misc_exec_child_thread(thread_t * thread)
+{
+	misc_exec_job_t *job = THREAD_ARG(thread);
+	pid_t pid = THREAD_CHILD_PID(thread);
+
+	if (thread->type == THREAD_CHILD_TIMEOUT) {
+		misc_exec_reply(job->id, job->slot, MISC_EXEC_TIMEOUT, 0);
+		kill(pid, SIGTERM);
+		thread_add_child(thread->master, misc_check_child_timeout_thread,
+				 NULL, pid, 2);
+	} else
+		misc_exec_reply(job->id, job->slot, MISC_EXEC_EXITED,
+				misc_exec_status(THREAD_CHILD_STATUS(thread)));
+
+	FREE(job);
+	return 0;
+}
+
+/*
+ * Executor side, run a script. posix_spawn() shares our memory until
+ * the exec, the size of the checker process costs nothing there.
+ */
+static void
+misc_exec_spawn(thread_master_t *m, misc_exec_req_t *req, char *path)
+{
+	char *argv[] = { "sh", "-c", path, NULL };
+	posix_spawnattr_t attr;
+	misc_exec_job_t *job;
+	sigset_t set;
+	pid_t pid;
+	int ret;
+
+	/* Scripts get default signal handling and an empty mask */
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK);
+	sigfillset(&set);
+	posix_spawnattr_setsigdefault(&attr, &set);
+	sigemptyset(&set);
+	posix_spawnattr_setsigmask(&attr, &set);
+
+	ret = posix_spawn(&pid, "/bin/sh", NULL, &attr, argv, environ);
+	posix_spawnattr_destroy(&attr);
+	if (ret) {
+		log_message(LOG_ALERT, "Error exec-ing command: %s (%s)"
+				     , path, strerror(ret));
+		misc_exec_reply(req->id, req->slot, MISC_EXEC_EXITED, 0);
+		return;
+	}
+
+	job = (misc_exec_job_t *) MALLOC(sizeof (misc_exec_job_t));
+	job->id = req->id;
+	job->slot = req->slot;
+	thread_add_child(m, misc_exec_child_thread, job, pid, req->timeout);
+}
+
+/* Executor side, requests from the checker process */
+static int
+misc_exec_request_thread(thread_t * thread)
+{
+	char buf[sizeof (misc_exec_req_t) + MISC_EXEC_PATH_MAX];
+	misc_exec_req_t *req = (misc_exec_req_t *) buf;
+	ssize_t len;
+
+	while (thread->type != THREAD_READ_TIMEOUT) {
+		len = recv(MISC_EXEC_FD, buf, sizeof (buf) - 1, MSG_DONTWAIT);
+		if (len == 0) {
+			/* Checker process gone, running scripts are left alone */
+			thread_add_terminate_event(thread->master);
+			return 0;
+		}
+		if (len < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				break;
+			log_message(LOG_INFO, "MISC_CHECK executor : read error (%s)"
+					    , strerror(errno));
+			thread_add_terminate_event(thread->master);
+			return 0;
+		}
+		if (len <= sizeof (misc_exec_req_t))
+			continue;
+
+		buf[len] = 0;
+		misc_exec_spawn(thread->master, req, buf + sizeof (misc_exec_req_t));
+	}
+
+	thread_add_read(thread->master, misc_exec_request_thread, NULL,
+			MISC_EXEC_FD, MISC_EXEC_TIMER);
+	return 0;
+}
+
+/* Executor process main loop */
+static void
+misc_exec_run(int fd)
+{
+	int ret;
+
+	/* Drop the checker scheduler first, it closes its own fds */
+	signal_handler_destroy();
+	thread_destroy_master(master);
+
+	/* Only keep the socket, on a fixed fd not inherited by scripts */
+	if (fd != MISC_EXEC_FD) {
+		dup2(fd, MISC_EXEC_FD);
+		fcntl(MISC_EXEC_FD, F_SETFD, FD_CLOEXEC);
+		close(fd);
+	}
+	closeall(MISC_EXEC_FD + 1);
+	close(0);
+	close(1);
+	close(2);
+	open("/dev/null", O_RDWR);
+	ret = dup(0);
+	if (ret < 0)
+		log_message(LOG_INFO, "dup(0) error");
+	ret = dup(0);
+	if (ret < 0)
+		log_message(LOG_INFO, "dup(0) error");
+
+	/* Stopped by the checker process closing the socket */
+	master = thread_make_master();
+	signal_handler_init();
+	signal_ignore(SIGINT);
+	signal_ignore(SIGHUP);
+	signal_ignore(SIGPIPE);
+
+	thread_add_read(master, misc_exec_request_thread, NULL,
+			MISC_EXEC_FD, MISC_EXEC_TIMER);
+	launch_scheduler();
+	exit(0);
+}
+
+/*
+ * Start the executor, while the checker process has not read its
+ * configuration yet. It lives across reloads.
+ */
+void
+misc_exec_start(void)
+{
+	int sv[2];
+	pid_t pid;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+		log_message(LOG_INFO, "MISC_CHECK executor : socketpair error (%s)"
+				    , strerror(errno));
+		return;
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		log_message(LOG_INFO, "MISC_CHECK executor : fork error (%s)"
+				    , strerror(errno));
+		close(sv[0]);
+		close(sv[1]);
+		return;
+	}
+
+	if (!pid) {
+		close(sv[0]);
+		misc_exec_run(sv[1]);
+	}
+
+	close(sv[1]);
+	misc_exec_fd = sv[0];
+	log_message(LOG_INFO, "Starting MISC_CHECK executor, pid=%d", pid);
+}
+
+/*
+ * Checker side, a slot for each script being run. A checker may have
+ * several when its script runs longer than its delay, like forked
+ * children each result is applied.
+ */
+static int
+misc_exec_slot_get(checker_t *checker, unsigned int id)
+{
+	misc_exec_slot_t *slots;
+	int i, size, slot;
+
+	if (misc_exec_free < 0) {
+		size = (misc_exec_nslots) ? misc_exec_nslots * 2 : MISC_EXEC_SLOTS_MIN;
+		slots = (misc_exec_slot_t *) MALLOC(size * sizeof (misc_exec_slot_t));
+		if (misc_exec_slots) {
+			memcpy(slots, misc_exec_slots
+				    , misc_exec_nslots * sizeof (misc_exec_slot_t));
+			FREE(misc_exec_slots);
+		}
+
+		/* Chain the new slots, lowest first */
+		for (i = size - 1; i >= misc_exec_nslots; i--) {
+			slots[i].next = misc_exec_free;
+			misc_exec_free = i;
+		}
+		misc_exec_slots = slots;
+		misc_exec_nslots = size;
+	}
+
+	slot = misc_exec_free;
+	misc_exec_free = misc_exec_slots[slot].next;
+	misc_exec_slots[slot].id = id;
+	misc_exec_slots[slot].checker = checker;
+	return slot;
+}
+
+static void
+misc_exec_slot_put(int slot)
+{
+	misc_exec_slots[slot].checker = NULL;
+	misc_exec_slots[slot].next = misc_exec_free;
+	misc_exec_free = slot;
+}
+
+/* Forget scripts being run, their results will be dropped */
+static void
+misc_exec_slots_release(void)
+{
+	FREE_PTR(misc_exec_slots);
+	misc_exec_slots = NULL;
+	misc_exec_nslots = 0;
+	misc_exec_free = -1;
+}
+
+/* The checker, if any, a result is for. Its slot is released */
+static checker_t *
+misc_exec_checker(misc_exec_res_t *res)
+{
+	checker_t *checker;
+
+	if (res->slot >= (unsigned int) misc_exec_nslots ||
+	    !misc_exec_slots[res->slot].checker ||
+	    misc_exec_slots[res->slot].id != res->id)
+		return NULL;
+
+	checker = misc_exec_slots[res->slot].checker;
+	misc_exec_slot_put(res->slot);
+	return checker;
+}
+
+/* Checker side, results from the executor */
+static int
+misc_exec_result_thread(thread_t * thread)
+{
+	misc_exec_res_t res;
+	checker_t *checker;
+	ssize_t len;
+
+	while (thread->type != THREAD_READ_TIMEOUT) {
+		len = recv(misc_exec_fd, &res, sizeof (res), MSG_DONTWAIT);
+		if (len < 0 && (errno == EAGAIN || errno == EINTR))
+			break;
+		if (len <= 0) {
+			/* Scripts are forked by ourselves from now on */
+			log_message(LOG_INFO, "MISC_CHECK executor is gone (%s)"
+					    , (len) ? strerror(errno) : "closed");
+			close(misc_exec_fd);
+			misc_exec_fd = -1;
+			misc_exec_thread = NULL;
+			misc_exec_slots_release();
+			return 0;
+		}
+		if (len != sizeof (res))
+			continue;
+
+		/* Results of a previous configuration are dropped */
+		checker = misc_exec_checker(&res);
+		if (!checker)
+			continue;
+
+		if (res.type == MISC_EXEC_TIMEOUT)
+			misc_check_timeout(checker);
+		else
+			misc_check_result(checker, res.status);
+	}
+
+	misc_exec_thread = thread_add_read(thread->master, misc_exec_result_thread,
+					   NULL, misc_exec_fd, MISC_EXEC_TIMER);
+	return 0;
+}
+
+/* Listen to the executor from the master of this configuration */
+void
+misc_exec_register(void)
+{
+	if (misc_exec_fd >= 0)
+		misc_exec_thread = thread_add_read(master, misc_exec_result_thread,
+						   NULL, misc_exec_fd, MISC_EXEC_TIMER);
+}
+
+/*
+ * Destroying the master closes the descriptors it still reads, the
+ * executor socket must survive a reload. Checkers are about to be
+ * freed, scripts still running are forgotten.
+ */
+void
+misc_exec_unregister(void)
+{
+	if (misc_exec_thread)
+		thread_cancel(misc_exec_thread);
+	misc_exec_thread = NULL;
+	misc_exec_slots_release();
+}
+
+/* Checker side, have the executor run the script, -1 if it can't */
+static int
+misc_exec_send(checker_t *checker)
+{
+	misc_checker_t *misck_checker = CHECKER_ARG(checker);
+	char buf[sizeof (misc_exec_req_t) + MISC_EXEC_PATH_MAX];
+	misc_exec_req_t *req = (misc_exec_req_t *) buf;
+	size_t len;
+
+	if (misc_exec_fd < 0)
+		return -1;
+
+	len = strlen(misck_checker->path) + 1;
+	if (len > MISC_EXEC_PATH_MAX)
+		return -1;
+
+	req->id = ++misc_exec_id;
+	req->slot = misc_exec_slot_get(checker, req->id);
+	req->timeout = (misck_checker->timeout) ? misck_checker->timeout :
+						  checker->vs->delay_loop;
+	memcpy(buf + sizeof (misc_exec_req_t), misck_checker->path, len);
+
+	if (send(misc_exec_fd, buf, sizeof (misc_exec_req_t) + len, MSG_DONTWAIT) < 0) {
+		log_message(LOG_INFO, "MISC_CHECK executor : cannot send request (%s)"
+				    , strerror(errno));
+		misc_exec_slot_put(req->slot);
+		return -1;
+	}
+
+	return 0;
+}
@@ -59,6 +59,11 @@ sslkey_handler(vector_t *strvec)
 {
 	check_data->ssl->keyfile = set_value(strvec);
 }
+static void
+sslsessionttl_handler(vector_t *strvec)
+{
+	check_data->ssl->session_ttl = atol(vector_slot(strvec, 1)) * TIMER_HZ;
+}
 
 /* Virtual Servers handlers */
 static void
@@ -82,6 +87,40 @@ delay_handler(vector_t *strvec)
 		vs->delay_loop = TIMER_HZ;
 }
 static void
+delay_min_handler(vector_t *strvec)
+{
+	virtual_server_t *vs = LIST_TAIL_DATA(check_data->vs);
+	vs->delay_loop_min = atoi(vector_slot(strvec, 1)) * TIMER_HZ;
+	if (vs->delay_loop_min < TIMER_HZ)
+		vs->delay_loop_min = TIMER_HZ;
+}
+static void
+delay_max_handler(vector_t *strvec)
+{
+	virtual_server_t *vs = LIST_TAIL_DATA(check_data->vs);
+	vs->delay_loop_max = atoi(vector_slot(strvec, 1)) * TIMER_HZ;
+	if (vs->delay_loop_max < TIMER_HZ)
+		vs->delay_loop_max = TIMER_HZ;
+}
+static void
+delay_success_handler(vector_t *strvec)
+{
+	virtual_server_t *vs = LIST_TAIL_DATA(check_data->vs);
+	vs->delay_success_factor = atof(vector_slot(strvec, 1));
+	if (vs->delay_success_factor < 1)
+		vs->delay_success_factor = 1;
+}
+static void
+delay_failure_handler(vector_t *strvec)
+{
+	virtual_server_t *vs = LIST_TAIL_DATA(check_data->vs);
+	vs->delay_failure_factor = atof(vector_slot(strvec, 1));
+	if (vs->delay_failure_factor < 0)
+		vs->delay_failure_factor = 0;
+	if (vs->delay_failure_factor > 1)
+		vs->delay_failure_factor = 1;
+}
+static void
 lbalgo_handler(vector_t *strvec)
 {
 	virtual_server_t *vs = LIST_TAIL_DATA(check_data->vs);
@@ -295,11 +334,16 @@ check_init_keywords(void)
 	install_keyword("ca", &sslca_handler);
 	install_keyword("certificate", &sslcert_handler);
 	install_keyword("key", &sslkey_handler);
+	install_keyword("session_ttl", &sslsessionttl_handler);
 
 	/* Virtual server mapping */
 	install_keyword_root("virtual_server_group", &vsg_handler);
 	install_keyword_root("virtual_server", &vs_handler);
 	install_keyword("delay_loop", &delay_handler);
+	install_keyword("delay_loop_min", &delay_min_handler);
+	install_keyword("delay_loop_max", &delay_max_handler);
+	install_keyword("delay_success_factor", &delay_success_handler);
+	install_keyword("delay_failure_factor", &delay_failure_handler);
 	install_keyword("lb_algo", &lbalgo_handler);
 	install_keyword("lvs_sched", &lbalgo_handler);
 	install_keyword("lb_kind", &lbkind_handler);
@@ -87,6 +87,29 @@ dump_smtp_check(void *data)
 	dump_list(smtp_checker->host);
 }
 
+/* Same dialog with the same hosts, probes can be shared */
+static int
+compare_smtp_check(checker_t *a, checker_t *b)
+{
+	smtp_checker_t *smtp_a = CHECKER_ARG(a);
+	smtp_checker_t *smtp_b = CHECKER_ARG(b);
+	element e_a, e_b;
+
+	if (!string_equal(smtp_a->helo_name, smtp_b->helo_name) ||
+	    smtp_a->timeout != smtp_b->timeout ||
+	    smtp_a->db_retry != smtp_b->db_retry ||
+	    smtp_a->retry != smtp_b->retry)
+		return 0;
+
+	for (e_a = LIST_HEAD(smtp_a->host), e_b = LIST_HEAD(smtp_b->host);
+	     e_a && e_b; ELEMENT_NEXT(e_a), ELEMENT_NEXT(e_b)) {
+		if (!checker_co_equal(ELEMENT_DATA(e_a), ELEMENT_DATA(e_b)))
+			return 0;
+	}
+
+	return !e_a && !e_b;
+}
+
 /* Allocates a default host structure */
 smtp_host_t *
 smtp_alloc_host(void)
@@ -134,10 +157,11 @@ smtp_check_handler(vector_t *strvec)
 	 *
 	 * queue_checker(void (*free) (void *), void (*dump) (void *),
 	 *               int (*launch) (thread_t *),
+	 *               int (*compare) (checker_t *, checker_t *),
 	 *               void *data, conn_opts_t *)
 	 */
 	queue_checker(free_smtp_check, dump_smtp_check, smtp_connect_thread,
-		      smtp_checker, NULL);
+		      compare_smtp_check, smtp_checker, NULL);
 
 	/* 
 	 * Last, allocate/setup the list that will hold all the per host 
@@ -256,14 +280,15 @@ smtp_final(thread_t *thread, int error, const char *format, ...)
 	va_list varg_list;
 
 	/* Error or no error we should always have to close the socket */
-	close(thread->u.fd);
+	CHECKER_CLOSE(thread->u.fd);
+	checker_release(checker);
 
 	/* If we're here, an attempt HAS been made already for the current host */
 	smtp_checker->attempts++;
 	
 	if (error) {
 		/* Always syslog the error when the real server is up */
-                if (svr_checker_up(checker->id, checker->rs)) {
+                if (CHECKER_IS_UP(checker)) {
 			if (format != NULL) {
 				/* prepend format with the "SMTP_CHECK " string */
 				error_buff[0] = '\0';
@@ -291,11 +316,11 @@ smtp_final(thread_t *thread, int error, const char *format, ...)
 
 		/*
 		 * No more retries, pull the real server from the virtual server.
-		 * Only smtp_alert if it wasn't previously down. It should
-		 * be noted that smtp_alert makes a copy of the string arguments, so
+		 * Only checker_alert if it wasn't previously down. It should
+		 * be noted that checker_alert makes a copy of the string arguments, so
 		 * we don't have to keep them statically allocated.
 		 */
-                if (svr_checker_up(checker->id, checker->rs)) {
+                if (CHECKER_IS_UP(checker)) {
 			if (format != NULL) {
 				snprintf(smtp_buff, 542, "=> CHECK failed on service : %s <=",
 					 error_buff + 11);
@@ -304,8 +329,8 @@ smtp_final(thread_t *thread, int error, const char *format, ...)
 			}
 
 			smtp_buff[542 - 1] = '\0';
-			smtp_alert(checker->rs, NULL, NULL, "DOWN", smtp_buff);
-			update_svr_checker_state(DOWN, checker->id, checker->vs, checker->rs);
+			checker_alert(checker, "DOWN", smtp_buff);
+			checker_update_state(checker, DOWN);
 		}
 
 		/* Reset everything back to the first host in the list */
@@ -313,7 +338,8 @@ smtp_final(thread_t *thread, int error, const char *format, ...)
 		smtp_checker->host_ctr = 0;
 
 		/* Reschedule the main thread using the configured delay loop */;
-		thread_add_timer(thread->master, smtp_connect_thread, checker, checker->vs->delay_loop);
+		thread_add_timer(thread->master, smtp_connect_thread, checker,
+				 checker_delay(checker));
 
 		return 0;
 	}	
@@ -355,7 +381,7 @@ smtp_get_line_cb(thread_t *thread)
 	checker_t *checker = THREAD_ARG(thread);
 	smtp_checker_t *smtp_checker = CHECKER_ARG(checker);
 	smtp_host_t *smtp_host = smtp_checker->host_ptr;
-	int f, r, x;
+	int r, x;
 
         /* Handle read timeout */
         if (thread->type == THREAD_READ_TIMEOUT) {
@@ -372,25 +398,18 @@ smtp_get_line_cb(thread_t *thread)
 		smtp_clear_buff(thread);
 	}
 
-	/* Set descriptor non blocking */
-	f = fcntl(thread->u.fd, F_GETFL, 0);
-	fcntl(thread->u.fd, F_SETFL, f | O_NONBLOCK);
-
-	/* read the data */
+	/* read the data, the socket is nonblocking */
+	CHECKER_SYSCALL(READ);
 	r = read(thread->u.fd, smtp_checker->buff + smtp_checker->buff_ctr,
 		 SMTP_BUFF_MAX - smtp_checker->buff_ctr);
 
 	if (r == -1 && (errno == EAGAIN || errno == EINTR)) {
 		thread_add_read(thread->master, smtp_get_line_cb, checker,
 				thread->u.fd, smtp_host->connection_to);
-        	fcntl(thread->u.fd, F_SETFL, f);
 		return 0;
 	} else if (r > 0)
 		smtp_checker->buff_ctr += r;
 
-        /* restore descriptor flags */
-        fcntl(thread->u.fd, F_SETFL, f);
-
 	/* check if we have a newline, if so, callback */
 	for (x = 0; x < SMTP_BUFF_MAX; x++) {
 		if (smtp_checker->buff[x] == '\n') {
@@ -466,7 +485,7 @@ smtp_put_line_cb(thread_t *thread)
 	checker_t *checker = THREAD_ARG(thread);
 	smtp_checker_t *smtp_checker = CHECKER_ARG(checker);
 	smtp_host_t *smtp_host = smtp_checker->host_ptr;
-	int f, w;
+	int w;
 
 
         /* Handle read timeout */
@@ -476,23 +495,16 @@ smtp_put_line_cb(thread_t *thread)
 		return 0;
 	}
 
-	/* Set descriptor non blocking */
-        f = fcntl(thread->u.fd, F_GETFL, 0);
-        fcntl(thread->u.fd, F_SETFL, f | O_NONBLOCK);
-
-        /* write the data */
-        w = write(thread->u.fd, smtp_checker->buff, smtp_checker->buff_ctr);
+	/* write the data, the socket is nonblocking */
+	CHECKER_SYSCALL(WRITE);
+	w = write(thread->u.fd, smtp_checker->buff, smtp_checker->buff_ctr);
 
 	if (w == -1 && (errno == EAGAIN || errno == EINTR)) {
 		thread_add_write(thread->master, smtp_put_line_cb, checker,
 				 thread->u.fd, smtp_host->connection_to);
-        	fcntl(thread->u.fd, F_SETFL, f);
 		return 0;
 	}
 
-        /* restore descriptor flags */
-        fcntl(thread->u.fd, F_SETFL, f);
-
 	DBG("SMTP_CHECK %s > %s"
 	    , FMT_SMTP_RS(smtp_host)
 	    , smtp_checker->buff);
@@ -708,7 +720,6 @@ smtp_connect_thread(thread_t *thread)
 	checker_t *checker = THREAD_ARG(thread);
 	smtp_checker_t *smtp_checker = CHECKER_ARG(checker);
 	smtp_host_t *smtp_host;
-	enum connect_result status;
 	int sd;
 
 	/* Let's review our data structures.
@@ -755,38 +766,44 @@ smtp_connect_thread(thread_t *thread)
 	 * will be reset and we will continue on checking them one by one.
 	 */
 	if ((smtp_checker->host_ptr = list_element(smtp_checker->host, smtp_checker->host_ctr)) == NULL) {
-		if (!svr_checker_up(checker->id, checker->rs)) {
+		if (!CHECKER_IS_UP(checker)) {
 			log_message(LOG_INFO, "Remote SMTP server %s succeed on service."
 					    , FMT_CHK(checker));
 
-			smtp_alert(checker->rs, NULL, NULL, "UP",
-				   "=> CHECK succeed on service <=");
-			update_svr_checker_state(UP, checker->id, checker->vs, checker->rs);
+			checker_alert(checker, "UP",
+				      "=> CHECK succeed on service <=");
+			checker_update_state(checker, UP);
 		}
 
 		smtp_checker->attempts = 0;
 		smtp_checker->host_ctr = 0;
 		smtp_checker->host_ptr = list_element(smtp_checker->host, 0);
 
-		thread_add_timer(thread->master, smtp_connect_thread, checker, checker->vs->delay_loop);
+		thread_add_timer(thread->master, smtp_connect_thread, checker,
+				 checker_delay(checker));
 		return 0;
 	}
 
 	smtp_host = smtp_checker->host_ptr;
 
+	if (!checker_admit(thread))
+		return 0;
+
 	/* Create the socket, failling here should be an oddity */
-	if ((sd = socket(smtp_host->dst.ss_family, SOCK_STREAM, IPPROTO_TCP)) == -1) {
+	CHECKER_PROBE();
+	if ((sd = CHECKER_SOCKET(smtp_host->dst.ss_family)) == -1) {
+		checker_release(checker);
 		log_message(LOG_INFO, "SMTP_CHECK connection failed to create socket. Rescheduling.");
 		thread_add_timer(thread->master, smtp_connect_thread, checker,
 				 checker->vs->delay_loop);
 		return 0;
 	}
 
-	status = tcp_bind_connect(sd, smtp_host);
-
-	/* handle tcp connection status & register callback the next setp in the process */
-	if(tcp_connection_state(sd, status, thread, smtp_check_thread, smtp_host->connection_to)) {
-		close(sd);
+	/* connect & register callback the next setp in the process */
+	if (tcp_async_connect(sd, smtp_host, thread, smtp_check_thread,
+			      smtp_host->connection_to)) {
+		CHECKER_CLOSE(sd);
+		checker_release(checker);
 		log_message(LOG_INFO, "SMTP_CHECK socket bind failed. Rescheduling.");
 		thread_add_timer(thread->master, smtp_connect_thread, checker,
 			checker->vs->delay_loop);
@@ -22,11 +22,32 @@
 
 #include "check_data.h"
 #include "check_snmp.h"
+#include "check_api.h"
 #include "list.h"
 #include "ipvswrapper.h"
 #include "ipwrapper.h"
 #include "global_data.h"
 
+/* Current probe interval of a real server, its shortest one */
+static long
+check_snmp_rs_interval(virtual_server_t *vs, real_server_t *rs)
+{
+	checker_t *checker, *probe;
+	long delay, interval = 0;
+	element e;
+
+	for (e = LIST_HEAD(checkers_queue); e; ELEMENT_NEXT(e)) {
+		checker = ELEMENT_DATA(e);
+		if (checker->rs != rs)
+			continue;
+		probe = (checker->probe) ? checker->probe : checker;
+		delay = (probe->delay) ? probe->delay : vs->delay_loop;
+		if (!interval || delay < interval)
+			interval = delay;
+	}
+	return interval;
+}
+
 static u_char*
 check_snmp_vsgroup(struct variable *vp, oid *name, size_t *length,
 		   int exact, size_t *var_len, WriteMethod **write_method)
@@ -650,6 +671,10 @@ check_snmp_realserver(struct variable *vp, oid *name, size_t *length,
 		else
 			long_ret = LIST_SIZE(be->failed_checkers);
 		return (u_char*)&long_ret;
+	case CHECK_SNMP_RSCHECKINTERVAL:
+		if (btype == STATE_RS_SORRY) break;
+		long_ret = check_snmp_rs_interval(bvs, be) / (TIMER_HZ / 1000);
+		return (u_char*)&long_ret;
 #if defined(_KRNL_2_6_) && defined(_WITH_LVS_)
 	case CHECK_SNMP_RSSTATSCONNS:
 		ipvs_update_stats(bvs);
@@ -869,6 +894,8 @@ static struct variable8 check_vars[] = {
 	{CHECK_SNMP_RSRATEOUTBPS, ASN_GAUGE, RONLY,
 	 check_snmp_realserver, 3, {4, 1, 26}},
 #endif
+	{CHECK_SNMP_RSCHECKINTERVAL, ASN_UNSIGNED, RONLY,
+	 check_snmp_realserver, 3, {4, 1, 27}},
 };
 
 void
@@ -4,8 +4,8 @@
  *              a loadbalanced server pool using multi-layer checks.
  *
  * Part:        SSL GET CHECK. Perform an ssl get query to a specified
- *              url, compute a MD5 over this result and match it to the
- *              expected value.
+ *              url, check the result (MD5, CRC32 or expected content)
+ *              against the expected value.
  *
  * Authors:     Alexandre Cassen, <acassen@linux-vs.org>
  *              Jan Holmberg, <jan@artech.net>
@@ -24,6 +24,7 @@
  */
 
 #include <openssl/err.h>
+#include <pthread.h>
 #include "check_ssl.h"
 #include "check_api.h"
 #include "logger.h"
@@ -33,6 +34,8 @@
 #include "utils.h"
 #include "html.h"
 
+static int ssl_session_new(SSL *, SSL_SESSION *);
+
 /* SSL primitives */
 /* Free an SSL context */
 void
@@ -57,6 +60,45 @@ password_cb(char *buf, int num, int rwflag, void *userdata)
 	return (plen);
 }
 
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+/* Pre 1.1 OpenSSL needs locking callbacks for checker threads */
+static pthread_mutex_t *ssl_locks;
+
+static void
+ssl_lock_cb(int mode, int n, const char *file, int line)
+{
+	if (mode & CRYPTO_LOCK)
+		pthread_mutex_lock(&ssl_locks[n]);
+	else
+		pthread_mutex_unlock(&ssl_locks[n]);
+}
+
+static unsigned long
+ssl_id_cb(void)
+{
+	return (unsigned long) pthread_self();
+}
+
+static void
+ssl_locks_init(void)
+{
+	int i;
+
+	/* Kept for the process lifetime, as the library init */
+	if (ssl_locks)
+		return;
+	ssl_locks = OPENSSL_malloc(CRYPTO_num_locks() * sizeof (pthread_mutex_t));
+	for (i = 0; i < CRYPTO_num_locks(); i++)
+		pthread_mutex_init(&ssl_locks[i], NULL);
+	CRYPTO_set_id_callback(ssl_id_cb);
+	CRYPTO_set_locking_callback(ssl_lock_cb);
+}
+#endif
+
+/* Handshakes done, full and resumed. Checker threads add to them. */
+static unsigned long ssl_handshakes_full;
+static unsigned long ssl_handshakes_resumed;
+
 /* Inititalize global SSL context */
 static BIO *bio_err = 0;
 static int
@@ -66,12 +108,15 @@ build_ssl_ctx(void)
 
 	/* Library initialization */
 	SSL_library_init();
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+	ssl_locks_init();
+#endif
 
 	SSL_load_error_strings();
 	bio_err = BIO_new_fp(stderr, BIO_NOCLOSE);
 
 	if (!check_data->ssl)
-		ssl = (ssl_data_t *) MALLOC(sizeof(ssl_data_t));
+		ssl = alloc_ssl();
 	else
 		ssl = check_data->ssl;
 
@@ -79,6 +124,16 @@ build_ssl_ctx(void)
 	ssl->meth = (SSL_METHOD *) SSLv23_method();
 	ssl->ctx = SSL_CTX_new(ssl->meth);
 
+	/* Sessions are cached per checker, for resumption */
+	SSL_CTX_set_session_cache_mode(ssl->ctx, SSL_SESS_CACHE_CLIENT |
+					 SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(ssl->ctx, ssl_session_new);
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+	/* A close without close_notify ends HTTP/1.0 bodies, it must
+	 * not be a fatal error : it makes the session not resumable */
+	SSL_CTX_set_options(ssl->ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+
 	/* return for autogen context */
 	if (!check_data->ssl) {
 		check_data->ssl = ssl;
@@ -187,6 +242,81 @@ ssl_printerr(int err)
 	return 0;
 }
 
+/* Drop the cached session of a checker */
+void
+ssl_session_flush(http_t *http)
+{
+	if (!http->session)
+		return;
+	SSL_SESSION_free(http->session);
+	http->session = NULL;
+}
+
+/* Offer the cached session of the checker, if not expired */
+static void
+ssl_session_resume(http_t *http, SSL *ssl)
+{
+	if (!http->session)
+		return;
+
+	if (timer_cmp(time_now, http->session_expire) >= 0) {
+		ssl_session_flush(http);
+		return;
+	}
+
+	SSL_set_session(ssl, http->session);
+}
+
+/*
+ * New session from the server, at handshake end or when a ticket
+ * comes after it (TLSv1.3). Keep it on the checker of the connection,
+ * taking the reference.
+ */
+static int
+ssl_session_new(SSL *ssl, SSL_SESSION *session)
+{
+	http_t *http = SSL_get_app_data(ssl);
+	long ttl = check_data->ssl->session_ttl;
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	long hint;
+#endif
+
+	if (!http || !ttl)
+		return 0;
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	/* Don't outlive the ticket lifetime the server gave */
+	hint = SSL_SESSION_get_ticket_lifetime_hint(session);
+	if (hint > 0 && hint * TIMER_HZ < ttl)
+		ttl = hint * TIMER_HZ;
+#endif
+	ssl_session_flush(http);
+	http->session = session;
+	http->session_expire = timer_add_long(time_now, ttl);
+	return 1;
+}
+
+/* Done with a connection */
+void
+ssl_release(http_t *http, SSL *ssl)
+{
+	/* Handshake failed, maybe on the session we offered */
+	if (!SSL_is_init_finished(ssl))
+		ssl_session_flush(http);
+
+	SSL_free(ssl);
+}
+
+/* Log handshake counters */
+void
+ssl_stats_dump(void)
+{
+	unsigned long full = __atomic_load_n(&ssl_handshakes_full, __ATOMIC_RELAXED);
+	unsigned long resumed = __atomic_load_n(&ssl_handshakes_resumed, __ATOMIC_RELAXED);
+
+	log_message(LOG_INFO, "SSL handshakes : %lu full, %lu resumed", full, resumed);
+}
+
 int
 ssl_connect(thread_t * thread, int new_req)
 {
@@ -195,23 +325,23 @@ ssl_connect(thread_t * thread, int new_req)
 	http_t *http = HTTP_ARG(http_get_check);
 	request_t *req = HTTP_REQ(http);
 	int ret = 0;
-	int val = 0;
 
 	/* First round, create SSL context */
 	if (new_req) {
 		req->ssl = SSL_new(check_data->ssl->ctx);
 		req->bio = BIO_new_socket(thread->u.fd, BIO_NOCLOSE);
 		SSL_set_bio(req->ssl, req->bio, req->bio);
+		SSL_set_app_data(req->ssl, http);
+		ssl_session_resume(http, req->ssl);
 	}
 
-	/* Set descriptor non blocking */
-	val = fcntl(thread->u.fd, F_GETFL, 0);
-	fcntl(thread->u.fd, F_SETFL, val | O_NONBLOCK);
-
+	/* The socket is nonblocking, SSL_connect() asks to wait as needed */
 	ret = SSL_connect(req->ssl);
 
-	/* restore descriptor flags */
-	fcntl(thread->u.fd, F_SETFL, val);
+	if (ret == 1)
+		__atomic_add_fetch(SSL_session_reused(req->ssl) ?
+				   &ssl_handshakes_resumed : &ssl_handshakes_full,
+				   1, __ATOMIC_RELAXED);
 
 	return ret;
 }
@@ -245,66 +375,60 @@ ssl_read_thread(thread_t * thread)
 	http_t *http = HTTP_ARG(http_get_check);
 	request_t *req = HTTP_REQ(http);
 	unsigned timeout = checker->co->connection_to;
-	unsigned char digest[16];
 	int r = 0;
-	int val;
+	int n;
 
 	/* Handle read timeout */
-	if (thread->type == THREAD_READ_TIMEOUT && !req->extracted)
+	if (thread->type == THREAD_READ_TIMEOUT && !HTTP_PARSE_HEADER_DONE(&req->parser))
 		return timeout_epilog(thread, "=> SSL CHECK failed on service"
 				      " : recevice data <=\n\n", "SSL read");
 
-	/* Set descriptor non blocking */
-	val = fcntl(thread->u.fd, F_GETFL, 0);
-	fcntl(thread->u.fd, F_SETFL, val | O_NONBLOCK);
-
-	/* read the SSL stream */
-	r = SSL_read(req->ssl, req->buffer + req->len,
-		     MAX_BUFFER_LENGTH - req->len);
-
-	/* restore descriptor flags */
-	fcntl(thread->u.fd, F_SETFL, val);
-
-	req->error = SSL_get_error(req->ssl, r);
+	/* Drain the SSL stream until it would block, as for plain HTTP */
+	for (n = 0; n < HTTP_READ_BATCH; n++) {
+		CHECKER_SYSCALL(READ);
+		r = SSL_read(req->ssl, req->buffer, MAX_BUFFER_LENGTH);
+		req->error = SSL_get_error(req->ssl, r);
+		if (r <= 0 || req->error)
+			break;
 
-	if (req->error == SSL_ERROR_WANT_READ) {
-		 /* async read unfinished */ 
-		thread_add_read(thread->master, ssl_read_thread, checker,
-				thread->u.fd, timeout);
-	} else if (r > 0 && req->error == 0) {
 		/* Handle response stream */
 		http_process_response(req, r);
 
-		/*
-		 * Register next ssl stream reader.
-		 * Register itself to not perturbe global I/O multiplexer.
-		 */
+		/* Response complete or checked, don't wait for the close */
+		if (req->done) {
+			http_handle_response(thread, 0);
+			return 0;
+		}
+	}
+
+	if (req->error == SSL_ERROR_WANT_READ || (r > 0 && !req->error)) {
+		/* async read unfinished, or batch used up */
 		thread_add_read(thread->master, ssl_read_thread, checker,
 				thread->u.fd, timeout);
+	} else if (req->error && req->reused && !HTTP_PARSE_STARTED(&req->parser)) {
+		/* Kept connection closed meanwhile by the server */
+		return http_reconnect(thread);
 	} else if (req->error) {
 
 		/* All the SSL streal has been parsed */
-		MD5_Final(digest, &req->context);
 		SSL_set_quiet_shutdown(req->ssl, 1);
 
 		r = (req->error == SSL_ERROR_ZERO_RETURN) ? SSL_shutdown(req->ssl) : 0;
 
-		if (r && !req->extracted) {
+		if (r && !HTTP_PARSE_HEADER_DONE(&req->parser)) {
 			/* check if server is currently alive */
-			if (svr_checker_up(checker->id, checker->rs)) {
-				smtp_alert(checker->rs, NULL, NULL,
-					   "DOWN",
-					   "=> SSL CHECK failed on service"
-					   " : cannot receive data <=\n\n");
-				update_svr_checker_state(DOWN, checker->id
-							     , checker->vs
-							     , checker->rs);
+			if (CHECKER_IS_UP(checker)) {
+				checker_alert(checker,
+					      "DOWN",
+					      "=> SSL CHECK failed on service"
+					      " : cannot receive data <=\n\n");
+				checker_update_state(checker, DOWN);
 			}
 			return epilog(thread, 1, 0, 0);
 		}
 
 		/* Handle response stream */
-		http_handle_response(thread, digest, (!req->extracted) ? 1 : 0);
+		http_handle_response(thread, !HTTP_PARSE_HEADER_DONE(&req->parser));
 
 	}
 
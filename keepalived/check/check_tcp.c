@@ -47,11 +47,19 @@ dump_tcp_check(void *data)
 	dump_conn_opts (CHECKER_GET_CO());
 }
 
+/* Nothing but connection options, already compared */
+static int
+compare_tcp_check(checker_t *a, checker_t *b)
+{
+	return 1;
+}
+
 void
 tcp_check_handler(vector_t *strvec)
 {
 	/* queue new checker */
-	queue_checker(free_tcp_check, dump_tcp_check, tcp_connect_thread, NULL, CHECKER_NEW_CO());
+	queue_checker(free_tcp_check, dump_tcp_check, tcp_connect_thread,
+		      compare_tcp_check, NULL, CHECKER_NEW_CO());
 }
 
 void
@@ -78,38 +86,36 @@ tcp_check_thread(thread_t * thread)
 	 * Otherwise we have a real connection error or connection timeout.
 	 */
 	if (status == connect_success) {
-		close(thread->u.fd);
+		CHECKER_CLOSE(thread->u.fd);
 
-		if (!svr_checker_up(checker->id, checker->rs)) {
+		if (!CHECKER_IS_UP(checker)) {
 			log_message(LOG_INFO, "TCP connection to %s success."
 					, FMT_TCP_RS(checker));
-			smtp_alert(checker->rs, NULL, NULL,
-				   "UP",
-				   "=> TCP CHECK succeed on service <=");
-			update_svr_checker_state(UP, checker->id
-						   , checker->vs
-						   , checker->rs);
+			checker_alert(checker,
+				      "UP",
+				      "=> TCP CHECK succeed on service <=");
+			checker_update_state(checker, UP);
 		}
 
 	} else {
 
-		if (svr_checker_up(checker->id, checker->rs)) {
+		if (CHECKER_IS_UP(checker)) {
 			log_message(LOG_INFO, "TCP connection to %s failed !!!"
 					, FMT_TCP_RS(checker));
-			smtp_alert(checker->rs, NULL, NULL,
-				   "DOWN",
-				   "=> TCP CHECK failed on service <=");
-			update_svr_checker_state(DOWN, checker->id
-						     , checker->vs
-						     , checker->rs);
+			checker_alert(checker,
+				      "DOWN",
+				      "=> TCP CHECK failed on service <=");
+			checker_update_state(checker, DOWN);
 		}
 
 	}
 
 	/* Register next timer checker */
-	if (status != connect_in_progress)
+	if (status != connect_in_progress) {
+		checker_release(checker);
 		thread_add_timer(thread->master, tcp_connect_thread, checker,
-				 checker->vs->delay_loop);
+				 checker_delay(checker));
+	}
 	return 0;
 }
 
@@ -119,7 +125,6 @@ tcp_connect_thread(thread_t * thread)
 	checker_t *checker = THREAD_ARG(thread);
 	conn_opts_t *co = checker->co;
 	int fd;
-	int status;
 
 	/*
 	 * Register a new checker thread & return
@@ -131,7 +136,12 @@ tcp_connect_thread(thread_t * thread)
 		return 0;
 	}
 
-	if ((fd = socket(co->dst.ss_family, SOCK_STREAM, IPPROTO_TCP)) == -1) {
+	if (!checker_admit(thread))
+		return 0;
+
+	CHECKER_PROBE();
+	if ((fd = CHECKER_SOCKET(co->dst.ss_family)) == -1) {
+		checker_release(checker);
 		log_message(LOG_INFO, "TCP connect fail to create socket. Rescheduling.");
 		thread_add_timer(thread->master, tcp_connect_thread, checker,
 				checker->vs->delay_loop);
@@ -139,12 +149,11 @@ tcp_connect_thread(thread_t * thread)
 		return 0;
 	}
 
-	status = tcp_bind_connect(fd, co);
-
-	/* handle tcp connection status & register check worker thread */
-	if(tcp_connection_state(fd, status, thread, tcp_check_thread,
-			co->connection_to)) {
-		close(fd);
+	/* connect & register check worker thread */
+	if (tcp_async_connect(fd, co, thread, tcp_check_thread,
+			      co->connection_to)) {
+		CHECKER_CLOSE(fd);
+		checker_release(checker);
 		log_message(LOG_INFO, "TCP socket bind failed. Rescheduling.");
 		thread_add_timer(thread->master, tcp_connect_thread, checker,
 				checker->vs->delay_loop);
@@ -0,0 +1,425 @@
+/*
+ * Soft:        Keepalived is a failover program for the LVS project
+ *              <www.linuxvirtualserver.org>. It monitor & manipulate
+ *              a loadbalanced server pool using multi-layer checks.
+ *
+ * Part:        Checker worker threads. Network checkers are sharded
+ *              over N pthreads, each one running its own scheduler
+ *              master. Workers never touch IPVS nor shared data, they
+ *              post state transitions and alerts to the main thread.
+ *
+ * Author:      Alexandre Cassen, <acassen@linux-vs.org>
+ *
+ *              This program is distributed in the hope that it will be useful,
+ *              but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *              MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *              See the GNU General Public License for more details.
+ *
+ *              This program is free software; you can redistribute it and/or
+ *              modify it under the terms of the GNU General Public License
+ *              as published by the Free Software Foundation; either version
+ *              2 of the License, or (at your option) any later version.
+ *
+ * Copyright (C) 2001-2012 Alexandre Cassen, <acassen@gmail.com>
+ */
+
+#include <unistd.h>
+#include <signal.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/eventfd.h>
+#include "check_worker.h"
+#include "check_misc.h"
+#include "check_data.h"
+#include "global_data.h"
+#include "ipwrapper.h"
+#include "smtp.h"
+#include "memory.h"
+#include "logger.h"
+#include "utils.h"
+
+/* Workers */
+static checker_worker_t *workers;
+static int nworkers;
+
+/* Workers log their statistics one at a time */
+static pthread_mutex_t dump_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Workers to main thread queue. Intrusive MPSC list : producers swap
+ * the head and then link the previous one, the main thread consumes
+ * from the tail. The stub node keeps the list never empty.
+ */
+static checker_msg_t msg_stub;
+static checker_msg_t *msg_head = &msg_stub;
+static checker_msg_t *msg_tail = &msg_stub;
+static int msg_fd = -1;
+static thread_t *msg_thread;
+
+static void
+checker_msg_push(checker_msg_t *msg)
+{
+	checker_msg_t *prev;
+
+	msg->next = NULL;
+	prev = __atomic_exchange_n(&msg_head, msg, __ATOMIC_ACQ_REL);
+	__atomic_store_n(&prev->next, msg, __ATOMIC_RELEASE);
+}
+
+static checker_msg_t *
+checker_msg_pop(void)
+{
+	checker_msg_t *tail = msg_tail;
+	checker_msg_t *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+	if (tail == &msg_stub) {
+		if (!next)
+			return NULL;
+		msg_tail = next;
+		tail = next;
+		next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	}
+
+	if (next) {
+		msg_tail = next;
+		return tail;
+	}
+
+	/* A producer is linking, it will wake us up when done */
+	if (tail != __atomic_load_n(&msg_head, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	checker_msg_push(&msg_stub);
+	next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	if (next) {
+		msg_tail = next;
+		return tail;
+	}
+
+	return NULL;
+}
+
+static char *
+checker_msg_strdup(const char *str)
+{
+	int size;
+	char *new;
+
+	if (!str)
+		return NULL;
+
+	size = strlen(str);
+	new = (char *) MALLOC(size + 1);
+	memcpy(new, str, size + 1);
+	return new;
+}
+
+/* Worker side, post a message to the main thread */
+void
+checker_worker_post(int type, checker_t *checker, int alive
+		    , const char *subject, const char *body)
+{
+	checker_msg_t *msg = (checker_msg_t *) MALLOC(sizeof (checker_msg_t));
+	uint64_t one = 1;
+
+	msg->type = type;
+	msg->checker = checker;
+	msg->alive = alive;
+	msg->subject = checker_msg_strdup(subject);
+	msg->body = checker_msg_strdup(body);
+	checker_msg_push(msg);
+
+	if (write(msg_fd, &one, sizeof (one)) < 0)
+		DBG("checker message wakeup error : %s", strerror(errno));
+}
+
+/* Main thread side, apply a message */
+static void
+checker_msg_run(checker_msg_t *msg)
+{
+	checker_t *checker = msg->checker;
+
+	switch (msg->type) {
+	case CHECKER_MSG_STATE:
+		update_svr_checker_state(msg->alive, checker->id
+					 , checker->vs
+					 , checker->rs);
+		break;
+	case CHECKER_MSG_ALERT:
+		smtp_alert(checker->rs, NULL, NULL, msg->subject, msg->body);
+		break;
+	}
+
+	FREE_PTR(msg->subject);
+	FREE_PTR(msg->body);
+	FREE(msg);
+}
+
+static void
+checker_msg_drain(void)
+{
+	checker_msg_t *msg;
+
+	while ((msg = checker_msg_pop()))
+		checker_msg_run(msg);
+}
+
+static int
+checker_msg_thread(thread_t *thread)
+{
+	uint64_t count;
+
+	if (thread->type == THREAD_READY_FD &&
+	    read(thread->u.fd, &count, sizeof (count)) < 0)
+		DBG("checker message read error : %s", strerror(errno));
+
+	checker_msg_drain();
+
+	msg_thread = thread_add_read(thread->master, checker_msg_thread, NULL
+				     , thread->u.fd, CHECKER_WORKER_TIMER);
+	return 0;
+}
+
+/* Worker side, scheduler statistics are per pthread */
+static void
+checker_worker_dump(checker_worker_t *worker)
+{
+	pthread_mutex_lock(&dump_lock);
+	log_message(LOG_INFO, "Checker thread %d :", worker->index);
+	thread_stats_dump();
+	pthread_mutex_unlock(&dump_lock);
+}
+
+/* Worker side, main thread asks us to stop or to dump statistics */
+static int
+checker_worker_stop_thread(thread_t *thread)
+{
+	checker_worker_t *worker = THREAD_ARG(thread);
+	uint64_t count;
+
+	if (thread->type == THREAD_READY_FD &&
+	    read(thread->u.fd, &count, sizeof (count)) < 0)
+		DBG("checker thread wakeup read error : %s", strerror(errno));
+
+	if (__atomic_exchange_n(&worker->dump, 0, __ATOMIC_ACQ_REL))
+		checker_worker_dump(worker);
+
+	if (__atomic_load_n(&worker->stop, __ATOMIC_ACQUIRE)) {
+		thread_add_terminate_event(thread->master);
+		return 0;
+	}
+
+	thread_add_read(thread->master, checker_worker_stop_thread
+			, worker, thread->u.fd, CHECKER_WORKER_TIMER);
+	return 0;
+}
+
+/* Worker thread, run its own scheduler over its checkers shard */
+static void *
+checker_worker_run(void *arg)
+{
+	checker_worker_t *worker = arg;
+	thread_master_t *m;
+	checker_t *checker;
+	thread_t thread;
+	element e;
+
+	m = thread_make_master();
+	m->worker = 1;
+	thread_set_budget(m, global_data->sched_budget);
+	thread_set_slack(m, global_data->checker_timer_slack);
+	checker_limit_attach(m, worker->index + 1);
+	thread_add_read(m, checker_worker_stop_thread, worker
+			, worker->stop_fd, CHECKER_WORKER_TIMER);
+
+	/* time_now is per thread, still unset in a new one */
+	set_time_now();
+	for (e = LIST_HEAD(checkers_queue); e; ELEMENT_NEXT(e)) {
+		checker = ELEMENT_DATA(e);
+		if (checker->worker != worker->index || !CHECKER_LAUNCHED(checker))
+			continue;
+
+		/* Same startup spreading than the main thread */
+		thread_add_timer(m, checker->launch, checker,
+				 checker_start_delay(checker, &worker->seed));
+	}
+
+	while (thread_fetch(m, &thread))
+		thread_call(&thread);
+
+	thread_destroy_master(m);
+	thread_pool_destroy();
+	return NULL;
+}
+
+/*
+ * Set the number of workers for the checkers about to be registered,
+ * returns how many are used.
+ */
+int
+checker_workers_init(int count)
+{
+	if (count > CHECKER_WORKERS_MAX)
+		count = CHECKER_WORKERS_MAX;
+#ifdef _DEBUG_
+	/* Memory debugging allocator is not thread safe */
+	if (count > 0)
+		log_message(LOG_INFO, "Checker threads disabled in debug mode");
+	count = 0;
+#endif
+	if (count <= 0)
+		return 0;
+
+	nworkers = count;
+	workers = (checker_worker_t *) MALLOC(nworkers * sizeof (checker_worker_t));
+	return nworkers;
+}
+
+/* Pick the worker of a checker, -1 for the main thread */
+int
+checker_worker_assign(checker_t *checker)
+{
+	struct sockaddr_storage *addr = &checker->rs->addr;
+	unsigned char *p;
+	unsigned int hash = 2166136261U;
+	int i, len;
+
+	/* MISC_CHECK forks and reaps children, main thread only */
+	if (!nworkers || checker->launch == misc_check_thread)
+		return -1;
+
+	/* FNV-1a of the real server address, keep its checkers together */
+	if (addr->ss_family == AF_INET6) {
+		p = (unsigned char *) &((struct sockaddr_in6 *) addr)->sin6_addr;
+		len = sizeof (struct in6_addr);
+	} else {
+		p = (unsigned char *) &((struct sockaddr_in *) addr)->sin_addr;
+		len = sizeof (struct in_addr);
+	}
+	for (i = 0; i < len; i++)
+		hash = (hash ^ p[i]) * 16777619U;
+	hash = (hash ^ inet_sockaddrport(addr)) * 16777619U;
+
+	return hash % nworkers;
+}
+
+/* Run the checkers of a worker from the main thread */
+static void
+checker_worker_fallback(checker_worker_t *worker)
+{
+	checker_t *checker;
+	element e;
+
+	checker_limit_handover(worker->index + 1);
+	for (e = LIST_HEAD(checkers_queue); e; ELEMENT_NEXT(e)) {
+		checker = ELEMENT_DATA(e);
+		if (checker->worker != worker->index)
+			continue;
+		checker->worker = -1;
+		if (CHECKER_LAUNCHED(checker))
+			thread_add_timer(master, checker->launch, checker,
+					 checker_start_delay(checker, NULL));
+	}
+}
+
+/* Start workers once checkers are assigned */
+void
+checker_workers_start(void)
+{
+	checker_worker_t *worker;
+	sigset_t set, old;
+	int i, started = 0;
+
+	if (!nworkers)
+		return;
+
+	msg_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (msg_fd < 0) {
+		log_message(LOG_INFO, "Checker threads : eventfd error (%s)"
+				    , strerror(errno));
+		for (i = 0; i < nworkers; i++)
+			checker_worker_fallback(&workers[i]);
+		return;
+	}
+	msg_thread = thread_add_read(master, checker_msg_thread, NULL
+				     , msg_fd, CHECKER_WORKER_TIMER);
+
+	/* Signals are for the main thread only */
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+
+	for (i = 0; i < nworkers; i++) {
+		worker = &workers[i];
+		worker->index = i;
+		worker->seed = (unsigned int) time(NULL) + i;
+		worker->stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (worker->stop_fd < 0 ||
+		    pthread_create(&worker->tid, NULL, checker_worker_run, worker)) {
+			log_message(LOG_INFO, "Checker thread %d : cannot start,"
+					      " using main thread", i);
+			if (worker->stop_fd >= 0)
+				close(worker->stop_fd);
+			checker_worker_fallback(worker);
+			continue;
+		}
+		worker->running = 1;
+		started++;
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	log_message(LOG_INFO, "Started %d checker threads", started);
+}
+
+/* Have running workers log their scheduler statistics */
+void
+checker_workers_dump(void)
+{
+	uint64_t one = 1;
+	int i;
+
+	for (i = 0; i < nworkers; i++) {
+		if (!workers[i].running)
+			continue;
+		__atomic_store_n(&workers[i].dump, 1, __ATOMIC_RELEASE);
+		if (write(workers[i].stop_fd, &one, sizeof (one)) < 0)
+			DBG("checker thread wakeup error : %s", strerror(errno));
+	}
+}
+
+/* Stop workers and apply what they posted */
+void
+checker_workers_stop(void)
+{
+	uint64_t one = 1;
+	int i;
+
+	if (!nworkers)
+		return;
+
+	for (i = 0; i < nworkers; i++) {
+		if (!workers[i].running)
+			continue;
+		__atomic_store_n(&workers[i].stop, 1, __ATOMIC_RELEASE);
+		if (write(workers[i].stop_fd, &one, sizeof (one)) < 0)
+			DBG("checker thread stop error : %s", strerror(errno));
+	}
+
+	for (i = 0; i < nworkers; i++) {
+		if (!workers[i].running)
+			continue;
+		pthread_join(workers[i].tid, NULL);
+		close(workers[i].stop_fd);
+	}
+
+	FREE(workers);
+	workers = NULL;
+	nworkers = 0;
+
+	if (msg_fd < 0)
+		return;
+	checker_msg_drain();
+	thread_cancel(msg_thread);
+	msg_thread = NULL;
+	close(msg_fd);
+	msg_fd = -1;
+}
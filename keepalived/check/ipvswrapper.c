@@ -27,6 +27,7 @@
 #include "utils.h"
 #include "memory.h"
 #include "logger.h"
+#include "signals.h"
 
 /* local helpers functions */
 static int parse_timeout(char *, unsigned *);
@@ -968,6 +969,7 @@ modprobe_ipvs(void)
 	int rc;
 
 	if (!(child = fork())) {
+		signal_handler_destroy();
 		execv(argv[0], argv);
 		exit(1);
 	}
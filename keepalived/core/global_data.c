@@ -180,6 +180,24 @@ dump_global_data(data_t * data)
 		log_message(LOG_INFO, " VRRP IPv6 mcast group = %s"
 				    , inet_sockaddrtos(&data->vrrp_mcast_group4));
 	}
+	if (data->sched_budget)
+		log_message(LOG_INFO, " Scheduler budget = %d", data->sched_budget);
+	if (data->checker_threads)
+		log_message(LOG_INFO, " Checker threads = %d", data->checker_threads);
+	if (data->checker_timer_slack)
+		log_message(LOG_INFO, " Checker timer slack = %ld ms"
+				    , data->checker_timer_slack / (TIMER_HZ / 1000));
+	if (data->checker_phase_spread)
+		log_message(LOG_INFO, " Checker phase spreading enabled");
+	if (data->checker_max_inflight)
+		log_message(LOG_INFO, " Checker max in flight = %ld"
+				    , data->checker_max_inflight);
+	if (data->checker_connect_rate)
+		log_message(LOG_INFO, " Checker connect rate = %ld/s, burst %ld"
+				    , data->checker_connect_rate
+				    , (data->checker_connect_burst) ?
+				      data->checker_connect_burst :
+				      data->checker_connect_rate);
 #ifdef _WITH_SNMP_
 	if (data->enable_traps)
 		log_message(LOG_INFO, " SNMP Trap enabled");
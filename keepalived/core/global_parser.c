@@ -67,6 +67,42 @@ smtpip_handler(vector_t *strvec)
 	inet_stosockaddr(vector_slot(strvec, 1), SMTP_PORT_STR, &global_data->smtp_server);
 }
 static void
+sched_budget_handler(vector_t *strvec)
+{
+	global_data->sched_budget = atoi(vector_slot(strvec, 1));
+}
+static void
+checker_threads_handler(vector_t *strvec)
+{
+	global_data->checker_threads = atoi(vector_slot(strvec, 1));
+}
+static void
+checker_timer_slack_handler(vector_t *strvec)
+{
+	/* milliseconds, "50" or "50ms" */
+	global_data->checker_timer_slack = atol(vector_slot(strvec, 1)) * (TIMER_HZ / 1000);
+}
+static void
+checker_phase_spread_handler(vector_t *strvec)
+{
+	global_data->checker_phase_spread = 1;
+}
+static void
+checker_max_inflight_handler(vector_t *strvec)
+{
+	global_data->checker_max_inflight = atol(vector_slot(strvec, 1));
+}
+static void
+checker_connect_rate_handler(vector_t *strvec)
+{
+	global_data->checker_connect_rate = atol(vector_slot(strvec, 1));
+}
+static void
+checker_connect_burst_handler(vector_t *strvec)
+{
+	global_data->checker_connect_burst = atol(vector_slot(strvec, 1));
+}
+static void
 email_handler(vector_t *strvec)
 {
 	vector_t *email_vec = read_value_block();
@@ -126,6 +162,13 @@ global_init_keywords(void)
 	install_keyword("notification_email", &email_handler);
 	install_keyword("vrrp_mcast_group4", &vrrp_mcast_group4_handler);
 	install_keyword("vrrp_mcast_group6", &vrrp_mcast_group6_handler);
+	install_keyword("scheduler_budget", &sched_budget_handler);
+	install_keyword("checker_threads", &checker_threads_handler);
+	install_keyword("checker_timer_slack", &checker_timer_slack_handler);
+	install_keyword("checker_phase_spread", &checker_phase_spread_handler);
+	install_keyword("checker_max_inflight", &checker_max_inflight_handler);
+	install_keyword("checker_connect_rate", &checker_connect_rate_handler);
+	install_keyword("checker_connect_burst", &checker_connect_burst_handler);
 #ifdef _WITH_SNMP_
 	install_keyword("enable_traps", &trap_handler);
 #endif
@@ -25,27 +25,32 @@
 #include "utils.h"
 #include "logger.h"
 
-enum connect_result
-tcp_bind_connect(int fd, conn_opts_t *co)
+unsigned long checker_syscalls[CHECKER_SYS_MAX];
+unsigned long checker_probes;
+
+/* Connects checker sockets in place of the network when set */
+enum connect_result (*tcp_connect_hook) (int, conn_opts_t *);
+
+/* Socket options and source address of a checker connection */
+static enum connect_result
+tcp_socket_bind(int fd, conn_opts_t *co)
 {
 	struct linger li = { 0 };
 	socklen_t addrlen;
-	int ret;
-	int val;
-	struct sockaddr_storage *addr = &co->dst;
 	struct sockaddr_storage *bind_addr = &co->bindto;
 
-	/* free the tcp port after closing the socket descriptor */
+	/*
+	 * free the tcp port after closing the socket descriptor, a probe
+	 * every few seconds would otherwise pile up TIME_WAIT sockets.
+	 */
 	li.l_onoff = 1;
 	li.l_linger = 0;
+	CHECKER_SYSCALL(SETUP);
 	setsockopt(fd, SOL_SOCKET, SO_LINGER, (char *) &li, sizeof (struct linger));
 
-	/* Make socket non-block. */
-	val = fcntl(fd, F_GETFL, 0);
-	fcntl(fd, F_SETFL, val | O_NONBLOCK);
-
 #ifdef _WITH_SO_MARK_
 	if (co->fwmark) {
+		CHECKER_SYSCALL(SETUP);
 		if (setsockopt (fd, SOL_SOCKET, SO_MARK, &co->fwmark, sizeof (co->fwmark)) < 0) {
 			log_message(LOG_ERR, "Error setting fwmark %d to socket: %s", co->fwmark, strerror(errno));
 			return connect_error;
@@ -56,31 +61,50 @@ tcp_bind_connect(int fd, conn_opts_t *co)
 	/* Bind socket */
 	if (((struct sockaddr *) bind_addr)->sa_family != AF_UNSPEC) {
 		addrlen = sizeof(*bind_addr);
+		CHECKER_SYSCALL(SETUP);
 		if (bind(fd, (struct sockaddr *) bind_addr, addrlen) != 0)
 			return connect_error;
 	}
 
+	return connect_success;
+}
+
+/*
+ * Non blocking connect of a prepared socket. Sockets are created
+ * with SOCK_NONBLOCK and stay so, no flags juggling is needed.
+ */
+static enum connect_result
+tcp_nonblock_connect(int fd, conn_opts_t *co)
+{
+	struct sockaddr_storage *addr = &co->dst;
+	socklen_t addrlen;
+	int ret;
+
 	/* Set remote IP and connect */
 	addrlen = sizeof(*addr);
+	CHECKER_SYSCALL(CONNECT);
 	ret = connect(fd, (struct sockaddr *) addr, addrlen);
 
 	/* Immediate success */
-	if (ret == 0) {
-		fcntl(fd, F_SETFL, val);
+	if (ret == 0)
 		return connect_success;
-	}
 
 	/* If connect is in progress then return 1 else it's real error. */
-	if (ret < 0) {
-		if (errno != EINPROGRESS)
-			return connect_error;
-	}
+	if (errno != EINPROGRESS)
+		return connect_error;
 
-	/* restore previous fd args */
-	fcntl(fd, F_SETFL, val);
 	return connect_in_progress;
 }
 
+enum connect_result
+tcp_bind_connect(int fd, conn_opts_t *co)
+{
+	if (tcp_socket_bind(fd, co) != connect_success)
+		return connect_error;
+
+	return tcp_nonblock_connect(fd, co);
+}
+
 enum connect_result
 tcp_connect(int fd, struct sockaddr_storage *addr)
 {
@@ -100,18 +124,28 @@ tcp_socket_state(int fd, thread_t * thread, int (*func) (thread_t *))
 
 	/* Handle connection timeout */
 	if (thread->type == THREAD_WRITE_TIMEOUT) {
-		close(thread->u.fd);
+		CHECKER_CLOSE(thread->u.fd);
 		return connect_timeout;
 	}
 
+	/* io_uring already reported the connect result */
+	if (thread->type == THREAD_IO_DONE) {
+		if (THREAD_IO_RESULT(thread) < 0) {
+			CHECKER_CLOSE(thread->u.fd);
+			return connect_error;
+		}
+		return connect_success;
+	}
+
 	/* Check file descriptor */
 	addrlen = sizeof(status);
+	CHECKER_SYSCALL(SETUP);
 	if (getsockopt(thread->u.fd, SOL_SOCKET, SO_ERROR, (void *) &status, &addrlen) < 0)
 		ret = errno;
 
 	/* Connection failed !!! */
 	if (ret) {
-		close(thread->u.fd);
+		CHECKER_CLOSE(thread->u.fd);
 		return connect_error;
 	}
 
@@ -126,7 +160,7 @@ tcp_socket_state(int fd, thread_t * thread, int (*func) (thread_t *))
 				 thread->u.fd, timer_long(timer_min));
 		return connect_in_progress;
 	} else if (status != 0) {
-		close(thread->u.fd);
+		CHECKER_CLOSE(thread->u.fd);
 		return connect_error;
 	}
 
@@ -155,3 +189,55 @@ tcp_connection_state(int fd, enum connect_result status, thread_t * thread,
 		return 1;
 	}
 }
+
+/*
+ * Connect a checker socket and register func to handle the result.
+ * io_uring does the whole connect in one submission when available,
+ * otherwise the non blocking connect is polled for writability.
+ */
+int
+tcp_async_connect(int fd, conn_opts_t *co, thread_t * thread,
+		  int (*func) (thread_t *), long timeout)
+{
+	enum connect_result status;
+
+	/* Simulation runs script the peer on fd themselves */
+	if (tcp_connect_hook) {
+		status = tcp_connect_hook(fd, co);
+		return tcp_connection_state(fd, status, thread, func, timeout);
+	}
+
+	if (tcp_socket_bind(fd, co) != connect_success)
+		return 1;
+
+	if (thread_add_connect(thread->master, func, THREAD_ARG(thread), fd,
+			       &co->dst, timeout))
+		return 0;
+
+	status = tcp_nonblock_connect(fd, co);
+	return tcp_connection_state(fd, status, thread, func, timeout);
+}
+
+/* Average syscalls made by a checker probe, on SIGUSR1 */
+void
+checker_syscalls_dump(void)
+{
+	static const char *names[CHECKER_SYS_MAX] = {
+		"socket", "setup", "connect", "read", "write", "close"
+	};
+	unsigned long probes = __atomic_load_n(&checker_probes, __ATOMIC_RELAXED);
+	unsigned long count, total = 0;
+	int i;
+
+	if (!probes)
+		return;
+
+	for (i = 0; i < CHECKER_SYS_MAX; i++) {
+		count = __atomic_load_n(&checker_syscalls[i], __ATOMIC_RELAXED);
+		total += count;
+		log_message(LOG_INFO, "Checker syscalls : %-7s %lu, %.2f per probe",
+			    names[i], count, (double) count / probes);
+	}
+	log_message(LOG_INFO, "Checker syscalls : %lu probes, %.2f per probe",
+		    probes, (double) total / probes);
+}
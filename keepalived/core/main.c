@@ -56,6 +56,7 @@ stop_keepalived(void)
 	/* Just cleanup memory & exit */
 	signal_handler_destroy();
 	thread_destroy_master(master);
+	thread_pool_destroy();
 
 	pidfile_rm(main_pidfile);
 
@@ -97,6 +98,19 @@ sighup(void *v, int sig)
 		kill(checkers_child, SIGHUP);
 }
 
+/* SIGUSR1 handler */
+void
+sigusr1(void *v, int sig)
+{
+	thread_stats_dump();
+
+	/* Signal child process */
+	if (vrrp_child > 0)
+		kill(vrrp_child, SIGUSR1);
+	if (checkers_child > 0)
+		kill(checkers_child, SIGUSR1);
+}
+
 /* Terminate handler */
 void
 sigend(void *v, int sig)
@@ -124,6 +138,7 @@ signal_init(void)
 	signal_set(SIGHUP, sighup, NULL);
 	signal_set(SIGINT, sigend, NULL);
 	signal_set(SIGTERM, sigend, NULL);
+	signal_set(SIGUSR1, sigusr1, NULL);
 	signal_ignore(SIGPIPE);
 }
 
@@ -23,6 +23,7 @@
  */
 
 #include <time.h>
+#include <fcntl.h>
 
 #include "smtp.h"
 #include "global_data.h"
@@ -138,6 +139,12 @@ connection_success(thread_t * thread)
 	log_message(LOG_INFO, "Remote SMTP server %s connected."
 			    , FMT_SMTP_HOST());
 
+	/*
+	 * Only the connect was nonblocking. Commands and the body are
+	 * sent in one go, a short send would truncate the alert.
+	 */
+	fcntl(smtp->fd, F_SETFL, fcntl(smtp->fd, F_GETFL, 0) & ~O_NONBLOCK);
+
 	smtp->stage = connect_success;
 	thread_add_read(thread->master, smtp_read_thread, smtp,
 			smtp->fd, global_data->smtp_connection_to);
@@ -560,8 +567,12 @@ static void
 smtp_connect(smtp_t * smtp)
 {
 	enum connect_result status;
+	thread_t *thread;
 
-	if ((smtp->fd = socket(global_data->smtp_server.ss_family, SOCK_STREAM, IPPROTO_TCP)) == -1) {
+	/* Nonblocking connect, tcp_connect() expects it */
+	if ((smtp->fd = socket(global_data->smtp_server.ss_family,
+			       SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			       IPPROTO_TCP)) == -1) {
 		DBG("SMTP connect fail to create socket.");
 		free_smtp_all(smtp);
 		return;
@@ -569,8 +580,9 @@ smtp_connect(smtp_t * smtp)
 
 	status = tcp_connect(smtp->fd, &global_data->smtp_server);
 
-	/* Handle connection status code */
-	thread_add_event(master, SMTP_FSM[status].send, smtp, smtp->fd);
+	/* Handle connection status code, alerting is background work */
+	thread = thread_add_event(master, SMTP_FSM[status].send, smtp, smtp->fd);
+	thread_set_priority(thread, THREAD_PRIO_BACKGROUND);
 }
 
 /* Main entry point */
@@ -43,6 +43,7 @@ typedef struct _checker {
 	void				(*dump_func) (void *);
 	int				(*launch) (struct _thread *);
 	int				(*plugin_launch) (void *);
+	int				(*compare_func) (struct _checker *, struct _checker *);
 	virtual_server_t		*vs;	/* pointer to the checker thread virtualserver */
 	real_server_t			*rs;	/* pointer to the checker thread realserver */
 	void				*data;
@@ -50,11 +51,56 @@ typedef struct _checker {
 	int				enabled;/* Activation flag */
 	conn_opts_t			*co; /* connection options */
 	long				warmup;	/* max random timeout to start checker */
+	int				is_up;	/* rs state seen by this checker */
+	int				worker;	/* running worker, -1 for main thread */
+	long				delay;	/* current probe interval, 0 before the first */
+	int				was_up;	/* state at the previous interval update */
+	int				admitted; /* holds a connect admission slot */
+	unsigned int			phase;	/* slot in the interval, in 1/2^32 */
+	struct _checker			*probe;	/* checker probing for us, NULL if self */
+	struct _checker			*next_shared; /* next one sharing our probe */
 } checker_t;
 
 /* Checkers queue */
 extern list checkers_queue;
 
+/* Connect thread deferred by the admission limits */
+typedef struct _checker_wait {
+	timeval_t			deadline; /* when it was due */
+	int				(*func) (struct _thread *);
+	checker_t			*checker;
+} checker_wait_t;
+
+/*
+ * Connect admission of a checker thread. A token bucket bounds the
+ * connect rate and max_inflight the probes running at once, from
+ * their connect to their result. Each thread owns its share of the
+ * global limits, no lock is taken.
+ */
+typedef struct _checker_limit {
+	thread_master_t			*master;
+	thread_t			*timer;	/* waiting for the next token */
+	long				max_inflight;	/* 0 for no limit */
+	long				inflight;
+	long				rate;	/* tokens per second, 0 for no limit */
+	long				burst;	/* bucket size, in tokens */
+	long				tokens;	/* in 1/TIMER_HZ of token */
+	timeval_t			refill;	/* last bucket refill */
+	checker_wait_t			*wait;	/* min-heap by deadline */
+	int				depth;
+	int				size;
+
+	/* Statistics, read by the main thread */
+	unsigned long			admitted;
+	unsigned long			deferred;
+	unsigned long			wait_total;	/* usec */
+	long				wait_max;	/* usec */
+	int				depth_max;
+} checker_limit_t;
+
+/* Event value of a connect thread already admitted */
+#define CHECKER_ADMITTED	1
+
 /* utility macro */
 #define CHECKER_ARG(X) ((X)->data)
 #define CHECKER_CO(X) (((checker_t *)X)->co)
@@ -69,6 +115,8 @@ extern list checkers_queue;
 #define CHECKER_ENABLE(C)  ((C)->enabled = 1)
 #define CHECKER_DISABLE(C) ((C)->enabled = 0)
 #define CHECKER_HA_SUSPEND(C) ((C)->vs->ha_suspend)
+#define CHECKER_IS_UP(C) ((C)->is_up)
+#define CHECKER_LAUNCHED(C) ((C)->launch && !(C)->probe)
 #define CHECKER_NEW_CO() ((conn_opts_t *) MALLOC(sizeof (conn_opts_t)))
 #define FMT_CHK(C) FMT_RS((C)->rs)
 
@@ -77,8 +125,10 @@ extern void init_checkers_queue(void);
 extern void dump_conn_opts (conn_opts_t *);
 extern void queue_checker(void (*free_func) (void *), void (*dump_func) (void *)
 			  , int (*launch) (thread_t *)
+			  , int (*compare_func) (checker_t *, checker_t *)
 			  , void *
 			  , conn_opts_t *);
+extern int checker_co_equal(conn_opts_t *, conn_opts_t *);
 extern void dump_checkers_queue(void);
 extern void free_checkers_queue(void);
 extern void register_checkers_thread(void);
@@ -88,5 +138,16 @@ extern void warmup_handler(vector_t *);
 extern void update_checker_activity(sa_family_t, void *, int);
 extern void checker_set_dst(struct sockaddr_storage *);
 extern void checker_set_dst_port(struct sockaddr_storage *, uint16_t);
+extern void checker_update_state(checker_t *, int);
+extern void checker_alert(checker_t *, const char *, const char *);
+extern long checker_delay(checker_t *);
+extern long checker_start_delay(checker_t *, unsigned int *);
+extern void checker_limit_init(int);
+extern void checker_limit_attach(thread_master_t *, int);
+extern void checker_limit_handover(int);
+extern void checker_limit_destroy(void);
+extern int checker_admit(thread_t *);
+extern void checker_release(checker_t *);
+extern void checker_limit_dump(void);
 
 #endif
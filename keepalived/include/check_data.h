@@ -53,6 +53,8 @@ typedef unsigned int checker_id_t;
 /* Daemon dynamic data structure definition */
 #define MAX_TIMEOUT_LENGTH		5
 #define KEEPALIVED_DEFAULT_DELAY	(60 * TIMER_HZ) 
+#define KEEPALIVED_DEFAULT_SUCCESS_FACTOR	2.0
+#define KEEPALIVED_DEFAULT_FAILURE_FACTOR	0.0
 
 /* SSL specific data */
 typedef struct _ssl_data {
@@ -64,8 +66,12 @@ typedef struct _ssl_data {
 	char				*cafile;
 	char				*certfile;
 	char				*keyfile;
+	long				session_ttl;	/* resumption, 0 = off */
 } ssl_data_t;
 
+/* Default lifetime of cached SSL sessions */
+#define SSL_SESSION_TTL		(300 * TIMER_HZ)
+
 /* Real Server definition */
 typedef struct _real_server {
 	struct sockaddr_storage		addr;
@@ -116,6 +122,10 @@ typedef struct _virtual_server {
 	uint32_t			vfwmark;
 	uint16_t			service_type;
 	long				delay_loop;
+	long				delay_loop_min;	/* adaptive interval, 0 for */
+	long				delay_loop_max;	/* ... delay_loop */
+	double				delay_success_factor;
+	double				delay_failure_factor;
 	int				ha_suspend;
 	int				ops;
 	char				sched[SCHED_MAX_LENGTH];
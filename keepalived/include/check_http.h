@@ -26,6 +26,8 @@
 
 /* system includes */
 #include <stdio.h>
+#include <stdint.h>
+#include <regex.h>
 #include <openssl/md5.h>
 #include <openssl/ssl.h>
 
@@ -35,37 +37,71 @@
 #include "scheduler.h"
 #include "layer4.h"
 #include "list.h"
+#include "html.h"
 
 /* Checker argument structure  */
 /* ssl specific thread arguments defs */
 typedef struct _request {
 	char				*buffer;
-	char				*extracted;
+	http_parser_t			parser;		/* of the response */
 	int				error;
-	int				status_code;
-	int				len;
 	SSL				*ssl;
 	BIO				*bio;
 	MD5_CTX				context;
+	uint32_t			crc;
+	struct _url			*url;		/* being checked */
+
+	/* Body matching, reading stops once all matched */
+	int				expect_pos;	/* expect bytes matched */
+	int				expect_matched;
+	char				*regex_line;	/* partial line kept */
+	int				regex_len;
+	int				regex_matched;
+	int				stop;		/* nothing left to check */
+
+	/* HTTP/1.1 keepalive mode */
+	int				framed;		/* follow framing */
+	int				reused;		/* on a kept connection */
+	int				done;		/* response complete or decided */
 } request_t;
 
 /* http specific thread arguments defs */
 typedef struct _http {
 	int				retry_it;	/* current number of get retry */
 	int				url_it;		/* current url checked index */
-	request_t			*req;		/* GET buffer and SSL args */
+	request_t			*req;		/* in flight, NULL if none */
+	request_t			request;	/* ... its storage */
+	char				*buffer;	/* read buffer, kept */
+	char				*regex_line;	/* expect_regex line, kept */
+	int				connected;	/* kept connection idle */
+	int				fd;		/* ... its socket */
+	SSL				*ssl;		/* ... and SSL session */
+	SSL_SESSION			*session;	/* to resume handshakes */
+	timeval_t			session_expire;
 } http_t ;
 
 typedef struct _url {
 	char				*path;
+	char				*request;	/* GET, rendered once */
+	int				request_len;
 	char				*digest;
+	unsigned char			digest_bin[MD5_DIGEST_LENGTH];
 	int				status_code;
+	int				status_only;	/* don't read the body */
+	int				crc32_set;
+	uint32_t			crc32;
+	char				*expect;	/* body substring */
+	int				expect_len;
+	int				*expect_next;	/* its KMP failure table */
+	char				*expect_regex;	/* line regex */
+	regex_t				*regex;
 } url_t;
 
 typedef struct _http_checker {
 	int				proto;
 	int				nb_get_retry;
 	long				delay_before_retry;
+	int				keepalive;	/* HTTP/1.1 persistent */
 	list				url;
 	http_t				*arg;
 } http_checker_t;
@@ -74,15 +110,16 @@ typedef struct _http_checker {
 #define MD5_BUFFER_LENGTH 32
 #define GET_BUFFER_LENGTH 2048
 #define MAX_BUFFER_LENGTH 4096
+#define HTTP_READ_BATCH	16	/* reads drained before yielding */
 #define PROTO_HTTP	0x01
 #define PROTO_SSL	0x02
 
-/* GET processing command */
-#define REQUEST_TEMPLATE "GET %s HTTP/1.0\r\n" \
+/* GET processing command, HTTP/1.1 when keepalive is used */
+#define REQUEST_TEMPLATE "GET %s HTTP/1.%d\r\n" \
                          "User-Agent: KeepAliveClient\r\n" \
                          "Host: %s%s\r\n\r\n"
 
-#define REQUEST_TEMPLATE_IPV6 "GET %s HTTP/1.0\r\n" \
+#define REQUEST_TEMPLATE_IPV6 "GET %s HTTP/1.%d\r\n" \
                          "User-Agent: KeepAliveClient\r\n" \
                          "Host: [%s]%s\r\n\r\n"
 
@@ -95,8 +132,8 @@ typedef struct _http_checker {
 extern void install_http_check_keyword(void);
 extern int epilog(thread_t *, int, int, int);
 extern int timeout_epilog(thread_t *, char *, char *);
+extern int http_reconnect(thread_t *);
 extern url_t *fetch_next_url(http_checker_t *);
 extern int http_process_response(request_t *, int);
-extern int http_handle_response(thread_t *, unsigned char digest[16]
-				, int);
+extern int http_handle_response(thread_t *, int);
 #endif
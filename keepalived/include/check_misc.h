@@ -37,7 +37,59 @@ typedef struct _misc_checker {
 	int			dynamic;  /* 0: old-style, 1: exit code from checker affects weight */
 } misc_checker_t;
 
+/*
+ * Script executor. A process forked before the configuration is read
+ * runs the scripts, so that the checker process does not fork itself
+ * for each of them.
+ */
+#define MISC_EXEC_FD		3	/* executor end of the socket */
+#define MISC_EXEC_PATH_MAX	4096
+#define MISC_EXEC_TIMER		(60 * TIMER_HZ)	/* read threads re-arm */
+#define MISC_EXEC_SLOTS_MIN	64
+
+/* Result types */
+#define MISC_EXEC_EXITED	0
+#define MISC_EXEC_TIMEOUT	1
+
+/*
+ * A request is identified by its slot into the checker table of
+ * scripts being run, and by an id telling apart successive users of
+ * the slot. Both are echoed back with the result.
+ */
+
+/* Request to the executor, followed by the command line */
+typedef struct _misc_exec_req {
+	unsigned int		id;
+	unsigned int		slot;
+	long			timeout;	/* usec */
+} misc_exec_req_t;
+
+/* Result from the executor */
+typedef struct _misc_exec_res {
+	unsigned int		id;
+	unsigned int		slot;
+	int			type;
+	int			status;		/* script exit code */
+} misc_exec_res_t;
+
+/* Script running in the executor */
+typedef struct _misc_exec_job {
+	unsigned int		id;
+	unsigned int		slot;
+} misc_exec_job_t;
+
+/* Checker side, script of a checker being run */
+typedef struct _misc_exec_slot {
+	unsigned int		id;
+	int			next;		/* free list */
+	struct _checker		*checker;	/* NULL if free */
+} misc_exec_slot_t;
+
 /* Prototypes defs */
 extern void install_misc_check_keyword(void);
+extern int misc_check_thread(thread_t *);
+extern void misc_exec_start(void);
+extern void misc_exec_register(void);
+extern void misc_exec_unregister(void);
 
 #endif
@@ -97,6 +97,7 @@
 #define CHECK_SNMP_RSRATEOUTPPS 58
 #define CHECK_SNMP_RSRATEINBPS 59
 #define CHECK_SNMP_RSRATEOUTBPS 60
+#define CHECK_SNMP_RSCHECKINTERVAL 61
 #define CHECK_SNMP_VSOPS 71
 
 #define STATE_VSGM_FWMARK 1
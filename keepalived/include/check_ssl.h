@@ -35,5 +35,8 @@ extern int ssl_connect(thread_t *, int);
 extern int ssl_printerr(int);
 extern int ssl_send_request(SSL *, char *, int);
 extern int ssl_read_thread(thread_t *);
+extern void ssl_release(http_t *, SSL *);
+extern void ssl_session_flush(http_t *);
+extern void ssl_stats_dump(void);
 
 #endif
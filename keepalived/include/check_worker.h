@@ -0,0 +1,72 @@
+/*
+ * Soft:        Keepalived is a failover program for the LVS project
+ *              <www.linuxvirtualserver.org>. It monitor & manipulate
+ *              a loadbalanced server pool using multi-layer checks.
+ *
+ * Part:        check_worker.c include file.
+ *
+ * Author:      Alexandre Cassen, <acassen@linux-vs.org>
+ *
+ *              This program is distributed in the hope that it will be useful,
+ *              but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *              MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *              See the GNU General Public License for more details.
+ *
+ *              This program is free software; you can redistribute it and/or
+ *              modify it under the terms of the GNU General Public License
+ *              as published by the Free Software Foundation; either version
+ *              2 of the License, or (at your option) any later version.
+ *
+ * Copyright (C) 2001-2012 Alexandre Cassen, <acassen@gmail.com>
+ */
+
+#ifndef _CHECK_WORKER_H
+#define _CHECK_WORKER_H
+
+/* system includes */
+#include <pthread.h>
+
+/* local includes */
+#include "scheduler.h"
+#include "check_api.h"
+
+/* Max number of checker worker threads */
+#define CHECKER_WORKERS_MAX	64
+
+/* Timeout of the wakeup fd read threads, they are just re-armed */
+#define CHECKER_WORKER_TIMER	(60 * TIMER_HZ)
+
+/* Message types */
+#define CHECKER_MSG_STATE	0
+#define CHECKER_MSG_ALERT	1
+
+/* Message posted by a worker to the main thread */
+typedef struct _checker_msg {
+	struct _checker_msg	*next;
+	int			type;
+	checker_t		*checker;
+	int			alive;
+	char			*subject;
+	char			*body;
+} checker_msg_t;
+
+/* Checker worker thread */
+typedef struct _checker_worker {
+	pthread_t		tid;
+	int			index;
+	int			running;
+	int			stop_fd;	/* eventfd, wakes up on stop or dump */
+	int			stop;		/* main asks to stop */
+	int			dump;		/* main asks for statistics */
+	unsigned int		seed;		/* warmup rand_r() seed */
+} checker_worker_t;
+
+/* Prototypes defs */
+extern int checker_workers_init(int);
+extern int checker_worker_assign(checker_t *);
+extern void checker_workers_start(void);
+extern void checker_workers_stop(void);
+extern void checker_workers_dump(void);
+extern void checker_worker_post(int, checker_t *, int, const char *, const char *);
+
+#endif
@@ -53,6 +53,13 @@ typedef struct _data {
 	list				email;
 	struct sockaddr_storage		vrrp_mcast_group4;
 	struct sockaddr_storage		vrrp_mcast_group6;
+	int				sched_budget;
+	int				checker_threads;
+	long				checker_timer_slack;	/* usec */
+	int				checker_phase_spread;
+	long				checker_max_inflight;
+	long				checker_connect_rate;	/* per second */
+	long				checker_connect_burst;
 #ifdef _WITH_SNMP_
 	int				enable_traps;
 #endif
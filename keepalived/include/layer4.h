@@ -43,6 +43,41 @@ enum connect_result {
 	connect_success
 };
 
+/*
+ * Syscalls made on checker sockets, reported per probe on SIGUSR1.
+ * Relaxed atomics, checker workers bump them concurrently.
+ */
+enum checker_syscall {
+	CHECKER_SYS_SOCKET,
+	CHECKER_SYS_SETUP,	/* setsockopt, getsockopt, bind */
+	CHECKER_SYS_CONNECT,
+	CHECKER_SYS_READ,
+	CHECKER_SYS_WRITE,
+	CHECKER_SYS_CLOSE,
+	CHECKER_SYS_MAX
+};
+
+extern unsigned long checker_syscalls[CHECKER_SYS_MAX];
+extern unsigned long checker_probes;
+
+/*
+ * Simulation hook, gets the checker socket and the connection it is
+ * for. It swaps a scripted peer in on the fd and reports the connect.
+ */
+extern enum connect_result (*tcp_connect_hook) (int, conn_opts_t *);
+
+#define CHECKER_SYSCALL(T) \
+	__atomic_add_fetch(&checker_syscalls[CHECKER_SYS_##T], 1, __ATOMIC_RELAXED)
+#define CHECKER_PROBE() \
+	__atomic_add_fetch(&checker_probes, 1, __ATOMIC_RELAXED)
+
+/* Checker sockets are nonblocking from creation on */
+#define CHECKER_SOCKET(F) \
+	(CHECKER_SYSCALL(SOCKET), \
+	 socket((F), SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP))
+#define CHECKER_CLOSE(FD) \
+	(CHECKER_SYSCALL(CLOSE), close(FD))
+
 /* Prototypes defs */
 extern enum connect_result
  tcp_bind_connect(int, conn_opts_t *);
@@ -57,4 +92,10 @@ extern int
  tcp_connection_state(int, enum connect_result
 		      , thread_t *, int (*func) (thread_t *)
 		      , long);
+
+extern int
+ tcp_async_connect(int, conn_opts_t *, thread_t *
+		   , int (*func) (thread_t *), long);
+
+extern void checker_syscalls_dump(void);
 #endif
@@ -85,6 +85,9 @@ stop_vrrp(void)
 	free_interface_queue();
 	kernel_netlink_close();
 	thread_destroy_master(master);
+	if (debug & 4)
+		thread_pool_dump();
+	thread_pool_destroy();
 	gratuitous_arp_close();
 	ndisc_close();
 
@@ -104,6 +107,8 @@ stop_vrrp(void)
 static void
 start_vrrp(void)
 {
+	thread_t *thread;
+
 	/* Initialize sub-system */
 	init_interface_queue();
 	kernel_netlink_init();
@@ -165,9 +170,13 @@ start_vrrp(void)
 	/* Initialize linkbeat */
 	init_interface_linkbeat();
 
-	/* Init & start the VRRP packet dispatcher */
-	thread_add_event(master, vrrp_dispatcher_init, NULL,
-			 VRRP_DISPATCHER);
+	/* Batch size between two scheduler polls */
+	thread_set_budget(master, global_data->sched_budget);
+
+	/* Init & start the VRRP packet dispatcher, adverts come first */
+	thread = thread_add_event(master, vrrp_dispatcher_init, NULL,
+				  VRRP_DISPATCHER);
+	thread_set_priority(thread, THREAD_PRIO_CRITICAL);
 }
 
 /* Reload handler */
@@ -194,6 +203,7 @@ vrrp_signal_init(void)
 	signal_set(SIGHUP, sighup_vrrp, NULL);
 	signal_set(SIGINT, sigend_vrrp, NULL);
 	signal_set(SIGTERM, sigend_vrrp, NULL);
+	signal_set(SIGUSR1, thread_stats_handler, NULL);
 	signal_ignore(SIGPIPE);
 }
 
@@ -295,6 +295,7 @@ static void
 vrrp_init_script(list l)
 {
 	vrrp_script_t *vscript;
+	thread_t *thread;
 	element e;
 
 	for (e = LIST_HEAD(l); e; ELEMENT_NEXT(e)) {
@@ -304,11 +305,15 @@ vrrp_init_script(list l)
 
 		if (vscript->result == VRRP_SCRIPT_STATUS_INIT) {
 			vscript->result = vscript->rise - 1; /* one success is enough */
-			thread_add_event(master, vrrp_script_thread, vscript, vscript->interval);
+			thread = thread_add_event(master, vrrp_script_thread, vscript, vscript->interval);
 		} else if (vscript->result == VRRP_SCRIPT_STATUS_INIT_GOOD) {
 			vscript->result = vscript->rise; /* one failure is enough */
-			thread_add_event(master, vrrp_script_thread, vscript, vscript->interval);
-		}
+			thread = thread_add_event(master, vrrp_script_thread, vscript, vscript->interval);
+		} else
+			continue;
+
+		/* Scripts must not run in the VRRP class */
+		thread_set_priority(thread, THREAD_PRIO_NORMAL);
 	}
 }
 
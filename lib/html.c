@@ -22,61 +22,245 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <ctype.h>
+#include <limits.h>
 #include "html.h"
-#include "memory.h"
 
-/* Return the http header content length */
-int extract_content_length(char *buffer, int size)
+/* Headers of interest, lower case */
+#define HTTP_HDR_CONTENT_LENGTH		0
+#define HTTP_HDR_TRANSFER_ENCODING	1
+#define HTTP_HDR_CONNECTION		2
+#define HTTP_HDR_ALL			((1 << 3) - 1)
+
+static const char *http_headers[] = {
+	"content-length",
+	"transfer-encoding",
+	"connection",
+};
+
+void
+http_parse_init(http_parser_t *p, int framed, int status_only)
+{
+	memset(p, 0, sizeof (http_parser_t));
+	p->framed = framed;
+	p->status_only = status_only;
+	p->content_length = -1;
+}
+
+/* Status line byte : "HTTP/1.x code reason" */
+static void
+http_parse_status(http_parser_t *p, int c)
+{
+	if (c == '\n') {
+		/* HTTP/1.1 connections are persistent by default, the
+		 * rest of a status only response is never read */
+		p->keepalive = (p->version >= 1 && !p->status_only);
+		p->state = (p->status_only) ? HTTP_PARSE_DONE : HTTP_PARSE_HEADER;
+		p->header = HTTP_HDR_ALL;
+		p->pos = 0;
+		return;
+	}
+
+	if (c == ' ') {
+		if (p->field < 2)
+			p->field++;
+	} else if (p->field == 0 && p->pos < 7) {
+		if (c != "HTTP/1."[p->pos])
+			p->version = -1;
+	} else if (p->field == 0 && p->pos == 7 && !p->version && isdigit(c))
+		p->version = c - '0';
+	else if (p->field == 1 && isdigit(c) && p->status_code < 1000)
+		p->status_code = p->status_code * 10 + c - '0';
+	p->pos++;
+}
+
+/* Header name byte, narrowing the candidates */
+static void
+http_parse_name(http_parser_t *p, int c)
 {
-	char *clen = strstr(buffer, CONTENT_LENGTH);
-	char *content_buffer = NULL;
-	char *buf_len;
-	int inc = 0;
 	int i;
 
-	/* Pattern not found */
-	if (!clen)
-		return 0;
-
-	/* Allocate the room */
-	buf_len = (char *)MALLOC(40);
-
-	/* Content-Length extraction */
-	while (*(clen++) != ':');
-	content_buffer = clen;
-	while (*(clen++) != '\r' && *clen != '\n')
-		inc++;
-	for (i = 0; i < inc; i++)
-		strncat(buf_len, content_buffer+i, 1);
-	i = atoi(buf_len);
-	FREE(buf_len);
-	return i;
+	if (c == ':') {
+		for (i = 0; i < 3; i++)
+			if ((p->header & (1 << i)) && !http_headers[i][p->pos])
+				break;
+		p->state = (i < 3) ? HTTP_PARSE_VALUE : HTTP_PARSE_SKIP;
+		p->header = i;
+		p->value_len = 0;
+		return;
+	}
+
+	/* A candidate shorter than the name, or a NUL byte, is out */
+	c = tolower(c);
+	for (i = 0; i < 3; i++)
+		if ((p->header & (1 << i)) &&
+		    (!http_headers[i][p->pos] || http_headers[i][p->pos] != c))
+			p->header &= ~(1 << i);
+	p->pos++;
+	if (!p->header)
+		p->state = HTTP_PARSE_SKIP;
+}
+
+/* Value of a header of interest is complete */
+static void
+http_parse_value(http_parser_t *p)
+{
+	p->value[p->value_len] = 0;
+	switch (p->header) {
+	case HTTP_HDR_CONTENT_LENGTH:
+		p->content_length = atol(p->value);
+		break;
+	case HTTP_HDR_TRANSFER_ENCODING:
+		p->chunked = (strstr(p->value, "chunked") != NULL);
+		break;
+	case HTTP_HDR_CONNECTION:
+		if (strstr(p->value, "close"))
+			p->keepalive = 0;
+		else if (strstr(p->value, "keep-alive"))
+			p->keepalive = 1;
+		break;
+	}
+}
+
+/* Blank line, set up the body framing */
+static void
+http_parse_body(http_parser_t *p)
+{
+	p->state = HTTP_PARSE_BODY;
+	p->remaining = -1;
+	if (!p->framed)
+		return;
+
+	/* No body for these */
+	if (p->status_code / 100 == 1 || p->status_code == 204 ||
+	    p->status_code == 304)
+		p->content_length = 0;
+
+	/* Chunked wins, otherwise body ends with the connection */
+	if (p->chunked) {
+		p->state = HTTP_PARSE_CHUNK_SIZE;
+		p->remaining = 0;
+	} else if (p->content_length >= 0) {
+		p->remaining = p->content_length;
+		if (!p->remaining)
+			p->state = HTTP_PARSE_DONE;
+	} else
+		p->keepalive = 0;
+}
+
+/* Chunk size line, CRLF after data and trailer byte */
+static void
+http_parse_chunk(http_parser_t *p, int c)
+{
+	switch (p->state) {
+	case HTTP_PARSE_CHUNK_SIZE:
+		if (c == '\n') {
+			p->state = (p->remaining) ? HTTP_PARSE_BODY :
+						    HTTP_PARSE_TRAILER;
+			p->chunk_ext = 0;
+			p->pos = 0;
+		} else if (!p->chunk_ext && isxdigit(c) &&
+			   p->remaining < (LONG_MAX >> 4)) {
+			p->remaining = p->remaining * 16 +
+				       (isdigit(c) ? c - '0' : tolower(c) - 'a' + 10);
+		} else if (c != '\r')
+			p->chunk_ext = 1;
+		break;
+	case HTTP_PARSE_CHUNK_END:
+		if (c == '\n')
+			p->state = HTTP_PARSE_CHUNK_SIZE;
+		break;
+	case HTTP_PARSE_TRAILER:
+		if (c == '\n') {
+			if (!p->pos)
+				p->state = HTTP_PARSE_DONE;
+			p->pos = 0;
+		} else if (c != '\r')
+			p->pos++;
+		break;
+	}
 }
 
 /*
- * Return the http header error code. According
- * to rfc2616.6.1 status code is between HTTP_Version
- * and Reason_Phrase, separated by space caracter.
+ * Parse len more bytes of a response, nothing is copied nor
+ * allocated : state is kept in the parser between reads and body
+ * bytes are handed to body() where they are. Returns the number
+ * of bytes used, less than len once done or stopped by body().
  */
-int extract_status_code(char *buffer, int size)
+int
+http_parse(http_parser_t *p, char *buf, int len, http_body_f body, void *arg)
 {
-	char *buf_code;
-	char *begin;
-	char *end = buffer + size;
-	int inc = 0;
-
-	/* Allocate the room */
-	buf_code = (char *)MALLOC(10);
-
-	/* Status-Code extraction */
-	while (buffer < end && *buffer++ != ' ') ;
-	begin = buffer;
-	while (buffer < end && *buffer++ != ' ')
-		inc++;
-	strncat(buf_code, begin, inc);
-	inc = atoi(buf_code);
-	FREE(buf_code);
-	return inc;
+	char *cur = buf, *end = buf + len, *eol;
+	int n, c;
+
+	while (cur < end && p->state != HTTP_PARSE_DONE) {
+		switch (p->state) {
+		case HTTP_PARSE_BODY:
+			n = end - cur;
+			if (p->remaining >= 0 && n > p->remaining)
+				n = p->remaining;
+			cur += n;
+			if (p->remaining > 0) {
+				p->remaining -= n;
+				if (!p->remaining)
+					p->state = (p->chunked) ? HTTP_PARSE_CHUNK_END :
+								  HTTP_PARSE_DONE;
+			}
+			if ((*body) (arg, cur - n, n))
+				goto end;
+			continue;
+		case HTTP_PARSE_SKIP:
+			/* Not of interest, straight to its end */
+			if (!(eol = memchr(cur, '\n', end - cur))) {
+				cur = end;
+				continue;
+			}
+			cur = eol + 1;
+			p->state = HTTP_PARSE_HEADER;
+			p->header = HTTP_HDR_ALL;
+			p->pos = 0;
+			continue;
+		}
+
+		/* Server bytes, ctype.h wants them unsigned */
+		c = (unsigned char) *cur++;
+		switch (p->state) {
+		case HTTP_PARSE_STATUS:
+			http_parse_status(p, c);
+			break;
+		case HTTP_PARSE_HEADER:
+			if (c == '\n') {
+				if (!p->pos)
+					http_parse_body(p);
+				p->header = HTTP_HDR_ALL;
+				p->pos = 0;
+			} else if (c != '\r' || p->pos)
+				http_parse_name(p, c);
+			break;
+		case HTTP_PARSE_VALUE:
+			if (c == '\n') {
+				http_parse_value(p);
+				p->state = HTTP_PARSE_HEADER;
+				p->header = HTTP_HDR_ALL;
+				p->pos = 0;
+			} else if (c == '\r' ||
+				   (!p->value_len && (c == ' ' || c == '\t'))) {
+				/* Surrounding blanks */
+			} else if (p->value_len < sizeof (p->value) - 1)
+				p->value[p->value_len++] = tolower(c);
+			break;
+		default:
+			http_parse_chunk(p, c);
+			break;
+		}
+	}
+
+  end:
+	/* Anything after the response, connection is out of sync */
+	if (cur < end)
+		p->keepalive = 0;
+
+	return cur - buf;
 }
 
 /* simple function returning a pointer to the html buffer begin */
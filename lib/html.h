@@ -3,7 +3,7 @@
  *              Set a timer to compute global remote server response
  *              time.
  *
- * Part:        parser.c include file.
+ * Part:        html.c include file.
  *
  * Authors:     Alexandre Cassen, <acassen@linux-vs.org>
  *
@@ -23,12 +23,55 @@
 #ifndef _HTML_H
 #define _HTML_H
 
-/* HTTP header tag */
-#define CONTENT_LENGTH	"Content-Length:"
+/* Incremental HTTP response parser states */
+#define HTTP_PARSE_STATUS	0	/* status line */
+#define HTTP_PARSE_HEADER	1	/* header name */
+#define HTTP_PARSE_VALUE	2	/* value of a header of interest */
+#define HTTP_PARSE_SKIP		3	/* rest of an other header line */
+#define HTTP_PARSE_BODY		4	/* body or chunk data */
+#define HTTP_PARSE_CHUNK_SIZE	5
+#define HTTP_PARSE_CHUNK_END	6	/* CRLF after chunk data */
+#define HTTP_PARSE_TRAILER	7
+#define HTTP_PARSE_DONE		8
+
+/*
+ * Body bytes, in place in the parsed buffer. Returning non zero
+ * stops the parsing, the check is decided.
+ */
+typedef int (*http_body_f) (void *, char *, int);
+
+typedef struct _http_parser {
+	int			state;
+	int			framed;		/* follow Content-Length and chunked,
+						 * else the body ends with the connection */
+	int			status_only;	/* done after the status line */
+	int			pos;		/* in current line or header name */
+	int			field;		/* of the status line */
+	int			header;		/* candidates, then header of interest */
+	char			value[64];	/* its value, lower case */
+	int			value_len;
+	int			chunk_ext;	/* in chunk extensions */
+
+	/* Response */
+	int			version;	/* HTTP/1.x minor */
+	int			status_code;
+	int			keepalive;	/* server keeps the connection */
+	int			chunked;
+	long			content_length;	/* -1 if unknown */
+	long			remaining;	/* body or chunk bytes, -1 up to EOF */
+} http_parser_t;
+
+/* Header fully parsed, body begins */
+#define HTTP_PARSE_HEADER_DONE(P)	((P)->state >= HTTP_PARSE_BODY)
+/* Anything received */
+#define HTTP_PARSE_STARTED(P)	((P)->state != HTTP_PARSE_STATUS || (P)->pos)
+/* Response complete, connection ready for the next one */
+#define HTTP_PARSE_REUSABLE(P)	((P)->framed && (P)->keepalive && \
+				 (P)->state == HTTP_PARSE_DONE)
 
 /* Prototypes */
-extern int extract_content_length(char *buffer, int size);
-extern int extract_status_code(char *buffer, int size);
+extern void http_parse_init(http_parser_t *, int, int);
+extern int http_parse(http_parser_t *, char *, int, http_body_f, void *);
 extern char *extract_html(char *buffer, int size_buffer);
 
 #endif
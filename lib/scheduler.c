@@ -22,6 +22,9 @@
  * Copyright (C) 2001-2012 Alexandre Cassen, <acassen@linux-vs.org>
  */
 
+/* dladdr() */
+#define _GNU_SOURCE
+
 /* SNMP should be included first: it redefines "FREE" */
 #ifdef _WITH_SNMP_
 #include <net-snmp/net-snmp-config.h>
@@ -34,7 +37,16 @@
 #include <signal.h>
 #include <sys/wait.h>
 #include <sys/select.h>
+#ifdef _WITH_EPOLL_
+#include <sys/epoll.h>
+#endif
+#ifdef _WITH_IO_URING_
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
 #include <unistd.h>
+#include <dlfcn.h>
 #include "scheduler.h"
 #include "memory.h"
 #include "utils.h"
@@ -44,6 +56,12 @@
 /* global vars */
 thread_master_t *master = NULL;
 
+/* Priority class of the thread being run, inherited by new threads */
+static __thread int thread_prio = THREAD_PRIO_NORMAL;
+
+/* Set while a callback runs, time_now is then the one of the loop */
+static __thread int thread_dispatching;
+
 /* Make thread master. */
 thread_master_t *
 thread_make_master(void)
@@ -51,52 +69,147 @@ thread_make_master(void)
 	thread_master_t *new;
 
 	new = (thread_master_t *) MALLOC(sizeof (thread_master_t));
+	new->epoll_fd = -1;
+	new->epoll_signal_fd = -1;
+	new->dispatch_fd = -1;
+
+#ifdef _WITH_EPOLL_
+	/* Fallback to select() if kernel doesn't provide epoll */
+	new->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (new->epoll_fd < 0) {
+		log_message(LOG_INFO, "epoll_create1 error (%s), using select()"
+				    , strerror(errno));
+	} else {
+		new->epoll_size = THREAD_EPOLL_EVENTS;
+		new->epoll_events = (struct epoll_event *)
+			MALLOC(new->epoll_size * sizeof (struct epoll_event));
+	}
+#endif
+
 	return new;
 }
 
-/* Add a new thread to the list. */
+/*
+ * Current time for a registration. Callbacks use the time read once
+ * by the loop after polling, others (startup, config) read the clock.
+ */
 static void
-thread_list_add(thread_list_t * list, thread_t * thread)
+thread_update_time(void)
 {
-	thread->next = NULL;
-	thread->prev = list->tail;
-	if (list->tail)
-		list->tail->next = thread;
-	else
-		list->head = thread;
-	list->tail = thread;
-	list->count++;
+	if (!thread_dispatching)
+		set_time_now();
 }
 
-/* Add a new thread to the list. */
-void
-thread_list_add_before(thread_list_t * list, thread_t * point, thread_t * thread)
+/* Make room into the fd index for descriptor fd */
+static int
+thread_fds_ensure(thread_master_t * m, int fd)
 {
-	thread->next = point;
-	thread->prev = point->prev;
-	if (point->prev)
-		point->prev->next = thread;
-	else
-		list->head = thread;
-	point->prev = thread;
-	list->count++;
+	thread_fd_t *fds;
+	int size;
+
+	if (fd < 0)
+		return -1;
+	if (fd < m->fds_size)
+		return 0;
+
+	/* select() can't handle descriptors above FD_SETSIZE */
+	if (m->epoll_fd < 0 && fd >= FD_SETSIZE) {
+		log_message(LOG_ERR, "fd [%d] exceeds select() FD_SETSIZE", fd);
+		return -1;
+	}
+
+	size = (m->fds_size) ? m->fds_size : THREAD_FDS_MIN;
+	while (size <= fd)
+		size *= 2;
+
+	fds = (thread_fd_t *) MALLOC(size * sizeof (thread_fd_t));
+	if (m->fds) {
+		memcpy(fds, m->fds, m->fds_size * sizeof (thread_fd_t));
+		FREE(m->fds);
+	}
+	m->fds = fds;
+	m->fds_size = size;
+	return 0;
 }
 
-/* Add a thread in the list sorted by timeval */
-void
-thread_list_add_timeval(thread_list_t * list, thread_t * thread)
+#ifdef _WITH_EPOLL_
+/* epoll events the threads waiting on fd need */
+static inline unsigned int
+thread_fds_events(thread_fd_t * tfd)
 {
-	thread_t *tt;
+	return ((tfd->read) ? EPOLLIN : 0) | ((tfd->write) ? EPOLLOUT : 0);
+}
+#endif
 
-	for (tt = list->head; tt; tt = tt->next) {
-		if (timer_cmp(thread->sands, tt->sands) <= 0)
-			break;
+/* Sync I/O multiplexer with the threads waiting on fd */
+static void
+thread_fds_update(thread_master_t * m, int fd)
+{
+	thread_fd_t *tfd = &m->fds[fd];
+#ifdef _WITH_EPOLL_
+	struct epoll_event ev;
+	unsigned int events;
+	int op, ret;
+
+	if (m->epoll_fd >= 0) {
+		events = thread_fds_events(tfd);
+		if (events == tfd->events)
+			return;
+
+		if (!events)
+			op = EPOLL_CTL_DEL;
+		else if (!tfd->events)
+			op = EPOLL_CTL_ADD;
+		else
+			op = EPOLL_CTL_MOD;
+
+		memset(&ev, 0, sizeof (struct epoll_event));
+		ev.events = events;
+		ev.data.fd = fd;
+		ret = epoll_ctl(m->epoll_fd, op, fd, &ev);
+
+		/*
+		 * The kernel drops the registration of a closed fd, so
+		 * a reused fd number can be out of sync with our index.
+		 */
+		if (ret < 0 && errno == ENOENT && op == EPOLL_CTL_MOD)
+			ret = epoll_ctl(m->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+		else if (ret < 0 && errno == EEXIST && op == EPOLL_CTL_ADD)
+			ret = epoll_ctl(m->epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+		else if (ret < 0 && op == EPOLL_CTL_DEL &&
+			 (errno == ENOENT || errno == EBADF))
+			ret = 0;
+
+		if (ret < 0)
+			log_message(LOG_ERR, "epoll_ctl error on fd [%d] (%s)"
+					   , fd, strerror(errno));
+		tfd->events = events;
+		return;
 	}
+#endif
+
+	if (tfd->read)
+		FD_SET(fd, &m->readfd);
+	else
+		FD_CLR(fd, &m->readfd);
+	if (tfd->write)
+		FD_SET(fd, &m->writefd);
+	else
+		FD_CLR(fd, &m->writefd);
+}
 
-	if (tt)
-		thread_list_add_before(list, tt, thread);
+/* Add a new thread to the list. */
+static void
+thread_list_add(thread_list_t * list, thread_t * thread)
+{
+	thread->next = NULL;
+	thread->prev = list->tail;
+	if (list->tail)
+		list->tail->next = thread;
 	else
-		thread_list_add(list, thread);
+		list->head = thread;
+	list->tail = thread;
+	list->count++;
 }
 
 /* Delete a thread from the list. */
@@ -116,28 +229,397 @@ thread_list_delete(thread_list_t * list, thread_t * thread)
 	return thread;
 }
 
-/* Free all unused thread. */
+/* Queue a thread into the ready list of its class. */
+static inline void
+thread_ready_add(thread_master_t * m, thread_t * thread)
+{
+	thread_list_add(&m->ready[thread->prio], thread);
+}
+
+/*
+ * Child threads are hashed by pid so that reaping is O(1). They sit
+ * into the child heap only, next/prev are free for hash chaining.
+ */
+static inline thread_list_t *
+thread_child_bucket(thread_master_t * m, pid_t pid)
+{
+	return &m->child_pid[pid & (THREAD_CHILD_HASH - 1)];
+}
+
+static inline void
+thread_child_unhash(thread_master_t * m, thread_t * thread)
+{
+	thread_list_delete(thread_child_bucket(m, thread->u.c.pid), thread);
+}
+
+/* Compare threads timeout */
+static inline int
+thread_heap_less(thread_t * a, thread_t * b)
+{
+	if (a->sands.tv_sec != b->sands.tv_sec)
+		return a->sands.tv_sec < b->sands.tv_sec;
+	return a->sands.tv_usec < b->sands.tv_usec;
+}
+
+/* Move heap node up to its place */
 static void
-thread_clean_unuse(thread_master_t * m)
+thread_heap_up(thread_heap_t * heap, int index)
 {
+	thread_t *thread = heap->node[index];
+	int parent;
+
+	while (index) {
+		parent = (index - 1) / THREAD_HEAP_ARITY;
+		if (!thread_heap_less(thread, heap->node[parent]))
+			break;
+		heap->node[index] = heap->node[parent];
+		heap->node[index]->index = index;
+		index = parent;
+	}
+
+	heap->node[index] = thread;
+	thread->index = index;
+}
+
+/* Move heap node down to its place */
+static void
+thread_heap_down(thread_heap_t * heap, int index)
+{
+	thread_t *thread = heap->node[index];
+	int child, last, min, i;
+
+	for (;;) {
+		child = index * THREAD_HEAP_ARITY + 1;
+		if (child >= heap->count)
+			break;
+
+		/* Find the earliest of the children */
+		last = child + THREAD_HEAP_ARITY;
+		if (last > heap->count)
+			last = heap->count;
+		min = child;
+		for (i = child + 1; i < last; i++)
+			if (thread_heap_less(heap->node[i], heap->node[min]))
+				min = i;
+
+		if (!thread_heap_less(heap->node[min], thread))
+			break;
+		heap->node[index] = heap->node[min];
+		heap->node[index]->index = index;
+		index = min;
+	}
+
+	heap->node[index] = thread;
+	thread->index = index;
+}
+
+/* Add a thread into the heap */
+static void
+thread_heap_add(thread_heap_t * heap, thread_t * thread)
+{
+	thread_t **node;
+
+	if (heap->count == heap->size) {
+		heap->size = (heap->size) ? heap->size * 2 : THREAD_HEAP_MIN;
+		node = (thread_t **) MALLOC(heap->size * sizeof (thread_t *));
+		if (heap->node) {
+			memcpy(node, heap->node, heap->count * sizeof (thread_t *));
+			FREE(heap->node);
+		}
+		heap->node = node;
+	}
+
+	heap->node[heap->count] = thread;
+	thread_heap_up(heap, heap->count++);
+}
+
+/* Delete a thread from the heap */
+static thread_t *
+thread_heap_delete(thread_heap_t * heap, thread_t * thread)
+{
+	int index = thread->index;
+
+	assert(index < heap->count && heap->node[index] == thread);
+
+	if (index != --heap->count) {
+		heap->node[index] = heap->node[heap->count];
+		heap->node[index]->index = index;
+		if (index && thread_heap_less(heap->node[index],
+					      heap->node[(index - 1) / THREAD_HEAP_ARITY]))
+			thread_heap_up(heap, index);
+		else
+			thread_heap_down(heap, index);
+	}
+
+	heap->node[heap->count] = NULL;
+	thread->index = -1;
+	return thread;
+}
+
+/* Earliest thread of the heap */
+static inline thread_t *
+thread_heap_top(thread_heap_t * heap)
+{
+	return (heap->count) ? heap->node[0] : NULL;
+}
+
+/* Top of the heap if timed out */
+static inline thread_t *
+thread_heap_expired(thread_heap_t * heap)
+{
+	thread_t *thread = thread_heap_top(heap);
+
+	if (thread && timer_cmp(time_now, thread->sands) >= 0)
+		return thread;
+	return NULL;
+}
+
+/* Delete top of the heap if timed out and return it */
+static thread_t *
+thread_heap_trim_expired(thread_heap_t * heap)
+{
+	thread_t *thread = thread_heap_expired(heap);
+
+	return (thread) ? thread_heap_delete(heap, thread) : NULL;
+}
+
+/*
+ * Thread pool. Threads are carved out of slabs of THREAD_SLAB_SIZE
+ * contiguous entries and recycled through a LIFO free list. The pool
+ * is process wide so that it survives master destruction on reload,
+ * slabs are only released by thread_pool_destroy() at exit. Pools
+ * are per pthread, a master must only be used by the pthread owning
+ * the pool its threads come from.
+ */
+typedef struct _thread_slab {
+	struct _thread_slab *next;
+	thread_t node[THREAD_SLAB_SIZE];
+} thread_slab_t;
+
+static __thread thread_slab_t *thread_slabs;
+static __thread thread_t *thread_free;
+static __thread thread_pool_stats_t thread_pool;
+
+/* Get a zeroed thread from the pool */
+static thread_t *
+thread_pool_get(void)
+{
+	thread_slab_t *slab;
 	thread_t *thread;
+	int i;
 
-	thread = m->unuse.head;
-	while (thread) {
-		thread_t *t;
+	if (!thread_free) {
+		slab = (thread_slab_t *) MALLOC(sizeof (thread_slab_t));
+		slab->next = thread_slabs;
+		thread_slabs = slab;
 
-		t = thread;
-		thread = t->next;
+		/* Chain in address order, first allocations are contiguous */
+		for (i = THREAD_SLAB_SIZE - 1; i >= 0; i--) {
+			slab->node[i].next = thread_free;
+			thread_free = &slab->node[i];
+		}
+		thread_pool.allocated += THREAD_SLAB_SIZE;
+		thread_pool.slabs++;
+	}
+
+	thread = thread_free;
+	thread_free = thread->next;
+	memset(thread, 0, sizeof (thread_t));
+
+	if (++thread_pool.in_use > thread_pool.high_water)
+		thread_pool.high_water = thread_pool.in_use;
+	return thread;
+}
+
+/* Give a thread back to the pool */
+static void
+thread_pool_put(thread_t * thread)
+{
+	thread->next = thread_free;
+	thread_free = thread;
+	thread_pool.in_use--;
+}
+
+void
+thread_pool_stats(thread_pool_stats_t * stats)
+{
+	*stats = thread_pool;
+}
+
+void
+thread_pool_dump(void)
+{
+	log_message(LOG_INFO, "Thread pool: %lu allocated in %lu slabs"
+			      ", %lu in use, %lu high-water"
+			    , thread_pool.allocated, thread_pool.slabs
+			    , thread_pool.in_use, thread_pool.high_water);
+}
+
+/* Release pool memory. Only at exit, no thread must be in use */
+void
+thread_pool_destroy(void)
+{
+	thread_slab_t *slab;
+
+	while ((slab = thread_slabs)) {
+		thread_slabs = slab->next;
+		FREE(slab);
+	}
 
-		thread_list_delete(&m->unuse, t);
+	thread_free = NULL;
+	memset(&thread_pool, 0, sizeof (thread_pool_stats_t));
+}
+
+/*
+ * Scheduler statistics. Collected in every pthread for its whole life,
+ * the hot path cost is one clock read around each callback plus a short
+ * open addressing lookup keyed by the callback address.
+ */
+static __thread thread_func_stats_t thread_func_stats[THREAD_FUNC_STATS + 1];
+static __thread thread_hist_t thread_lateness[THREAD_PRIO_MAX]; /* dispatch - sands */
+static __thread thread_hist_t thread_wait;	/* time spent into select/epoll */
+
+/* Account a duration into a histogram */
+static void
+thread_hist_add(thread_hist_t * hist, long usec)
+{
+	int i = 0;
+
+	if (usec < 0)
+		usec = 0;
+	while (i < THREAD_HIST_SIZE - 1 && (usec >> (i + 1)))
+		i++;
+
+	hist->count++;
+	hist->total += usec;
+	if (usec > hist->max)
+		hist->max = usec;
+	hist->bucket[i]++;
+}
+
+/* Statistics entry of a thread function */
+static thread_func_stats_t *
+thread_func_stats_get(int (*func) (thread_t *))
+{
+	unsigned long h = ((unsigned long) func >> 4) & (THREAD_FUNC_STATS - 1);
+	int i;
+
+	for (i = 0; i < THREAD_FUNC_STATS; i++) {
+		thread_func_stats_t *s = &thread_func_stats[h];
+		if (s->func == func)
+			return s;
+		if (!s->func) {
+			s->func = func;
+			return s;
+		}
+		h = (h + 1) & (THREAD_FUNC_STATS - 1);
+	}
+
+	/* Table full, account into the overflow entry */
+	return &thread_func_stats[THREAD_FUNC_STATS];
+}
+
+/* Timer lateness of a thread about to be run */
+static inline void
+thread_stats_dispatch(thread_t * thread)
+{
+	if ((thread->type == THREAD_READY ||
+	     thread->type == THREAD_READ_TIMEOUT ||
+	     thread->type == THREAD_WRITE_TIMEOUT ||
+	     thread->type == THREAD_CHILD_TIMEOUT) &&
+	    timer_cmp(time_now, thread->sands) >= 0)
+		thread_hist_add(&thread_lateness[thread->prio],
+				timer_long(timer_sub(time_now, thread->sands)));
+}
+
+static void
+thread_hist_dump(const char *name, thread_hist_t * hist)
+{
+	char buf[512];
+	int i, len = 0;
+
+	if (!hist->count)
+		return;
+
+	for (i = 0; i < THREAD_HIST_SIZE && len < sizeof (buf); i++) {
+		if (!hist->bucket[i])
+			continue;
+		len += snprintf(buf + len, sizeof (buf) - len, " %s%luus:%lu"
+				, (i == THREAD_HIST_SIZE - 1) ? ">=" : "<"
+				, (i == THREAD_HIST_SIZE - 1) ? 1UL << i : 2UL << i
+				, hist->bucket[i]);
+	}
+	if (len >= sizeof (buf))
+		len = sizeof (buf) - 1;
+	buf[len] = 0;
+
+	log_message(LOG_INFO, "%s: count %lu, avg %luus, max %luus,%s"
+			    , name, hist->count, hist->total / hist->count
+			    , hist->max, buf);
+}
+
+/*
+ * Printable name of a thread function. A stripped PIE binary has no
+ * symbol for it, the offset into the object is then given instead:
+ * unlike the address, it is stable across runs and can be fed to
+ * addr2line -f -e on an unstripped build.
+ */
+static void
+thread_func_name(int (*func) (thread_t *), char *buf, size_t size)
+{
+	const char *file;
+	Dl_info info;
+
+	if (!dladdr((void *) func, &info) || !info.dli_fname) {
+		snprintf(buf, size, "%p", (void *) func);
+		return;
+	}
+
+	if (info.dli_sname && info.dli_saddr == (void *) func) {
+		snprintf(buf, size, "%s", info.dli_sname);
+		return;
+	}
 
-		/* free the thread */
-		FREE(t);
-		m->alloc--;
+	file = strrchr(info.dli_fname, '/');
+	file = (file) ? file + 1 : info.dli_fname;
+	snprintf(buf, size, "%s+%#lx", file
+		 , (unsigned long) func - (unsigned long) info.dli_fbase);
+}
+
+/* Log scheduler statistics */
+void
+thread_stats_dump(void)
+{
+	char name[128];
+	char func[96];
+	int i;
+
+	log_message(LOG_INFO, "------< Scheduler statistics >------");
+	thread_pool_dump();
+	thread_hist_dump("Poll wait", &thread_wait);
+	thread_hist_dump("Timer lateness (critical)", &thread_lateness[THREAD_PRIO_CRITICAL]);
+	thread_hist_dump("Timer lateness (normal)", &thread_lateness[THREAD_PRIO_NORMAL]);
+	thread_hist_dump("Timer lateness (background)", &thread_lateness[THREAD_PRIO_BACKGROUND]);
+	for (i = 0; i <= THREAD_FUNC_STATS; i++) {
+		if (!thread_func_stats[i].run.count)
+			continue;
+		if (thread_func_stats[i].func) {
+			thread_func_name(thread_func_stats[i].func, func, sizeof (func));
+			snprintf(name, sizeof (name), "Thread %s", func);
+		} else
+			snprintf(name, sizeof (name), "Thread (others)");
+		thread_hist_dump(name, &thread_func_stats[i].run);
 	}
 }
 
-/* Move thread to unuse list. */
+/* Signal handler flavour of thread_stats_dump() */
+void
+thread_stats_handler(void *v, int sig)
+{
+	thread_stats_dump();
+}
+
+/* Release an unused thread. */
 static void
 thread_add_unuse(thread_master_t * m, thread_t * thread)
 {
@@ -145,10 +627,328 @@ thread_add_unuse(thread_master_t * m, thread_t * thread)
 	assert(thread->next == NULL);
 	assert(thread->prev == NULL);
 	assert(thread->type == THREAD_UNUSED);
-	thread_list_add(&m->unuse, thread);
+	thread_pool_put(thread);
+	m->alloc--;
+}
+
+#ifdef _WITH_IO_URING_
+/*
+ * io_uring rings, one per master. Each I/O thread is submitted as its
+ * operation linked to a LINK_TIMEOUT, so the kernel enforces the
+ * timeout and a single CQE reports either the result or -ECANCELED.
+ * SQEs are batched and submitted once per scheduler loop, the ring fd
+ * is polled with the other descriptors to learn about completions.
+ * Raw syscalls are used, liburing is not required.
+ */
+typedef struct _thread_ring {
+	int fd;
+	pid_t pid;			/* forked children must not touch it */
+	unsigned int sq_entries;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	struct io_uring_sqe *sqes;
+	unsigned int tail;		/* local SQ tail, published on submit */
+	unsigned int pending;		/* SQEs not yet submitted */
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+	void *sq_ptr;
+	size_t sq_len;
+	void *cq_ptr;
+	size_t cq_len;
+	size_t sqes_len;
+	struct __kernel_timespec *ts;	/* link timeouts, by SQE index */
+} thread_ring_t;
+
+static void
+thread_ring_unmap(thread_ring_t * ring)
+{
+	if (ring->sqes)
+		munmap(ring->sqes, ring->sqes_len);
+	if (ring->cq_ptr && ring->cq_ptr != ring->sq_ptr)
+		munmap(ring->cq_ptr, ring->cq_len);
+	if (ring->sq_ptr)
+		munmap(ring->sq_ptr, ring->sq_len);
+	if (ring->fd >= 0)
+		close(ring->fd);
+	FREE_PTR(ring->ts);
+	FREE(ring);
+}
+
+static thread_ring_t *
+thread_ring_init(void)
+{
+	struct io_uring_params p;
+	thread_ring_t *ring;
+	unsigned int *array;
+	unsigned int i;
+	void *ptr;
+
+	memset(&p, 0, sizeof (p));
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = 4 * THREAD_RING_ENTRIES;
+
+	ring = (thread_ring_t *) MALLOC(sizeof (thread_ring_t));
+	ring->fd = syscall(__NR_io_uring_setup, THREAD_RING_ENTRIES, &p);
+	if (ring->fd < 0) {
+		FREE(ring);
+		return NULL;
+	}
+	ring->pid = getpid();
+
+	ring->sq_len = p.sq_off.array + p.sq_entries * sizeof (unsigned int);
+	ring->cq_len = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_len > ring->sq_len)
+			ring->sq_len = ring->cq_len;
+		ring->cq_len = ring->sq_len;
+	}
+
+	ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ptr == MAP_FAILED)
+		goto err;
+	ring->sq_ptr = ptr;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ptr = ring->sq_ptr;
+	} else {
+		ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (ptr == MAP_FAILED)
+			goto err;
+		ring->cq_ptr = ptr;
+	}
+
+	ring->sqes_len = p.sq_entries * sizeof (struct io_uring_sqe);
+	ptr = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ptr == MAP_FAILED)
+		goto err;
+	ring->sqes = ptr;
+
+	ring->sq_entries = p.sq_entries;
+	ring->sq_head = (unsigned int *) ((char *) ring->sq_ptr + p.sq_off.head);
+	ring->sq_tail = (unsigned int *) ((char *) ring->sq_ptr + p.sq_off.tail);
+	ring->sq_mask = (unsigned int *) ((char *) ring->sq_ptr + p.sq_off.ring_mask);
+	ring->cq_head = (unsigned int *) ((char *) ring->cq_ptr + p.cq_off.head);
+	ring->cq_tail = (unsigned int *) ((char *) ring->cq_ptr + p.cq_off.tail);
+	ring->cq_mask = (unsigned int *) ((char *) ring->cq_ptr + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *) ((char *) ring->cq_ptr + p.cq_off.cqes);
+	ring->tail = *ring->sq_tail;
+
+	/* SQ index array is an identity mapping */
+	array = (unsigned int *) ((char *) ring->sq_ptr + p.sq_off.array);
+	for (i = 0; i < p.sq_entries; i++)
+		array[i] = i;
+
+	ring->ts = (struct __kernel_timespec *)
+		MALLOC(p.sq_entries * sizeof (struct __kernel_timespec));
+	return ring;
+
+err:
+	thread_ring_unmap(ring);
+	return NULL;
+}
+
+/* Submit queued SQEs */
+static int
+thread_ring_submit(thread_ring_t * ring)
+{
+	int ret;
+
+	if (!ring->pending)
+		return 0;
+
+	__atomic_store_n(ring->sq_tail, ring->tail, __ATOMIC_RELEASE);
+	ret = syscall(__NR_io_uring_enter, ring->fd, ring->pending, 0, 0, NULL, 0);
+	if (ret < 0) {
+		if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+			log_message(LOG_ERR, "io_uring_enter error (%s)"
+					   , strerror(errno));
+		return -1;
+	}
+
+	ring->pending -= (ret > ring->pending) ? ring->pending : ret;
+	return ret;
+}
+
+/* Make sure count SQEs are free, flushing the queue if needed */
+static int
+thread_ring_reserve(thread_ring_t * ring, unsigned int count)
+{
+	unsigned int used;
+
+	used = ring->tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	if (used + count <= ring->sq_entries)
+		return 1;
+
+	thread_ring_submit(ring);
+	used = ring->tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	return (used + count <= ring->sq_entries);
+}
+
+/* Next free SQE, space must have been reserved */
+static struct io_uring_sqe *
+thread_ring_sqe(thread_ring_t * ring, unsigned int *index)
+{
+	struct io_uring_sqe *sqe;
+
+	*index = ring->tail & *ring->sq_mask;
+	sqe = &ring->sqes[*index];
+	memset(sqe, 0, sizeof (struct io_uring_sqe));
+	ring->tail++;
+	ring->pending++;
+	return sqe;
+}
+
+/* Ring of a master, set up on first use */
+static thread_ring_t *
+thread_ring_get(thread_master_t * m)
+{
+#ifdef _WITH_EPOLL_
+	struct epoll_event ev;
+#endif
+
+	/* Completions are in real time, not in simulated one */
+	if (m->ring || m->ring_failed || m->sim)
+		return m->ring;
+
+	m->ring = thread_ring_init();
+	if (!m->ring) {
+		log_message(LOG_INFO, "io_uring setup error (%s), using %s"
+				    , strerror(errno)
+				    , (m->epoll_fd < 0) ? "select()" : "epoll");
+		m->ring_failed = 1;
+		return NULL;
+	}
+
+	if (m->epoll_fd < 0 && m->ring->fd >= FD_SETSIZE) {
+		log_message(LOG_INFO, "io_uring fd [%d] exceeds select()"
+				      " FD_SETSIZE, not used", m->ring->fd);
+		thread_ring_unmap(m->ring);
+		m->ring = NULL;
+		m->ring_failed = 1;
+		return NULL;
+	}
+
+#ifdef _WITH_EPOLL_
+	/* Completions are notified through the ring fd */
+	if (m->epoll_fd >= 0) {
+		memset(&ev, 0, sizeof (struct epoll_event));
+		ev.events = EPOLLIN;
+		ev.data.fd = m->ring->fd;
+		if (epoll_ctl(m->epoll_fd, EPOLL_CTL_ADD, m->ring->fd, &ev) < 0)
+			log_message(LOG_ERR, "epoll_ctl error on io_uring fd [%d] (%s)"
+					   , m->ring->fd, strerror(errno));
+	}
+#endif
+
+	return m->ring;
+}
+
+/* Move completed I/O threads to the ready queue */
+static void
+thread_ring_reap(thread_master_t * m)
+{
+	thread_ring_t *ring = m->ring;
+	struct io_uring_cqe *cqe;
+	unsigned int head, tail;
+	thread_t *t;
+
+	head = *ring->cq_head;
+	tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+	for (; head != tail; head++) {
+		cqe = &ring->cqes[head & *ring->cq_mask];
+		t = (thread_t *) (unsigned long) cqe->user_data;
+
+		/* LINK_TIMEOUT and cancel requests completions */
+		if (!t)
+			continue;
+
+		thread_list_delete(&m->io, t);
+		if (t->type == THREAD_IO_CANCEL) {
+			t->type = THREAD_UNUSED;
+			thread_add_unuse(m, t);
+			continue;
+		}
+
+		/* While in flight, res holds the type to report on timeout */
+		if (cqe->res == -ECANCELED) {
+			t->type = t->u.io.res;
+		} else {
+			t->type = THREAD_IO_DONE;
+			t->u.io.res = cqe->res;
+		}
+		thread_ready_add(m, t);
+	}
+
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* Ask the kernel to cancel an in flight I/O thread */
+static void
+thread_ring_cancel(thread_ring_t * ring, thread_t * thread)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int index;
+
+	if (!thread_ring_reserve(ring, 1))
+		return;
+
+	sqe = thread_ring_sqe(ring, &index);
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = (unsigned long) thread;
+	sqe->user_data = 0;
+}
+
+/*
+ * Cancel and wait for every in flight I/O so that no buffer is
+ * written by the kernel after its owner released it. Completed
+ * threads land into the ready queue, destroyed with it.
+ */
+static void
+thread_ring_destroy(thread_master_t * m)
+{
+	thread_ring_t *ring = m->ring;
+	thread_t *t;
+
+	if (!ring)
+		return;
+
+	if (ring->pid == getpid()) {
+		for (t = m->io.head; t; t = t->next)
+			thread_ring_cancel(ring, t);
+		thread_ring_submit(ring);
+
+		while (m->io.count) {
+			if (syscall(__NR_io_uring_enter, ring->fd, 0, 1,
+				    IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+			    errno != EINTR)
+				break;
+			thread_ring_reap(m);
+		}
+	}
+
+	/* Forked child: the ring is still the parent one */
+	while ((t = m->io.head)) {
+		thread_list_delete(&m->io, t);
+		if (t->type == THREAD_IO)
+			close(t->u.io.fd);
+		t->type = THREAD_UNUSED;
+		thread_add_unuse(m, t);
+	}
+
+	thread_ring_unmap(ring);
+	m->ring = NULL;
 }
+#endif
 
-/* Move list element to unuse queue */
+/* Release list elements */
 static void
 thread_destroy_list(thread_master_t * m, thread_list_t thread_list)
 {
@@ -162,37 +962,71 @@ thread_destroy_list(thread_master_t * m, thread_list_t thread_list)
 		t = thread;
 		thread = t->next;
 
-		if (t->type == THREAD_READY_FD ||
-		    t->type == THREAD_READ ||
-		    t->type == THREAD_WRITE ||
-		    t->type == THREAD_READ_TIMEOUT ||
-		    t->type == THREAD_WRITE_TIMEOUT)
+		if (t->type == THREAD_READY_FD ||
+		    t->type == THREAD_IO_DONE ||
+		    t->type == THREAD_READ ||
+		    t->type == THREAD_WRITE ||
+		    t->type == THREAD_READ_TIMEOUT ||
+		    t->type == THREAD_WRITE_TIMEOUT)
+			close (t->u.fd);
+
+		thread_list_delete(&thread_list, t);
+		t->type = THREAD_UNUSED;
+		thread_add_unuse(m, t);
+	}
+}
+
+/* Release heap elements */
+static void
+thread_destroy_heap(thread_master_t * m, thread_heap_t * heap)
+{
+	thread_t *t;
+
+	while ((t = thread_heap_top(heap))) {
+		thread_heap_delete(heap, t);
+
+		if (t->type == THREAD_CHILD)
+			thread_child_unhash(m, t);
+
+		if (t->type == THREAD_READ ||
+		    t->type == THREAD_WRITE)
 			close (t->u.fd);
 
-		thread_list_delete(&thread_list, t);
 		t->type = THREAD_UNUSED;
 		thread_add_unuse(m, t);
 	}
+
+	FREE_PTR(heap->node);
+	memset(heap, 0, sizeof (thread_heap_t));
 }
 
 /* Cleanup master */
 static void
 thread_cleanup_master(thread_master_t * m)
 {
+	int i;
+
+#ifdef _WITH_IO_URING_
+	/* In flight I/O first, completions go to the ready queue */
+	thread_ring_destroy(m);
+#endif
+
 	/* Unuse current thread lists */
-	thread_destroy_list(m, m->read);
-	thread_destroy_list(m, m->write);
-	thread_destroy_list(m, m->timer);
-	thread_destroy_list(m, m->event);
-	thread_destroy_list(m, m->ready);
+	thread_destroy_heap(m, &m->read);
+	thread_destroy_heap(m, &m->write);
+	thread_destroy_heap(m, &m->timer);
+	thread_destroy_heap(m, &m->child);
+	for (i = 0; i < THREAD_PRIO_MAX; i++) {
+		thread_destroy_list(m, m->event[i]);
+		thread_destroy_list(m, m->ready[i]);
+	}
 
 	/* Clear all FDs */
 	FD_ZERO(&m->readfd);
 	FD_ZERO(&m->writefd);
 	FD_ZERO(&m->exceptfd);
-
-	/* Clean garbage */
-	thread_clean_unuse(m);
+	if (m->fds)
+		memset(m->fds, 0, m->fds_size * sizeof (thread_fd_t));
 }
 
 /* Stop thread scheduler. */
@@ -200,6 +1034,15 @@ void
 thread_destroy_master(thread_master_t * m)
 {
 	thread_cleanup_master(m);
+
+	/*
+	 * A forked child shares the epoll set with its parent, so
+	 * we just close our descriptor without any epoll_ctl().
+	 */
+	if (m->epoll_fd >= 0)
+		close(m->epoll_fd);
+	FREE_PTR(m->epoll_events);
+	FREE_PTR(m->fds);
 	FREE(m);
 }
 
@@ -218,14 +1061,8 @@ thread_new(thread_master_t * m)
 {
 	thread_t *new;
 
-	/* If one thread is already allocated return it */
-	if (m->unuse.head) {
-		new = thread_trim_head(&m->unuse);
-		memset(new, 0, sizeof (thread_t));
-		return new;
-	}
-
-	new = (thread_t *) MALLOC(sizeof (thread_t));
+	new = thread_pool_get();
+	new->prio = thread_prio;
 	m->alloc++;
 	return new;
 }
@@ -239,7 +1076,10 @@ thread_add_read(thread_master_t * m, int (*func) (thread_t *)
 
 	assert(m != NULL);
 
-	if (FD_ISSET(fd, &m->readfd)) {
+	if (thread_fds_ensure(m, fd) < 0)
+		return NULL;
+
+	if (m->fds[fd].read) {
 		log_message(LOG_WARNING, "There is already read fd [%d]", fd);
 		return NULL;
 	}
@@ -250,15 +1090,16 @@ thread_add_read(thread_master_t * m, int (*func) (thread_t *)
 	thread->master = m;
 	thread->func = func;
 	thread->arg = arg;
-	FD_SET(fd, &m->readfd);
 	thread->u.fd = fd;
+	m->fds[fd].read = thread;
+	thread_fds_update(m, fd);
 
 	/* Compute read timeout value */
-	set_time_now();
+	thread_update_time();
 	thread->sands = timer_add_long(time_now, timer);
 
-	/* Sort the thread. */
-	thread_list_add_timeval(&m->read, thread);
+	/* Queue into read timeouts heap. */
+	thread_heap_add(&m->read, thread);
 
 	return thread;
 }
@@ -272,7 +1113,10 @@ thread_add_write(thread_master_t * m, int (*func) (thread_t *)
 
 	assert(m != NULL);
 
-	if (FD_ISSET(fd, &m->writefd)) {
+	if (thread_fds_ensure(m, fd) < 0)
+		return NULL;
+
+	if (m->fds[fd].write) {
 		log_message(LOG_WARNING, "There is already write fd [%d]", fd);
 		return NULL;
 	}
@@ -283,15 +1127,16 @@ thread_add_write(thread_master_t * m, int (*func) (thread_t *)
 	thread->master = m;
 	thread->func = func;
 	thread->arg = arg;
-	FD_SET(fd, &m->writefd);
 	thread->u.fd = fd;
+	m->fds[fd].write = thread;
+	thread_fds_update(m, fd);
 
 	/* Compute write timeout value */
-	set_time_now();
+	thread_update_time();
 	thread->sands = timer_add_long(time_now, timer);
 
-	/* Sort the thread. */
-	thread_list_add_timeval(&m->write, thread);
+	/* Queue into write timeouts heap. */
+	thread_heap_add(&m->write, thread);
 
 	return thread;
 }
@@ -313,11 +1158,11 @@ thread_add_timer(thread_master_t * m, int (*func) (thread_t *)
 	thread->arg = arg;
 
 	/* Do we need jitter here? */
-	set_time_now();
+	thread_update_time();
 	thread->sands = timer_add_long(time_now, timer);
 
-	/* Sort by timeval. */
-	thread_list_add_timeval(&m->timer, thread);
+	/* Queue into timers heap. */
+	thread_heap_add(&m->timer, thread);
 
 	return thread;
 }
@@ -341,11 +1186,12 @@ thread_add_child(thread_master_t * m, int (*func) (thread_t *)
 	thread->u.c.status = 0;
 
 	/* Compute write timeout value */
-	set_time_now();
+	thread_update_time();
 	thread->sands = timer_add_long(time_now, timer);
 
-	/* Sort by timeval. */
-	thread_list_add_timeval(&m->child, thread);
+	/* Queue into children heap and pid hash. */
+	thread_heap_add(&m->child, thread);
+	thread_list_add(thread_child_bucket(m, pid), thread);
 
 	return thread;
 }
@@ -366,7 +1212,7 @@ thread_add_event(thread_master_t * m, int (*func) (thread_t *)
 	thread->func = func;
 	thread->arg = arg;
 	thread->u.val = val;
-	thread_list_add(&m->event, thread);
+	thread_list_add(&m->event[thread->prio], thread);
 
 	return thread;
 }
@@ -386,9 +1232,124 @@ thread_add_terminate_event(thread_master_t * m)
 	thread->func = NULL;
 	thread->arg = NULL;
 	thread->u.val = 0;
-	thread_list_add(&m->event, thread);
+	thread_list_add(&m->event[thread->prio], thread);
+
+	return thread;
+}
+
+#ifdef _WITH_IO_URING_
+/*
+ * Queue an I/O thread and its link timeout. The caller fills the
+ * operation into the returned SQE.
+ */
+static thread_t *
+thread_add_io(thread_master_t * m, int (*func) (thread_t *), void *arg,
+	      int fd, long timer, int timeout_type, struct io_uring_sqe **sqe)
+{
+	thread_ring_t *ring = thread_ring_get(m);
+	struct io_uring_sqe *link;
+	thread_t *thread;
+	unsigned int index;
+
+	if (!ring || !thread_ring_reserve(ring, 2))
+		return NULL;
+
+	thread = thread_new(m);
+	thread->type = THREAD_IO;
+	thread->id = 0;
+	thread->master = m;
+	thread->func = func;
+	thread->arg = arg;
+	thread->u.io.fd = fd;
+	thread->u.io.res = timeout_type;
+	thread_update_time();
+	thread->sands = timer_add_long(time_now, timer);
+	thread_list_add(&m->io, thread);
+
+	*sqe = thread_ring_sqe(ring, &index);
+	(*sqe)->fd = fd;
+	(*sqe)->flags = IOSQE_IO_LINK;
+	(*sqe)->user_data = (unsigned long) thread;
+
+	link = thread_ring_sqe(ring, &index);
+	ring->ts[index].tv_sec = timer / TIMER_HZ;
+	ring->ts[index].tv_nsec = (timer % TIMER_HZ) * (1000000000 / TIMER_HZ);
+	link->opcode = IORING_OP_LINK_TIMEOUT;
+	link->fd = -1;
+	link->addr = (unsigned long) &ring->ts[index];
+	link->len = 1;
+	link->user_data = 0;
+
+	return thread;
+}
+#endif
+
+/*
+ * io_uring I/O threads. They return NULL when io_uring is not
+ * available, the caller then falls back to thread_add_read/write.
+ * The callback is run with THREAD_IO_DONE and THREAD_IO_RESULT()
+ * set to the syscall result (-errno on error), or with the usual
+ * READ/WRITE_TIMEOUT type. Buffers must stay valid until then.
+ */
+thread_t *
+thread_add_connect(thread_master_t * m, int (*func) (thread_t *)
+		   , void *arg, int fd, struct sockaddr_storage *addr, long timer)
+{
+#ifdef _WITH_IO_URING_
+	struct io_uring_sqe *sqe;
+	thread_t *thread;
+
+	thread = thread_add_io(m, func, arg, fd, timer, THREAD_WRITE_TIMEOUT, &sqe);
+	if (thread) {
+		sqe->opcode = IORING_OP_CONNECT;
+		sqe->addr = (unsigned long) addr;
+		sqe->off = sizeof (struct sockaddr_storage);
+	}
+	return thread;
+#else
+	return NULL;
+#endif
+}
+
+thread_t *
+thread_add_send(thread_master_t * m, int (*func) (thread_t *)
+		, void *arg, int fd, void *buf, size_t len, long timer)
+{
+#ifdef _WITH_IO_URING_
+	struct io_uring_sqe *sqe;
+	thread_t *thread;
+
+	thread = thread_add_io(m, func, arg, fd, timer, THREAD_WRITE_TIMEOUT, &sqe);
+	if (thread) {
+		sqe->opcode = IORING_OP_SEND;
+		sqe->addr = (unsigned long) buf;
+		sqe->len = len;
+		sqe->msg_flags = MSG_NOSIGNAL;
+	}
+	return thread;
+#else
+	return NULL;
+#endif
+}
+
+thread_t *
+thread_add_recv(thread_master_t * m, int (*func) (thread_t *)
+		, void *arg, int fd, void *buf, size_t len, long timer)
+{
+#ifdef _WITH_IO_URING_
+	struct io_uring_sqe *sqe;
+	thread_t *thread;
 
+	thread = thread_add_io(m, func, arg, fd, timer, THREAD_READ_TIMEOUT, &sqe);
+	if (thread) {
+		sqe->opcode = IORING_OP_RECV;
+		sqe->addr = (unsigned long) buf;
+		sqe->len = len;
+	}
 	return thread;
+#else
+	return NULL;
+#endif
 }
 
 /* Cancel thread from scheduler. */
@@ -400,32 +1361,48 @@ thread_cancel(thread_t * thread)
 
 	switch (thread->type) {
 	case THREAD_READ:
-		assert(FD_ISSET(thread->u.fd, &thread->master->readfd));
-		FD_CLR(thread->u.fd, &thread->master->readfd);
-		thread_list_delete(&thread->master->read, thread);
+		assert(thread->master->fds[thread->u.fd].read == thread);
+		thread->master->fds[thread->u.fd].read = NULL;
+		thread_fds_update(thread->master, thread->u.fd);
+		thread_heap_delete(&thread->master->read, thread);
 		break;
 	case THREAD_WRITE:
-		assert(FD_ISSET(thread->u.fd, &thread->master->writefd));
-		FD_CLR(thread->u.fd, &thread->master->writefd);
-		thread_list_delete(&thread->master->write, thread);
+		assert(thread->master->fds[thread->u.fd].write == thread);
+		thread->master->fds[thread->u.fd].write = NULL;
+		thread_fds_update(thread->master, thread->u.fd);
+		thread_heap_delete(&thread->master->write, thread);
 		break;
 	case THREAD_TIMER:
-		thread_list_delete(&thread->master->timer, thread);
+		thread_heap_delete(&thread->master->timer, thread);
 		break;
 	case THREAD_CHILD:
 		/* Does this need to kill the child, or is that the
 		 * caller's job?
 		 * This function is currently unused, so leave it for now.
 		 */
-		thread_list_delete(&thread->master->child, thread);
+		thread_heap_delete(&thread->master->child, thread);
+		thread_child_unhash(thread->master, thread);
 		break;
 	case THREAD_EVENT:
-		thread_list_delete(&thread->master->event, thread);
+		thread_list_delete(&thread->master->event[thread->prio], thread);
 		break;
 	case THREAD_READY:
 	case THREAD_READY_FD:
-		thread_list_delete(&thread->master->ready, thread);
+	case THREAD_IO_DONE:
+		thread_list_delete(&thread->master->ready[thread->prio], thread);
+		/* Registration was kept for its callback */
+		if (thread->type == THREAD_READY_FD &&
+		    thread->u.fd < thread->master->fds_size)
+			thread_fds_update(thread->master, thread->u.fd);
 		break;
+#ifdef _WITH_IO_URING_
+	case THREAD_IO:
+		/* Released once the kernel reports the cancelation */
+		thread->type = THREAD_IO_CANCEL;
+		thread_ring_cancel(thread->master->ring, thread);
+		thread_ring_submit(thread->master->ring);
+		return 0;
+#endif
 	default:
 		break;
 	}
@@ -440,33 +1417,36 @@ void
 thread_cancel_event(thread_master_t * m, void *arg)
 {
 	thread_t *thread;
+	int i;
 
-	thread = m->event.head;
-	while (thread) {
-		thread_t *t;
+	for (i = 0; i < THREAD_PRIO_MAX; i++) {
+		thread = m->event[i].head;
+		while (thread) {
+			thread_t *t;
 
-		t = thread;
-		thread = t->next;
+			t = thread;
+			thread = t->next;
 
-		if (t->arg == arg) {
-			thread_list_delete(&m->event, t);
-			t->type = THREAD_UNUSED;
-			thread_add_unuse(m, t);
+			if (t->arg == arg) {
+				thread_list_delete(&m->event[i], t);
+				t->type = THREAD_UNUSED;
+				thread_add_unuse(m, t);
+			}
 		}
 	}
 }
 
 /* Update timer value */
 static void
-thread_update_timer(thread_list_t *list, timeval_t *timer_min)
+thread_update_timer(thread_t *thread, timeval_t *timer_min)
 {
-	if (list->head) {
+	if (thread) {
 		if (!timer_isnull(*timer_min)) {
-			if (timer_cmp(list->head->sands, *timer_min) <= 0) {
-				*timer_min = list->head->sands;
+			if (timer_cmp(thread->sands, *timer_min) <= 0) {
+				*timer_min = thread->sands;
 			}
 		} else {
-			*timer_min = list->head->sands;
+			*timer_min = thread->sands;
 		}
 	}
 }
@@ -476,20 +1456,28 @@ static void
 thread_compute_timer(thread_master_t * m, timeval_t * timer_wait)
 {
 	timeval_t timer_min;
+	thread_t *thread;
 
 	/* Prepare timer */
 	timer_reset(timer_min);
-	thread_update_timer(&m->timer, &timer_min);
-	thread_update_timer(&m->write, &timer_min);
-	thread_update_timer(&m->read, &timer_min);
-	thread_update_timer(&m->child, &timer_min);
+
+	/*
+	 * Timers may be deferred by the slack: we sleep until the first
+	 * deadline plus slack, then every timer due by then fires in
+	 * the same wakeup. I/O timeouts and children keep precision.
+	 */
+	if ((thread = thread_heap_top(&m->timer)))
+		timer_min = timer_add_long(thread->sands, m->slack);
+	thread_update_timer(thread_heap_top(&m->write), &timer_min);
+	thread_update_timer(thread_heap_top(&m->read), &timer_min);
+	thread_update_timer(thread_heap_top(&m->child), &timer_min);
 
 	/* Take care about monothonic clock */
 	if (!timer_isnull(timer_min)) {
 		timer_min = timer_sub(timer_min, time_now);
 		if (timer_min.tv_sec < 0) {
 			timer_min.tv_sec = timer_min.tv_usec = 0;
-		} else if (timer_min.tv_sec >= 1) {
+		} else if (timer_min.tv_sec >= 1 && !m->sim) {
 			timer_min.tv_sec = 1;
 			timer_min.tv_usec = 0;
 		}
@@ -502,6 +1490,185 @@ thread_compute_timer(thread_master_t * m, timeval_t * timer_wait)
 	}
 }
 
+/*
+ * Move an I/O thread to the ready queue. The fd stays registered:
+ * most callbacks wait on the same fd again, the multiplexer is synced
+ * once the callback has returned (see thread_fetch()), which saves a
+ * DEL/ADD pair of epoll_ctl() per event.
+ */
+static void
+thread_move_ready_fd(thread_master_t * m, thread_heap_t * heap, thread_t * t,
+		     int type)
+{
+	if (heap == &m->read)
+		m->fds[t->u.fd].read = NULL;
+	else
+		m->fds[t->u.fd].write = NULL;
+	thread_heap_delete(heap, t);
+	thread_ready_add(m, t);
+	t->type = type;
+}
+
+/* Move threads of select() ready fds to the ready queue */
+static void
+thread_select_ready(thread_master_t * m, fd_set * readfd, fd_set * writefd,
+		    int count)
+{
+	thread_fd_t *tfd;
+	int fd;
+
+	for (fd = 0; fd < m->fds_size && count > 0; fd++) {
+		tfd = &m->fds[fd];
+		if (tfd->read && FD_ISSET(fd, readfd)) {
+			thread_move_ready_fd(m, &m->read, tfd->read,
+					     THREAD_READY_FD);
+			count--;
+		}
+		if (tfd->write && FD_ISSET(fd, writefd)) {
+			thread_move_ready_fd(m, &m->write, tfd->write,
+					     THREAD_READY_FD);
+			count--;
+		}
+	}
+}
+
+#ifdef _WITH_EPOLL_
+/* Wait for I/O events using epoll. Ready fds are moved to ready queue */
+static int
+thread_epoll_wait(thread_master_t * m, timeval_t * timer_wait)
+{
+	struct epoll_event ev;
+	thread_fd_t *tfd;
+	int signal_fd, signal_ready = 0;
+	int timeout, ret, i, fd;
+	int old_errno;
+#ifdef _WITH_SNMP_
+	timeval_t snmp_timer_wait;
+	int snmpblock = 0;
+	int fdsetsize;
+	fd_set readfd;
+#endif
+
+	/* Register signal descriptor */
+	signal_fd = (m->worker) ? -1 : signal_rfd();
+	if (signal_fd >= 0 && signal_fd != m->epoll_signal_fd) {
+		memset(&ev, 0, sizeof (struct epoll_event));
+		ev.events = EPOLLIN;
+		ev.data.fd = signal_fd;
+		if (epoll_ctl(m->epoll_fd, EPOLL_CTL_ADD, signal_fd, &ev) < 0 &&
+		    errno != EEXIST)
+			log_message(LOG_ERR, "epoll_ctl error on signal fd [%d] (%s)"
+					   , signal_fd, strerror(errno));
+		m->epoll_signal_fd = signal_fd;
+	}
+
+	/* epoll timeout is in ms, round it up */
+	timeout = timer_wait->tv_sec * 1000 + (timer_wait->tv_usec + 999) / 1000;
+
+#ifdef _WITH_SNMP_
+	/* SNMP only deals with fd_set, so we select() on its FD
+	 * and on the epoll descriptor itself. Same trick on timer
+	 * than the select() path. */
+	if (!m->worker) {
+		FD_ZERO(&readfd);
+		FD_SET(m->epoll_fd, &readfd);
+		fdsetsize = m->epoll_fd + 1;
+		snmpblock = 0;
+		memcpy(&snmp_timer_wait, timer_wait, sizeof(timeval_t));
+		snmp_select_info(&fdsetsize, &readfd, &snmp_timer_wait, &snmpblock);
+		if (snmpblock == 0)
+			memcpy(timer_wait, &snmp_timer_wait, sizeof(timeval_t));
+
+		ret = select(fdsetsize, &readfd, NULL, NULL, timer_wait);
+		old_errno = errno;
+		if (ret > 0)
+			snmp_read(&readfd);
+		else if (ret == 0)
+			snmp_timeout();
+		errno = old_errno;
+		if (ret <= 0 || !FD_ISSET(m->epoll_fd, &readfd))
+			return ret;
+		timeout = 0;
+	}
+#endif
+
+	ret = epoll_wait(m->epoll_fd, m->epoll_events, m->epoll_size, timeout);
+
+	/* we have to save errno here because the next syscalls will set it */
+	old_errno = errno;
+
+	for (i = 0; i < ret; i++) {
+		fd = m->epoll_events[i].data.fd;
+		ev.events = m->epoll_events[i].events;
+
+		if (fd == signal_fd) {
+			signal_ready = 1;
+			continue;
+		}
+#ifdef _WITH_IO_URING_
+		if (m->ring && fd == m->ring->fd)
+			continue;
+#endif
+
+		if (fd >= m->fds_size)
+			continue;
+		tfd = &m->fds[fd];
+
+		/* Stale registration, nobody is waiting for these */
+		if (tfd->events & ~thread_fds_events(tfd))
+			thread_fds_update(m, fd);
+
+		if (tfd->read && (ev.events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+			thread_move_ready_fd(m, &m->read, tfd->read,
+					     THREAD_READY_FD);
+		if (tfd->write && (ev.events & (EPOLLOUT | EPOLLHUP | EPOLLERR)))
+			thread_move_ready_fd(m, &m->write, tfd->write,
+					     THREAD_READY_FD);
+	}
+
+	/* All events slots used, there may be more pending next time */
+	if (ret == m->epoll_size) {
+		FREE(m->epoll_events);
+		m->epoll_size *= 2;
+		m->epoll_events = (struct epoll_event *)
+			MALLOC(m->epoll_size * sizeof (struct epoll_event));
+	}
+
+	/* handle signals synchronously, including child reaping */
+	if (signal_ready)
+		signal_run_callback();
+
+	errno = old_errno;
+	return ret;
+}
+#endif
+
+/* Number of event and ready threads */
+static int
+thread_queued(thread_master_t * m)
+{
+	int i, count = 0;
+
+	for (i = 0; i < THREAD_PRIO_MAX; i++)
+		count += m->event[i].count + m->ready[i].count;
+	return count;
+}
+
+/* Next event or ready thread. Events first within a class. */
+static thread_t *
+thread_trim_queued(thread_master_t * m)
+{
+	int i;
+
+	for (i = 0; i < THREAD_PRIO_MAX; i++) {
+		if (m->event[i].head)
+			return thread_trim_head(&m->event[i]);
+		if (m->ready[i].head)
+			return thread_trim_head(&m->ready[i]);
+	}
+	return NULL;
+}
+
 /* Fetch next ready thread. */
 thread_t *
 thread_fetch(thread_master_t * m, thread_t * fetch)
@@ -512,7 +1679,10 @@ thread_fetch(thread_master_t * m, thread_t * fetch)
 	fd_set writefd;
 	fd_set exceptfd;
 	timeval_t timer_wait;
+	timeval_t wait_start;
+	timeval_t sim_wait;
 	int signal_fd;
+	int use_select = (m->epoll_fd < 0);
 #ifdef _WITH_SNMP_
 	timeval_t snmp_timer_wait;
 	int snmpblock = 0;
@@ -521,34 +1691,55 @@ thread_fetch(thread_master_t * m, thread_t * fetch)
 
 	assert(m != NULL);
 
+	/* Registration of the fd last run is synced now its callback is done */
+	if (m->dispatch_fd >= 0) {
+		if (m->dispatch_fd < m->fds_size)
+			thread_fds_update(m, m->dispatch_fd);
+		m->dispatch_fd = -1;
+	}
+
 	/* Timer initialization */
 	memset(&timer_wait, 0, sizeof (timeval_t));
 
 retry:	/* When thread can't fetch try to find next thread again. */
 
-	/* If there is event process it first. */
-	while ((thread = thread_trim_head(&m->event))) {
-		*fetch = *thread;
+	/*
+	 * Dispatch budget exhausted while work is still queued. Poll
+	 * without waiting so that fds which became ready meanwhile and
+	 * expired timers get their turn instead of being starved by a
+	 * long burst.
+	 */
+	if (m->budget && m->dispatched >= m->budget && thread_queued(m)) {
+		m->dispatched = 0;
+		memset(&timer_wait, 0, sizeof (timeval_t));
+		set_time_now();
+		goto poll;
+	}
 
+	/* Events then ready threads, higher classes first */
+	if ((thread = thread_trim_queued(m))) {
 		/* If daemon hanging event is received return NULL pointer */
 		if (thread->type == THREAD_TERMINATE) {
 			thread->type = THREAD_UNUSED;
 			thread_add_unuse(m, thread);
 			return NULL;
 		}
-		thread->type = THREAD_UNUSED;
-		thread_add_unuse(m, thread);
-		return fetch;
-	}
 
-	/* If there is ready threads process them */
-	while ((thread = thread_trim_head(&m->ready))) {
+		thread_stats_dispatch(thread);
+		if (thread->type == THREAD_READY_FD ||
+		    thread->type == THREAD_READ_TIMEOUT ||
+		    thread->type == THREAD_WRITE_TIMEOUT)
+			m->dispatch_fd = thread->u.fd;
 		*fetch = *thread;
 		thread->type = THREAD_UNUSED;
 		thread_add_unuse(m, thread);
+		m->dispatched++;
 		return fetch;
 	}
 
+	/* Everything gathered by last poll has been run */
+	m->dispatched = 0;
+
 	/*
 	 * Re-read the current time to get the maximum accuracy.
 	 * Calculate select wait timer. Take care of timeouted fd.
@@ -556,13 +1747,43 @@ retry:	/* When thread can't fetch try to find next thread again. */
 	set_time_now();
 	thread_compute_timer(m, &timer_wait);
 
+poll:
+	wait_start = time_now;
+
+	/* Simulation: only look at fds, the clock jumps instead */
+	sim_wait = timer_wait;
+	if (m->sim)
+		timer_reset(timer_wait);
+
+#ifdef _WITH_IO_URING_
+	/* One submission for all I/O queued since last poll */
+	if (m->ring)
+		thread_ring_submit(m->ring);
+#endif
+
+#ifdef _WITH_EPOLL_
+	if (!use_select) {
+		ret = thread_epoll_wait(m, &timer_wait);
+		old_errno = errno;
+		goto process;
+	}
+#endif
+
 	/* Call select function. */
 	readfd = m->readfd;
 	writefd = m->writefd;
 	exceptfd = m->exceptfd;
 
-	signal_fd = signal_rfd();
-	FD_SET(signal_fd, &readfd);
+	/* Worker masters leave signals and SNMP to the main thread */
+	signal_fd = -1;
+	if (!m->worker) {
+		signal_fd = signal_rfd();
+		FD_SET(signal_fd, &readfd);
+	}
+#ifdef _WITH_IO_URING_
+	if (m->ring)
+		FD_SET(m->ring->fd, &readfd);
+#endif
 
 #ifdef _WITH_SNMP_
 	/* When SNMP is enabled, we may have to select() on additional
@@ -570,12 +1791,14 @@ retry:	/* When thread can't fetch try to find next thread again. */
 	 * with this function is its last argument. We need to set it
 	 * to 0 and we need to use the provided new timer only if it
 	 * is still set to 0. */
-	fdsetsize = FD_SETSIZE;
-	snmpblock = 0;
-	memcpy(&snmp_timer_wait, &timer_wait, sizeof(timeval_t));
-	snmp_select_info(&fdsetsize, &readfd, &snmp_timer_wait, &snmpblock);
-	if (snmpblock == 0)
-		memcpy(&timer_wait, &snmp_timer_wait, sizeof(timeval_t));
+	if (!m->worker) {
+		fdsetsize = FD_SETSIZE;
+		snmpblock = 0;
+		memcpy(&snmp_timer_wait, &timer_wait, sizeof(timeval_t));
+		snmp_select_info(&fdsetsize, &readfd, &snmp_timer_wait, &snmpblock);
+		if (snmpblock == 0)
+			memcpy(&timer_wait, &snmp_timer_wait, sizeof(timeval_t));
+	}
 #endif
 
 	ret = select(FD_SETSIZE, &readfd, &writefd, &exceptfd, &timer_wait);
@@ -585,18 +1808,28 @@ retry:	/* When thread can't fetch try to find next thread again. */
 
        /* Handle SNMP stuff */
 #ifdef _WITH_SNMP_
-	if (ret > 0)
+	if (m->worker)
+		;
+	else if (ret > 0)
 		snmp_read(&readfd);
 	else if (ret == 0)
 		snmp_timeout();
 #endif
 
 	/* handle signals synchronously, including child reaping */
-	if (FD_ISSET(signal_fd, &readfd))
+	if (signal_fd >= 0 && FD_ISSET(signal_fd, &readfd))
 		signal_run_callback();
 
+#ifdef _WITH_EPOLL_
+process:
+#endif
+	/* Simulation: nothing happened, go to the next deadline */
+	if (m->sim && ret == 0)
+		timer_set_virtual(timer_add(wait_start, sim_wait));
+
 	/* Update current time */
 	set_time_now();
+	thread_hist_add(&thread_wait, timer_long(timer_sub(time_now, wait_start)));
 
 	if (ret < 0) {
 		if (old_errno == EINTR)
@@ -606,103 +1839,170 @@ retry:	/* When thread can't fetch try to find next thread again. */
 		assert(0);
 	}
 
+#ifdef _WITH_IO_URING_
+	/* Completed I/O, cheap enough to look at each loop */
+	if (m->ring)
+		thread_ring_reap(m);
+#endif
+
 	/* Timeout children */
-	thread = m->child.head;
-	while (thread) {
-		thread_t *t;
+	while ((thread = thread_heap_trim_expired(&m->child))) {
+		thread_child_unhash(m, thread);
+		thread_ready_add(m, thread);
+		thread->type = THREAD_CHILD_TIMEOUT;
+	}
 
-		t = thread;
-		thread = t->next;
+	/* Ready fds, epoll already did the job */
+	if (use_select && ret > 0)
+		thread_select_ready(m, &readfd, &writefd, ret);
 
-		if (timer_cmp(time_now, t->sands) >= 0) {
-			thread_list_delete(&m->child, t);
-			thread_list_add(&m->ready, t);
-			t->type = THREAD_CHILD_TIMEOUT;
-		}
-	}
+	/* Read timeouts. */
+	while ((thread = thread_heap_expired(&m->read)))
+		thread_move_ready_fd(m, &m->read, thread, THREAD_READ_TIMEOUT);
 
-	/* Read thead. */
-	thread = m->read.head;
-	while (thread) {
-		thread_t *t;
+	/* Write timeouts. */
+	while ((thread = thread_heap_expired(&m->write)))
+		thread_move_ready_fd(m, &m->write, thread, THREAD_WRITE_TIMEOUT);
 
-		t = thread;
-		thread = t->next;
+	/* Exception thead. */
+	/*... */
 
-		if (FD_ISSET(t->u.fd, &readfd)) {
-			assert(FD_ISSET(t->u.fd, &m->readfd));
-			FD_CLR(t->u.fd, &m->readfd);
-			thread_list_delete(&m->read, t);
-			thread_list_add(&m->ready, t);
-			t->type = THREAD_READY_FD;
-		} else {
-			if (timer_cmp(time_now, t->sands) >= 0) {
-				FD_CLR(t->u.fd, &m->readfd);
-				thread_list_delete(&m->read, t);
-				thread_list_add(&m->ready, t);
-				t->type = THREAD_READ_TIMEOUT;
-			}
-		}
+	/* Timer update. */
+	while ((thread = thread_heap_trim_expired(&m->timer))) {
+		thread_ready_add(m, thread);
+		thread->type = THREAD_READY;
 	}
 
-	/* Write thead. */
-	thread = m->write.head;
-	while (thread) {
-		thread_t *t;
+#ifdef _WITH_SNMP_
+	if (!m->worker) {
+		run_alarms();
+		netsnmp_check_outstanding_agent_requests();
+	}
+#endif
 
-		t = thread;
-		thread = t->next;
+	/* Return one event, by class. Poll again if there is none. */
+	goto retry;
+}
 
-		if (FD_ISSET(t->u.fd, &writefd)) {
-			assert(FD_ISSET(t->u.fd, &writefd));
-			FD_CLR(t->u.fd, &m->writefd);
-			thread_list_delete(&m->write, t);
-			thread_list_add(&m->ready, t);
-			t->type = THREAD_READY_FD;
-		} else {
-			if (timer_cmp(time_now, t->sands) >= 0) {
-				FD_CLR(t->u.fd, &m->writefd);
-				thread_list_delete(&m->write, t);
-				thread_list_add(&m->ready, t);
-				t->type = THREAD_WRITE_TIMEOUT;
-			}
-		}
-	}
-	/* Exception thead. */
-	/*... */
+/* Set the number of threads run between two polls */
+void
+thread_set_budget(thread_master_t * m, int budget)
+{
+	m->budget = (budget > 0) ? budget : 0;
+	m->dispatched = 0;
+}
 
-	/* Timer update. */
-	thread = m->timer.head;
-	while (thread) {
-		thread_t *t;
+/* Set the priority class of a thread, requeue it if already queued */
+void
+thread_set_priority(thread_t * thread, int prio)
+{
+	thread_list_t *list;
 
-		t = thread;
-		thread = t->next;
+	if (!thread || prio < 0 || prio >= THREAD_PRIO_MAX)
+		return;
 
-		if (timer_cmp(time_now, t->sands) >= 0) {
-			thread_list_delete(&m->timer, t);
-			thread_list_add(&m->ready, t);
-			t->type = THREAD_READY;
-		}
+	switch (thread->type) {
+	case THREAD_EVENT:
+	case THREAD_TERMINATE:
+		list = thread->master->event;
+		break;
+	case THREAD_READY:
+	case THREAD_READY_FD:
+	case THREAD_IO_DONE:
+	case THREAD_READ_TIMEOUT:
+	case THREAD_WRITE_TIMEOUT:
+	case THREAD_CHILD_TIMEOUT:
+		list = thread->master->ready;
+		break;
+	default:
+		/* Not queued yet, class is used when it gets ready */
+		thread->prio = prio;
+		return;
 	}
 
-	/* Return one event. */
-	thread = thread_trim_head(&m->ready);
+	thread_list_delete(&list[thread->prio], thread);
+	thread->prio = prio;
+	thread_list_add(&list[prio], thread);
+}
 
-#ifdef _WITH_SNMP_
-	run_alarms();
-	netsnmp_check_outstanding_agent_requests();
-#endif
+/* Set the time timers may be deferred to share a wakeup */
+void
+thread_set_slack(thread_master_t * m, long slack)
+{
+	m->slack = (slack > 0) ? slack : 0;
+}
 
-	/* There is no ready thread. */
-	if (!thread)
-		goto retry;
+/*
+ * Simulation mode. The master runs on a virtual clock starting at
+ * start: thread_fetch() never sleeps, when no fd is ready it jumps
+ * straight to the next deadline. Peers are scripted on fake sockets
+ * with thread_sim_write(), so runs are reproducible and hours of
+ * scheduling are replayed in seconds.
+ */
+void
+thread_set_simulation(thread_master_t * m, timeval_t start)
+{
+	m->sim = 1;
+	timer_set_virtual(start);
+	set_time_now();
+}
 
-	*fetch = *thread;
-	thread->type = THREAD_UNUSED;
-	thread_add_unuse(m, thread);
+/* Fake socket, returns our end and the peer end to script */
+int
+thread_sim_socket(int *peer)
+{
+	int sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+		       0, sv) < 0)
+		return -1;
+	*peer = sv[1];
+	return sv[0];
+}
 
-	return fetch;
+/* Scripted peer write */
+typedef struct _thread_sim_io {
+	int fd;
+	int len;			/* -1 closes the peer */
+	char data[0];
+} thread_sim_io_t;
+
+static int
+thread_sim_io_thread(thread_t * thread)
+{
+	thread_sim_io_t *io = THREAD_ARG(thread);
+	char buf[512];
+
+	/* The peer consumes what it was sent, closing on unread data
+	 * would reset the connection */
+	while (read(io->fd, buf, sizeof(buf)) > 0)
+		;
+
+	if (io->len < 0)
+		close(io->fd);
+	else if (write(io->fd, io->data, io->len) != io->len)
+		DBG("simulated write error on fd %d", io->fd);
+	FREE(io);
+	return 0;
+}
+
+/* Have the peer send len bytes of data, or close if data is NULL,
+ * after delay usec of simulated time */
+thread_t *
+thread_sim_write(thread_master_t * m, int peer, const void *data, int len,
+		 long delay)
+{
+	thread_sim_io_t *io;
+
+	if (!data)
+		len = 0;
+	io = (thread_sim_io_t *) MALLOC(sizeof (thread_sim_io_t) + len);
+	io->fd = peer;
+	io->len = (data) ? len : -1;
+	if (data)
+		memcpy(io->data, data, len);
+
+	return thread_add_timer(m, thread_sim_io_thread, io, delay);
 }
 
 /* Synchronous signal handler to reap child processes */
@@ -710,12 +2010,7 @@ void
 thread_child_handler(void * v, int sig)
 {
 	thread_master_t * m = v;
-
-	/*
-	 * This is O(n^2), but there will only be a few entries on
-	 * this list.
-	 */
-	thread_t *thread;
+	thread_t *t;
 	pid_t pid;
 	int status = 77;
 	while ((pid = waitpid(-1, &status, WNOHANG))) {
@@ -725,14 +2020,11 @@ thread_child_handler(void * v, int sig)
 			DBG("waitpid error: %s", strerror(errno));
 			assert(0);
 		} else {
-			thread = m->child.head;
-			while (thread) {
-				thread_t *t;
-				t = thread;
-				thread = t->next;
+			for (t = thread_child_bucket(m, pid)->head; t; t = t->next) {
 				if (pid == t->u.c.pid) {
-					thread_list_delete(&m->child, t);
-					thread_list_add(&m->ready, t);
+					thread_child_unhash(m, t);
+					thread_heap_delete(&m->child, t);
+					thread_ready_add(m, t);
 					t->u.c.status = status;
 					t->type = THREAD_READY;
 					break;
@@ -755,8 +2047,22 @@ thread_get_id(void)
 void
 thread_call(thread_t * thread)
 {
+	thread_func_stats_t *stats;
+	timeval_t start;
+
 	thread->id = thread_get_id();
+	start = timer_real_now();
+
+	/* Threads it registers inherit its class. The callback may
+	 * destroy its master (reload), so this is not kept there. */
+	thread_prio = thread->prio;
+	thread_dispatching = 1;
 	(*thread->func) (thread);
+	thread_dispatching = 0;
+	thread_prio = THREAD_PRIO_NORMAL;
+
+	stats = thread_func_stats_get(thread->func);
+	thread_hist_add(&stats->run, timer_long(timer_sub(timer_real_now(), start)));
 }
 
 /* Our infinite scheduling loop */
@@ -31,21 +31,28 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <syslog.h>
+#include <sys/socket.h>
 #include "timer.h"
 
 /* Thread itself. */
 typedef struct _thread {
 	unsigned long id;
 	unsigned char type;		/* thread type */
+	unsigned char prio;		/* priority class */
 	struct _thread *next;		/* next pointer of the thread */
 	struct _thread *prev;		/* previous pointer of the thread */
 	struct _thread_master *master;	/* pointer to the struct thread_master. */
+	int index;			/* position into a thread heap */
 	int (*func) (struct _thread *);	/* event function */
 	void *arg;			/* event argument */
 	timeval_t sands;		/* rest of time sands value. */
 	union {
 		int val;		/* second argument of the event. */
 		int fd;			/* file descriptor in case of read/write. */
+		struct {
+			int fd;		/* same slot than fd above */
+			int res;	/* io_uring completion result */
+		} io;
 		struct {
 			pid_t pid;	/* process id a child thread is wanting. */
 			int status;	/* return status of the process */
@@ -60,21 +67,89 @@ typedef struct _thread_list {
 	int count;
 } thread_list_t;
 
+/* Min-heap of thread ordered by sands. */
+typedef struct _thread_heap {
+	thread_t **node;
+	int count;
+	int size;
+} thread_heap_t;
+
+/* I/O threads waiting on a file descriptor. */
+typedef struct _thread_fd {
+	thread_t *read;			/* pending read thread */
+	thread_t *write;		/* pending write thread */
+	unsigned int events;		/* events registered into epoll */
+} thread_fd_t;
+
+/* Scheduler statistics sizes. */
+#define THREAD_HIST_SIZE	24
+#define THREAD_FUNC_STATS	128	/* power of 2 */
+
+/*
+ * Priority classes. Ready and event threads of a higher class are
+ * always run first. New threads inherit the class of the thread
+ * being run, NORMAL outside of any thread.
+ */
+#define THREAD_PRIO_CRITICAL	0	/* VRRP adverts and dispatcher */
+#define THREAD_PRIO_NORMAL	1	/* checkers, default */
+#define THREAD_PRIO_BACKGROUND	2	/* alerting, stats */
+#define THREAD_PRIO_MAX		3
+
+/* Buckets of the pid to child thread hash, power of 2. */
+#define THREAD_CHILD_HASH	64
+
 /* Master of the theads. */
 typedef struct _thread_master {
-	thread_list_t read;
-	thread_list_t write;
-	thread_list_t timer;
-	thread_list_t child;
-	thread_list_t event;
-	thread_list_t ready;
-	thread_list_t unuse;
+	thread_heap_t read;
+	thread_heap_t write;
+	thread_heap_t timer;
+	thread_heap_t child;
+	thread_list_t child_pid[THREAD_CHILD_HASH]; /* children by pid */
+	thread_list_t event[THREAD_PRIO_MAX];	/* by priority class */
+	thread_list_t ready[THREAD_PRIO_MAX];
 	fd_set readfd;
 	fd_set writefd;
 	fd_set exceptfd;
-	unsigned long alloc;
+	thread_fd_t *fds;		/* fd indexed I/O threads */
+	int fds_size;
+	int epoll_fd;			/* -1 when select() is used */
+	int epoll_signal_fd;		/* signal fd registered into epoll */
+	int dispatch_fd;		/* fd of the I/O thread last fetched */
+	struct epoll_event *epoll_events;
+	int epoll_size;
+	int worker;			/* worker pthread: no signal, no SNMP */
+	struct _thread_ring *ring;	/* io_uring, created on first use */
+	int ring_failed;		/* io_uring unavailable, don't retry */
+	thread_list_t io;		/* threads submitted to io_uring */
+	int budget;			/* threads run between polls, 0 = no limit */
+	int dispatched;			/* threads run since last poll */
+	long slack;			/* timer coalescing window, usec */
+	int sim;			/* simulated clock, never sleeps */
+	unsigned long alloc;		/* threads held by this master */
 } thread_master_t;
 
+/* Thread pool statistics. */
+typedef struct _thread_pool_stats {
+	unsigned long allocated;	/* threads carved out of slabs */
+	unsigned long in_use;		/* threads handed out to masters */
+	unsigned long high_water;	/* highest in_use seen */
+	unsigned long slabs;
+} thread_pool_stats_t;
+
+/* Log2 histogram of durations, bucket i counts [2^i, 2^(i+1)) usec. */
+typedef struct _thread_hist {
+	unsigned long count;
+	unsigned long total;		/* usec */
+	unsigned long max;		/* usec */
+	unsigned long bucket[THREAD_HIST_SIZE];
+} thread_hist_t;
+
+/* Run time statistics of a thread function. */
+typedef struct _thread_func_stats {
+	int (*func) (struct _thread *);	/* NULL for the overflow entry */
+	thread_hist_t run;
+} thread_func_stats_t;
+
 /* Thread types. */
 #define THREAD_READ		0
 #define THREAD_WRITE		1
@@ -88,6 +163,17 @@ typedef struct _thread_master {
 #define THREAD_CHILD_TIMEOUT	9
 #define THREAD_TERMINATE	10
 #define THREAD_READY_FD		11
+#define THREAD_IO		12
+#define THREAD_IO_DONE		13
+#define THREAD_IO_CANCEL	14
+
+/* I/O multiplexer backends */
+#define THREAD_EPOLL_EVENTS	64
+#define THREAD_FDS_MIN		64
+#define THREAD_HEAP_MIN		64
+#define THREAD_HEAP_ARITY	4
+#define THREAD_SLAB_SIZE	64
+#define THREAD_RING_ENTRIES	256
 
 /* MICRO SEC def */
 #define BOOTSTRAP_DELAY TIMER_HZ
@@ -99,6 +185,7 @@ typedef struct _thread_master {
 #define THREAD_VAL(X) ((X)->u.val)
 #define THREAD_CHILD_PID(X) ((X)->u.c.pid)
 #define THREAD_CHILD_STATUS(X) ((X)->u.c.status)
+#define THREAD_IO_RESULT(X) ((X)->u.io.res)
 
 /* global vars exported */
 extern thread_master_t *master;
@@ -112,11 +199,28 @@ extern thread_t *thread_add_write(thread_master_t *, int (*func) (thread_t *), v
 extern thread_t *thread_add_timer(thread_master_t *, int (*func) (thread_t *), void *, long);
 extern thread_t *thread_add_child(thread_master_t *, int (*func) (thread_t *), void *, pid_t, long);
 extern thread_t *thread_add_event(thread_master_t *, int (*func) (thread_t *), void *, int);
+extern thread_t *thread_add_connect(thread_master_t *, int (*func) (thread_t *), void *, int,
+				    struct sockaddr_storage *, long);
+extern thread_t *thread_add_send(thread_master_t *, int (*func) (thread_t *), void *, int,
+				 void *, size_t, long);
+extern thread_t *thread_add_recv(thread_master_t *, int (*func) (thread_t *), void *, int,
+				 void *, size_t, long);
 extern int thread_cancel(thread_t *);
 extern void thread_cancel_event(thread_master_t *, void *);
 extern thread_t *thread_fetch(thread_master_t *, thread_t *);
 extern void thread_child_handler(void *, int);
 extern void thread_call(thread_t *);
+extern void thread_set_budget(thread_master_t *, int);
+extern void thread_set_slack(thread_master_t *, long);
+extern void thread_set_priority(thread_t *, int);
+extern void thread_set_simulation(thread_master_t *, timeval_t);
+extern int thread_sim_socket(int *);
+extern thread_t *thread_sim_write(thread_master_t *, int, const void *, int, long);
+extern void thread_pool_stats(thread_pool_stats_t *);
+extern void thread_pool_dump(void);
+extern void thread_pool_destroy(void);
+extern void thread_stats_dump(void);
+extern void thread_stats_handler(void *, int);
 extern void launch_scheduler(void);
 
 #endif
@@ -27,6 +27,7 @@
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/signalfd.h>
 #include <errno.h>
 #include <assert.h>
 #include <syslog.h>
@@ -43,7 +44,15 @@ void (*signal_SIGTERM_handler) (void *, int sig);
 void *signal_SIGTERM_v;
 void (*signal_SIGCHLD_handler) (void *, int sig);
 void *signal_SIGCHLD_v;
+void (*signal_SIGUSR1_handler) (void *, int sig);
+void *signal_SIGUSR1_v;
 
+/*
+ * Signals are read synchronously from a signalfd when the kernel
+ * provides it. Otherwise the handler forwards them through a pipe.
+ */
+static int signal_sfd = -1;
+static sigset_t signal_sfd_mask;
 static int signal_pipe[2] = { -1, -1 };
 
 /* Local signal test */
@@ -55,9 +64,9 @@ signal_pending(void)
 	struct timeval timeout = { 0, 0 };
 
 	FD_ZERO(&readset);
-	FD_SET(signal_pipe[0], &readset);
+	FD_SET(signal_rfd(), &readset);
 
-	rc = select(signal_pipe[0] + 1, &readset, NULL, NULL, &timeout);
+	rc = select(signal_rfd() + 1, &readset, NULL, NULL, &timeout);
 
 	return rc>0?1:0;
 }
@@ -79,8 +88,18 @@ signal_set(int signo, void (*func) (void *, int), void *v)
 	int ret;
 	struct sigaction sig;
 	struct sigaction osig;
+	sigset_t set;
+
+	/* Blocked and queued to the signalfd, keep default disposition */
+	if (signal_sfd >= 0) {
+		sigaddset(&signal_sfd_mask, signo);
+		sigemptyset(&set);
+		sigaddset(&set, signo);
+		sigprocmask(SIG_BLOCK, &set, NULL);
+		signalfd(signal_sfd, &signal_sfd_mask, 0);
+	}
 
-	sig.sa_handler = signal_handler;
+	sig.sa_handler = (signal_sfd >= 0) ? SIG_DFL : signal_handler;
 	sigemptyset(&sig.sa_mask);
 	sig.sa_flags = 0;
 #ifdef SA_RESTART
@@ -106,6 +125,10 @@ signal_set(int signo, void (*func) (void *, int), void *v)
 		signal_SIGCHLD_handler = func;
 		signal_SIGCHLD_v = v;
 		break;
+	case SIGUSR1:
+		signal_SIGUSR1_handler = func;
+		signal_SIGUSR1_v = v;
+		break;
 	}
 
 	if (ret < 0)
@@ -125,16 +148,23 @@ signal_ignore(int signo)
 void
 signal_handler_init(void)
 {
-	int n = pipe(signal_pipe);
-	assert(!n);
+	int n;
+
+	sigemptyset(&signal_sfd_mask);
+	signal_sfd = signalfd(-1, &signal_sfd_mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (signal_sfd < 0) {
+		n = pipe(signal_pipe);
+		assert(!n);
 
-	fcntl(signal_pipe[0], F_SETFL, O_NONBLOCK | fcntl(signal_pipe[0], F_GETFL));
-	fcntl(signal_pipe[1], F_SETFL, O_NONBLOCK | fcntl(signal_pipe[1], F_GETFL));
+		fcntl(signal_pipe[0], F_SETFL, O_NONBLOCK | fcntl(signal_pipe[0], F_GETFL));
+		fcntl(signal_pipe[1], F_SETFL, O_NONBLOCK | fcntl(signal_pipe[1], F_GETFL));
+	}
 
 	signal_SIGHUP_handler = NULL;
 	signal_SIGINT_handler = NULL;
 	signal_SIGTERM_handler = NULL;
 	signal_SIGCHLD_handler = NULL;
+	signal_SIGUSR1_handler = NULL;
 }
 
 void
@@ -151,12 +181,14 @@ signal_wait_handlers(void)
 	sigaction(SIGINT, &sig, NULL);
 	sigaction(SIGTERM, &sig, NULL);
 	sigaction(SIGCHLD, &sig, NULL);
+	sigaction(SIGUSR1, &sig, NULL);
 
 	/* reset */
 	signal_SIGHUP_v = NULL;
 	signal_SIGINT_v = NULL;
 	signal_SIGTERM_v = NULL;
 	signal_SIGCHLD_v = NULL;
+	signal_SIGUSR1_v = NULL;
 }
 
 void signal_reset(void)
@@ -166,12 +198,30 @@ void signal_reset(void)
 	signal_SIGINT_handler = NULL;
 	signal_SIGTERM_handler = NULL;
 	signal_SIGCHLD_handler = NULL;
+	signal_SIGUSR1_handler = NULL;
 }
 
 void
 signal_handler_destroy(void)
 {
+	struct signalfd_siginfo info;
+
 	signal_wait_handlers();
+
+	/*
+	 * Drop what is still queued like the pipe flavour does, then
+	 * unblock so that forked children and exec'ed scripts get the
+	 * signal mask we were started with.
+	 */
+	if (signal_sfd >= 0) {
+		while (read(signal_sfd, &info, sizeof(info)) == sizeof(info))
+			;
+		sigprocmask(SIG_UNBLOCK, &signal_sfd_mask, NULL);
+		sigemptyset(&signal_sfd_mask);
+		close(signal_sfd);
+		signal_sfd = -1;
+	}
+
 	close(signal_pipe[1]);
 	close(signal_pipe[0]);
 	signal_pipe[1] = -1;
@@ -181,35 +231,54 @@ signal_handler_destroy(void)
 int
 signal_rfd(void)
 {
+	if (signal_sfd >= 0)
+		return signal_sfd;
 	return(signal_pipe[0]);
 }
 
+/* Run the handler of a signal */
+static void
+signal_run(int sig)
+{
+	switch(sig) {
+	case SIGHUP:
+		if (signal_SIGHUP_handler)
+			signal_SIGHUP_handler(signal_SIGHUP_v, SIGHUP);
+		break;
+	case SIGINT:
+		if (signal_SIGINT_handler)
+			signal_SIGINT_handler(signal_SIGINT_v, SIGINT);
+		break;
+	case SIGTERM:
+		if (signal_SIGTERM_handler)
+			signal_SIGTERM_handler(signal_SIGTERM_v, SIGTERM);
+		break;	
+	case SIGCHLD:	
+		if (signal_SIGCHLD_handler)
+			signal_SIGCHLD_handler(signal_SIGCHLD_v, SIGCHLD);
+		break;
+	case SIGUSR1:
+		if (signal_SIGUSR1_handler)
+			signal_SIGUSR1_handler(signal_SIGUSR1_v, SIGUSR1);
+		break;
+	default:
+		break;
+	}	
+}
+
 /* Handlers callback  */
 void
 signal_run_callback(void)
 {
+	struct signalfd_siginfo info;
 	int sig;
 
-	while(read(signal_pipe[0], &sig, sizeof(int)) == sizeof(int)) {
-		switch(sig) {
-		case SIGHUP:
-			if (signal_SIGHUP_handler)
-				signal_SIGHUP_handler(signal_SIGHUP_v, SIGHUP);
-			break;
-		case SIGINT:
-			if (signal_SIGINT_handler)
-				signal_SIGINT_handler(signal_SIGINT_v, SIGINT);
-			break;
-		case SIGTERM:
-			if (signal_SIGTERM_handler)
-				signal_SIGTERM_handler(signal_SIGTERM_v, SIGTERM);
-			break;	
-		case SIGCHLD:	
-			if (signal_SIGCHLD_handler)
-				signal_SIGCHLD_handler(signal_SIGCHLD_v, SIGCHLD);
-			break;
-		default:
-			break;
-		}	
+	if (signal_sfd >= 0) {
+		while (read(signal_sfd, &info, sizeof(info)) == sizeof(info))
+			signal_run(info.ssi_signo);
+		return;
 	}
+
+	while(read(signal_pipe[0], &sig, sizeof(int)) == sizeof(int))
+		signal_run(sig);
 }
@@ -23,10 +23,15 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
 #include "timer.h"
 
-/* time_now holds current time */
-timeval_t time_now = { tv_sec: 0, tv_usec: 0 };
+/* time_now holds current time, per pthread */
+__thread timeval_t time_now = { tv_sec: 0, tv_usec: 0 };
+
+/* Simulated clock, only moved forward by timer_set_virtual() */
+static __thread timeval_t virtual_now;
+static __thread int virtual_clock;
 
 /* set a timer to a specific value */
 timeval_t
@@ -108,115 +113,61 @@ timer_add_long(timeval_t a, long b)
 	return ret;
 }
 
-/* This function is a wrapper for gettimeofday(). It uses local storage to
- * guarantee that the returned time will always be monotonic. If the time goes
- * backwards, it returns the same as previous one and readjust its internal
- * drift. If the time goes forward further than TIME_MAX_FORWARD_US
- * microseconds since last call, it will bound it to that value. It is designed
- * to be used as a drop-in replacement of gettimeofday(&now, NULL). It will
- * normally return 0, unless <now> is NULL, in which case it will return -1 and
- * set errno to EFAULT.
+/*
+ * Current time, from the system clock even when simulating.
+ * CLOCK_MONOTONIC never jumps when the date is changed and is read
+ * from the vDSO, without entering the kernel.
  */
-int monotonic_gettimeofday(timeval_t *now)
+timeval_t
+timer_real_now(void)
 {
-	static timeval_t mono_date;
-	static timeval_t drift; /* warning: signed seconds! */
-	timeval_t sys_date, adjusted, deadline;
-
-	if (!now) {
-		errno = EFAULT;
-		return -1;
-	}
-
-	gettimeofday(&sys_date, NULL);
-
-	/* on first call, we set mono_date to system date */
-	if (mono_date.tv_sec == 0) {
-		mono_date = sys_date;
-		drift.tv_sec = drift.tv_usec = 0;
-		*now = mono_date;
-		return 0;
-	}
-
-	/* compute new adjusted time by adding the drift offset */
-	adjusted.tv_sec  = sys_date.tv_sec  + drift.tv_sec;
-	adjusted.tv_usec = sys_date.tv_usec + drift.tv_usec;
-	if (adjusted.tv_usec >= TIMER_HZ) {
-		adjusted.tv_usec -= TIMER_HZ;
-		adjusted.tv_sec++;
-	}
-
-	/* check for jumps in the past, and bound to last date */
-	if (adjusted.tv_sec  <  mono_date.tv_sec ||
-	    (adjusted.tv_sec  == mono_date.tv_sec &&
-	     adjusted.tv_usec <  mono_date.tv_usec))
-		goto fixup;
-
-	/* check for jumps too far in the future, and bound them to
-	 * TIME_MAX_FORWARD_US microseconds.
-	 */
-	deadline.tv_sec  = mono_date.tv_sec  + TIME_MAX_FORWARD_US / TIMER_HZ;
-	deadline.tv_usec = mono_date.tv_usec + TIME_MAX_FORWARD_US % TIMER_HZ;
-	if (deadline.tv_usec >= TIMER_HZ) {
-		deadline.tv_usec -= TIMER_HZ;
-		deadline.tv_sec++;
-	}
-
-	if (adjusted.tv_sec  >  deadline.tv_sec ||
-	    (adjusted.tv_sec  == deadline.tv_sec &&
-	     adjusted.tv_usec >= deadline.tv_usec)) {
-		mono_date = deadline;
-		goto fixup;
-	}
+	struct timespec ts;
+	timeval_t curr_time;
+	int old_errno = errno;
 
-	/* adjusted date is correct */
-	mono_date = adjusted;
-	*now = mono_date;
-	return 0;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	curr_time.tv_sec = ts.tv_sec;
+	curr_time.tv_usec = ts.tv_nsec / 1000;
+	errno = old_errno;
 
- fixup:
-	/* Now we have to recompute the drift between sys_date and
-	 * mono_date. Since it can be negative and we don't want to
-	 * play with negative carries in all computations, we take
-	 * care of always having the microseconds positive.
-	 */
-	drift.tv_sec  = mono_date.tv_sec  - sys_date.tv_sec;
-	drift.tv_usec = mono_date.tv_usec - sys_date.tv_usec;
-	if (drift.tv_usec < 0) {
-		drift.tv_usec += TIMER_HZ;
-		drift.tv_sec--;
-	}
-	*now = mono_date;
-	return 0;
+	return curr_time;
 }
 
 /* current time */
 timeval_t
 timer_now(void)
 {
-	timeval_t curr_time;
-	int old_errno = errno;
-
-	/* init timer */
-	timer_reset(curr_time);
-	monotonic_gettimeofday(&curr_time);
-	errno = old_errno;
-
-	return curr_time;
+	if (virtual_clock)
+		return virtual_now;
+	return timer_real_now();
 }
 
 /* sets and returns current time from system time */
 timeval_t
 set_time_now(void)
 {
-	int old_errno = errno;
+	time_now = timer_now();
+	return time_now;
+}
 
-	/* init timer */
-	timer_reset(time_now);
-	monotonic_gettimeofday(&time_now);
-	errno = old_errno;
+/*
+ * Switch the calling pthread to a simulated clock. Time then only
+ * moves when told to, it never goes backward. Used to replay hours
+ * of scheduling in seconds.
+ */
+void
+timer_set_virtual(timeval_t a)
+{
+	if (virtual_clock && timer_cmp(a, virtual_now) < 0)
+		return;
+	virtual_now = a;
+	virtual_clock = 1;
+}
 
-	return time_now;
+int
+timer_is_virtual(void)
+{
+	return virtual_clock;
 }
 
 /* timer sub from current time */
@@ -28,10 +28,9 @@
 typedef struct timeval timeval_t;
 
 /* Global vars */
-extern timeval_t time_now;
+extern __thread timeval_t time_now;
 
 /* Some defines */
-#define TIME_MAX_FORWARD_US	2000000
 #define TIMER_HZ		1000000
 #define TIMER_MAX_SEC		1000
 
@@ -43,6 +42,7 @@ extern timeval_t time_now;
 
 /* prototypes */
 extern timeval_t timer_now(void);
+extern timeval_t timer_real_now(void);
 extern timeval_t set_time_now(void);
 extern timeval_t timer_dup(timeval_t);
 extern int timer_cmp(timeval_t, timeval_t);
@@ -53,5 +53,7 @@ extern timeval_t timer_sub_now(timeval_t);
 extern timeval_t timer_add_now(timeval_t);
 extern void timer_dump(timeval_t);
 extern unsigned long timer_tol(timeval_t);
+extern void timer_set_virtual(timeval_t);
+extern int timer_is_virtual(void);
 
 #endif
@@ -101,11 +101,73 @@ in_csum(u_short * addr, int len, u_short csum)
 	return (answer);
 }
 
+/* CRC32 tables, one per byte of a 64bit word */
+static uint32_t crc32_table[8][256];
+static int crc32_ready;
+
+static void
+crc32_init(void)
+{
+	uint32_t c;
+	int i, k;
+
+	for (i = 0; i < 256; i++) {
+		c = i;
+		for (k = 0; k < 8; k++)
+			c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+		crc32_table[0][i] = c;
+	}
+	for (i = 0; i < 256; i++) {
+		c = crc32_table[0][i];
+		for (k = 1; k < 8; k++) {
+			c = crc32_table[0][c & 0xff] ^ (c >> 8);
+			crc32_table[k][i] = c;
+		}
+	}
+
+	/* Checker threads may race here, they all write the same */
+	__atomic_store_n(&crc32_ready, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Update a CRC32 (IEEE 802.3, as zlib and cksum -a crc32b) with len
+ * bytes. Start with crc = 0. Eight bytes per step, slicing tables.
+ */
+uint32_t
+crc32_update(uint32_t crc, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	uint32_t hi;
+
+	if (!__atomic_load_n(&crc32_ready, __ATOMIC_ACQUIRE))
+		crc32_init();
+
+	crc = ~crc;
+	while (len >= 8) {
+		crc ^= p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+		hi = p[4] | (p[5] << 8) | (p[6] << 16) | ((uint32_t) p[7] << 24);
+		crc = crc32_table[7][crc & 0xff] ^
+		      crc32_table[6][(crc >> 8) & 0xff] ^
+		      crc32_table[5][(crc >> 16) & 0xff] ^
+		      crc32_table[4][crc >> 24] ^
+		      crc32_table[3][hi & 0xff] ^
+		      crc32_table[2][(hi >> 8) & 0xff] ^
+		      crc32_table[1][(hi >> 16) & 0xff] ^
+		      crc32_table[0][hi >> 24];
+		p += 8;
+		len -= 8;
+	}
+	while (len--)
+		crc = crc32_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+	return ~crc;
+}
+
 /* IP network to ascii representation */
 char *
 inet_ntop2(uint32_t ip)
 {
-	static char buf[16];
+	static __thread char buf[16];
 	unsigned char *bytep;
 
 	bytep = (unsigned char *) &(ip);
@@ -249,7 +311,7 @@ inet_sockaddrtos2(struct sockaddr_storage *addr, char *addr_str)
 char *
 inet_sockaddrtos(struct sockaddr_storage *addr)
 {
-	static char addr_str[INET6_ADDRSTRLEN];
+	static __thread char addr_str[INET6_ADDRSTRLEN];
 	inet_sockaddrtos2(addr, addr_str);
 	return addr_str;
 }
@@ -273,8 +335,8 @@ inet_sockaddrport(struct sockaddr_storage *addr)
 char *
 inet_sockaddrtopair(struct sockaddr_storage *addr)
 {
-	static char addr_str[INET6_ADDRSTRLEN + 1];
-	static char ret[sizeof(addr_str) + 16];
+	static __thread char addr_str[INET6_ADDRSTRLEN + 1];
+	static __thread char ret[sizeof(addr_str) + 16];
 
 	inet_sockaddrtos2(addr, addr_str);
 	snprintf(ret, sizeof(ret) - 1, "[%s]:%d"
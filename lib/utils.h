@@ -49,6 +49,7 @@ extern int debug;
 /* Prototypes defs */
 extern void dump_buffer(char *, int);
 extern u_short in_csum(u_short *, int, u_short);
+extern uint32_t crc32_update(uint32_t, const void *, size_t);
 extern char *inet_ntop2(uint32_t);
 extern char *inet_ntoa2(uint32_t, char *);
 extern uint8_t inet_stom(char *);
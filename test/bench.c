@@ -0,0 +1,380 @@
+/*
+ * Soft:        Keepalived is a failover program for the LVS project
+ *              <www.linuxvirtualserver.org>. It monitor & manipulate
+ *              a loadbalanced server pool using multi-layer checks.
+ *
+ * Part:        Microbenchmarks of lib/ primitives and of the scheduler.
+ *              Results are printed one per line, tab separated :
+ *              name, size, ops, ns/op, ops/s. An optional argument
+ *              only runs the groups (thread, list, vector, alloc_strvec,
+ *              in_csum, crc32, http_parse, inet_sockaddrtopair)
+ *              starting with it.
+ *
+ * Author:      Alexandre Cassen, <acassen@linux-vs.org>
+ *
+ *              This program is distributed in the hope that it will be useful,
+ *              but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *              MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *              See the GNU General Public License for more details.
+ *
+ *              This program is free software; you can redistribute it and/or
+ *              modify it under the terms of the GNU General Public License
+ *              as published by the Free Software Foundation; either version
+ *              2 of the License, or (at your option) any later version.
+ *
+ * Copyright (C) 2001-2012 Alexandre Cassen, <acassen@gmail.com>
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "scheduler.h"
+#include "timer.h"
+#include "list.h"
+#include "vector.h"
+#include "parser.h"
+#include "memory.h"
+#include "utils.h"
+#include "html.h"
+
+/* Each measure runs at least that long */
+#define BENCH_MIN_TIME	(TIMER_HZ / 5)
+
+static const char *bench_filter;
+static unsigned int bench_seed = 1;
+
+/* Benchmark result, one line */
+static void
+bench_report(const char *name, long size, unsigned long ops, long usec)
+{
+	double ns = (ops) ? (double) usec * 1000 / ops : 0;
+
+	printf("%s\t%ld\t%lu\t%.1f\t%.0f\n", name, size, ops, ns,
+	       (usec) ? (double) ops * TIMER_HZ / usec : 0);
+	fflush(stdout);
+}
+
+static int
+bench_enabled(const char *name)
+{
+	return !bench_filter || !strncmp(name, bench_filter, strlen(bench_filter));
+}
+
+static long
+bench_elapsed(timeval_t start)
+{
+	return timer_long(timer_sub(timer_real_now(), start));
+}
+
+/* Deterministic pseudo random, same runs compare */
+static unsigned int
+bench_rand(void)
+{
+	bench_seed = bench_seed * 1103515245 + 12345;
+	return bench_seed >> 8;
+}
+
+/* Scheduler */
+static int
+bench_thread(thread_t * thread)
+{
+	return 0;
+}
+
+/*
+ * A round adds size timers spread over 10s, cancels half of them,
+ * then fetches and runs the others. The master is on a simulated
+ * clock, so fetch never sleeps and only scheduler cost is measured.
+ */
+static void
+bench_scheduler(long size)
+{
+	thread_master_t *m;
+	thread_t **threads, fetched;
+	unsigned long ops = 0;
+	long t_add = 0, t_cancel = 0, t_fetch = 0;
+	timeval_t start;
+	long i;
+
+	threads = (thread_t **) MALLOC(size * sizeof (thread_t *));
+
+	while (t_add + t_cancel + t_fetch < 3 * BENCH_MIN_TIME) {
+		m = thread_make_master();
+		thread_set_simulation(m, time_now);
+
+		start = timer_real_now();
+		for (i = 0; i < size; i++)
+			threads[i] = thread_add_timer(m, bench_thread, NULL,
+						      bench_rand() % (10 * TIMER_HZ));
+		t_add += bench_elapsed(start);
+
+		start = timer_real_now();
+		for (i = 0; i < size; i += 2)
+			thread_cancel(threads[i]);
+		t_cancel += bench_elapsed(start);
+
+		start = timer_real_now();
+		for (i = 1; i < size; i += 2) {
+			thread_fetch(m, &fetched);
+			thread_call(&fetched);
+		}
+		t_fetch += bench_elapsed(start);
+
+		thread_destroy_master(m);
+		ops += size;
+	}
+
+	bench_report("thread_add_timer", size, ops, t_add);
+	bench_report("thread_cancel", size, ops / 2, t_cancel);
+	bench_report("thread_fetch", size, ops / 2, t_fetch);
+	FREE(threads);
+}
+
+/* Lists and vectors */
+static void
+bench_list(long size)
+{
+	unsigned long ops = 0;
+	long t_add = 0, t_del = 0;
+	timeval_t start;
+	list l;
+	long i;
+
+	while (t_add + t_del < 2 * BENCH_MIN_TIME) {
+		l = alloc_list(NULL, NULL);
+
+		start = timer_real_now();
+		for (i = 0; i < size; i++)
+			list_add(l, (void *) (i + 1));
+		t_add += bench_elapsed(start);
+
+		/* Oldest first, as queues are consumed */
+		start = timer_real_now();
+		for (i = 0; i < size; i++)
+			list_del(l, (void *) (i + 1));
+		t_del += bench_elapsed(start);
+
+		free_list(l);
+		ops += size;
+	}
+
+	bench_report("list_add", size, ops, t_add);
+	bench_report("list_del", size, ops, t_del);
+}
+
+static void
+bench_vector(long size)
+{
+	unsigned long ops = 0;
+	long usec = 0;
+	timeval_t start;
+	vector_t *v;
+	long i;
+
+	while (usec < BENCH_MIN_TIME) {
+		start = timer_real_now();
+		v = vector_alloc();
+		for (i = 0; i < size; i++) {
+			vector_alloc_slot(v);
+			vector_set_slot(v, (void *) (i + 1));
+		}
+		vector_free(v);
+		usec += bench_elapsed(start);
+		ops += size;
+	}
+
+	bench_report("vector_alloc_slot", size, ops, usec);
+}
+
+/* Configuration parser */
+static void
+bench_strvec(void)
+{
+	char line[] = "    real_server 192.168.200.3 1358 { weight 1 ! comment";
+	unsigned long ops = 0;
+	long usec = 0;
+	timeval_t start;
+	vector_t *strvec;
+	int i;
+
+	while (usec < BENCH_MIN_TIME) {
+		start = timer_real_now();
+		for (i = 0; i < 1000; i++) {
+			strvec = alloc_strvec(line);
+			free_strvec(strvec);
+		}
+		usec += bench_elapsed(start);
+		ops += 1000;
+	}
+
+	bench_report("alloc_strvec", strlen(line), ops, usec);
+}
+
+/* Checksum, VRRP advert and ethernet MTU sizes */
+static void
+bench_csum(int len)
+{
+	u_short buf[1500 / sizeof (u_short)];
+	unsigned long ops = 0;
+	volatile u_short sum = 0;
+	long usec = 0;
+	timeval_t start;
+	int i;
+
+	for (i = 0; i < len / sizeof (u_short); i++)
+		buf[i] = bench_rand();
+
+	while (usec < BENCH_MIN_TIME) {
+		start = timer_real_now();
+		for (i = 0; i < 10000; i++)
+			sum += in_csum(buf, len, sum);
+		usec += bench_elapsed(start);
+		ops += 10000;
+	}
+
+	bench_report("in_csum", len, ops, usec);
+}
+
+/* CRC32 of HTTP check bodies */
+static void
+bench_crc32(int len)
+{
+	unsigned char *buf = (unsigned char *) MALLOC(len);
+	unsigned long ops = 0;
+	volatile uint32_t crc = 0;
+	long usec = 0;
+	timeval_t start;
+	int i;
+
+	for (i = 0; i < len; i++)
+		buf[i] = bench_rand();
+
+	while (usec < BENCH_MIN_TIME) {
+		start = timer_real_now();
+		for (i = 0; i < 100; i++)
+			crc = crc32_update(crc, buf, len);
+		usec += bench_elapsed(start);
+		ops += 100;
+	}
+
+	bench_report("crc32_update", len, ops, usec);
+	FREE(buf);
+}
+
+/* HTTP check response parsing, body bytes discarded */
+static int
+bench_http_body(void *arg, char *buf, int len)
+{
+	return 0;
+}
+
+static void
+bench_http_parse(int chunked)
+{
+	char resp[4096 + 512];
+	http_parser_t parser;
+	unsigned long ops = 0;
+	long usec = 0;
+	timeval_t start;
+	int len, i;
+
+	len = snprintf(resp, sizeof (resp), "HTTP/1.1 200 OK\r\n"
+		       "Server: bench\r\nDate: Thu, 01 Jan 2015 00:00:00 GMT\r\n"
+		       "Content-Type: text/html\r\n%s\r\n",
+		       (chunked) ? "Transfer-Encoding: chunked\r\n\r\n1000" :
+				   "Content-Length: 4096\r\n");
+	memset(resp + len, 'x', 4096);
+	len += 4096;
+	if (chunked)
+		len += sprintf(resp + len, "\r\n0\r\n\r\n");
+
+	while (usec < BENCH_MIN_TIME) {
+		start = timer_real_now();
+		for (i = 0; i < 10000; i++) {
+			http_parse_init(&parser, 1, 0);
+			http_parse(&parser, resp, len, bench_http_body, NULL);
+		}
+		usec += bench_elapsed(start);
+		ops += 10000;
+	}
+
+	bench_report((chunked) ? "http_parse_chunked" : "http_parse", len, ops, usec);
+}
+
+/* Address formatting, as done in every checker log line */
+static void
+bench_sockaddr(int family)
+{
+	struct sockaddr_storage addr;
+	unsigned long ops = 0;
+	long usec = 0;
+	timeval_t start;
+	int i;
+
+	memset(&addr, 0, sizeof (addr));
+	addr.ss_family = family;
+	if (family == AF_INET6) {
+		inet_pton(AF_INET6, "2001:db8::c0a8:c803",
+			  &((struct sockaddr_in6 *) &addr)->sin6_addr);
+		((struct sockaddr_in6 *) &addr)->sin6_port = htons(1358);
+	} else {
+		inet_pton(AF_INET, "192.168.200.3",
+			  &((struct sockaddr_in *) &addr)->sin_addr);
+		((struct sockaddr_in *) &addr)->sin_port = htons(1358);
+	}
+
+	while (usec < BENCH_MIN_TIME) {
+		start = timer_real_now();
+		for (i = 0; i < 10000; i++)
+			inet_sockaddrtopair(&addr);
+		usec += bench_elapsed(start);
+		ops += 10000;
+	}
+
+	bench_report((family == AF_INET6) ? "inet_sockaddrtopair6" :
+		     "inet_sockaddrtopair", 0, ops, usec);
+}
+
+int
+main(int argc, char **argv)
+{
+	long sizes[] = { 1000, 10000, 100000 };
+	int i;
+
+	if (argc > 1)
+		bench_filter = argv[1];
+
+	set_time_now();
+	printf("# name\tsize\tops\tns/op\tops/s\n");
+
+	for (i = 0; i < 3; i++) {
+		if (bench_enabled("thread"))
+			bench_scheduler(sizes[i]);
+		if (bench_enabled("list"))
+			bench_list(sizes[i]);
+		if (bench_enabled("vector"))
+			bench_vector(sizes[i]);
+	}
+
+	if (bench_enabled("alloc_strvec"))
+		bench_strvec();
+	if (bench_enabled("in_csum")) {
+		bench_csum(20);
+		bench_csum(1500);
+	}
+	if (bench_enabled("crc32")) {
+		bench_crc32(1500);
+		bench_crc32(65536);
+	}
+	if (bench_enabled("http_parse")) {
+		bench_http_parse(0);
+		bench_http_parse(1);
+	}
+	if (bench_enabled("inet_sockaddrtopair")) {
+		bench_sockaddr(AF_INET);
+		bench_sockaddr(AF_INET6);
+	}
+
+	thread_pool_destroy();
+	return 0;
+}
@@ -0,0 +1,282 @@
+/*
+ * Soft:        Keepalived is a failover program for the LVS project
+ *              <www.linuxvirtualserver.org>. It monitor & manipulate
+ *              a loadbalanced server pool using multi-layer checks.
+ *
+ * Part:        Checker simulation. TCP_CHECK and HTTP_GET checkers of
+ *              the healthcheck daemon run on the virtual clock of the
+ *              scheduler against scripted peers, so hours of probes
+ *              replay in seconds. Half of the real servers fail from
+ *              the middle of the run on, the run fails unless exactly
+ *              these end up down.
+ *
+ *              Usage : checksim [servers [hours]]
+ *
+ * Author:      Alexandre Cassen, <acassen@linux-vs.org>
+ *
+ *              This program is distributed in the hope that it will be useful,
+ *              but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *              MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *              See the GNU General Public License for more details.
+ *
+ *              This program is free software; you can redistribute it and/or
+ *              modify it under the terms of the GNU General Public License
+ *              as published by the Free Software Foundation; either version
+ *              2 of the License, or (at your option) any later version.
+ *
+ * Copyright (C) 2001-2012 Alexandre Cassen, <acassen@gmail.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include "scheduler.h"
+#include "timer.h"
+#include "global_data.h"
+#include "check_data.h"
+#include "check_api.h"
+#include "check_parser.h"
+#include "ipwrapper.h"
+#include "layer4.h"
+#include "memory.h"
+#include "parser.h"
+
+/* Peer answer time */
+#define SIM_RTT		(TIMER_HZ / 100)
+
+/* Real server n is 10.0.0.1 + n, odd ones are HTTP_GET checked */
+#define SIM_ADDR_BASE	0x0a000001
+
+static const char sim_http_ok[] =
+	"HTTP/1.0 200 OK\r\nContent-Length: 2\r\n\r\nok";
+static const char sim_http_unavailable[] =
+	"HTTP/1.0 503 Service Unavailable\r\nContent-Length: 0\r\n\r\n";
+
+static timeval_t sim_start = { 1000, 0 };
+static long sim_duration;
+static unsigned long sim_connects;
+static unsigned long sim_transitions;
+
+static int
+sim_index(struct sockaddr_storage *addr)
+{
+	return ntohl(((struct sockaddr_in *) addr)->sin_addr.s_addr) - SIM_ADDR_BASE;
+}
+
+/* Two real servers out of four fail in the second half of the run */
+static int
+sim_failing(int index)
+{
+	return index % 4 >= 2 &&
+	       timer_long(timer_sub(time_now, sim_start)) >= sim_duration / 2;
+}
+
+/*
+ * Connect hook. A healthy peer is a socket pair, a web server answers
+ * the request. A failing TCP server is blackholed : the checker gets
+ * the read end of a pipe, never writable, and its connect times out.
+ */
+static enum connect_result
+sim_connect(int fd, conn_opts_t *co)
+{
+	int index = sim_index(&co->dst);
+	const char *answer;
+	int sock, peer;
+	int pfd[2];
+
+	sim_connects++;
+
+	if (!(index & 1) && sim_failing(index)) {
+		if (pipe(pfd) < 0)
+			return connect_error;
+		dup2(pfd[0], fd);
+		close(pfd[0]);
+		thread_sim_write(master, pfd[1], NULL, 0,
+				 co->connection_to + TIMER_HZ);
+		return connect_in_progress;
+	}
+
+	if ((sock = thread_sim_socket(&peer)) < 0)
+		return connect_error;
+	dup2(sock, fd);
+	close(sock);
+
+	if (index & 1) {
+		answer = (sim_failing(index)) ? sim_http_unavailable : sim_http_ok;
+		thread_sim_write(master, peer, answer, strlen(answer), SIM_RTT);
+	}
+	thread_sim_write(master, peer, NULL, 0, 2 * SIM_RTT);
+
+	return connect_success;
+}
+
+/* Checker results, in place of the IPVS updates */
+void
+update_svr_checker_state(int alive, checker_id_t cid, virtual_server_t *vs,
+			 real_server_t *rs)
+{
+	if (ISALIVE(rs) == alive)
+		return;
+	rs->alive = alive;
+	sim_transitions++;
+}
+
+int
+svr_checker_up(checker_id_t cid, real_server_t *rs)
+{
+	return ISALIVE(rs);
+}
+
+void
+update_svr_wgt(int weight, virtual_server_t *vs, real_server_t *rs)
+{
+	rs->weight = weight;
+}
+
+/* One virtual server, its real servers alternate TCP_CHECK and HTTP_GET */
+static char *
+sim_config(int servers)
+{
+	static char path[] = "/tmp/checksim.XXXXXX";
+	struct in_addr addr;
+	FILE *fp;
+	int fd, i;
+
+	if ((fd = mkstemp(path)) < 0 || !(fp = fdopen(fd, "w")))
+		return NULL;
+
+	fprintf(fp, "virtual_server 10.255.255.254 80 {\n"
+		    "  delay_loop 6\n"
+		    "  lb_kind NAT\n"
+		    "  protocol TCP\n");
+	for (i = 0; i < servers; i++) {
+		addr.s_addr = htonl(SIM_ADDR_BASE + i);
+		fprintf(fp, "  real_server %s 80 {\n", inet_ntoa(addr));
+		if (i & 1)
+			fprintf(fp, "    HTTP_GET {\n"
+				    "      url {\n"
+				    "        path /\n"
+				    "        status_code 200\n"
+				    "      }\n"
+				    "      connect_timeout 3\n"
+				    "    }\n");
+		else
+			fprintf(fp, "    TCP_CHECK {\n"
+				    "      connect_timeout 3\n"
+				    "    }\n");
+		fprintf(fp, "  }\n");
+	}
+	fprintf(fp, "}\n");
+	fclose(fp);
+
+	return path;
+}
+
+static int
+sim_end_thread(thread_t * thread)
+{
+	thread_add_terminate_event(thread->master);
+	return 0;
+}
+
+/* Pool as init_services() leaves it without alpha, all servers in */
+static void
+sim_init_services(void)
+{
+	virtual_server_t *vs;
+	element e, f;
+
+	for (e = LIST_HEAD(check_data->vs); e; ELEMENT_NEXT(e)) {
+		vs = ELEMENT_DATA(e);
+		for (f = LIST_HEAD(vs->rs); f; ELEMENT_NEXT(f))
+			SET_ALIVE((real_server_t *) ELEMENT_DATA(f));
+	}
+}
+
+/* Real servers left in the wrong state */
+static int
+sim_verify(int *down)
+{
+	virtual_server_t *vs;
+	real_server_t *rs;
+	element e, f;
+	int errors = 0;
+
+	*down = 0;
+	for (e = LIST_HEAD(check_data->vs); e; ELEMENT_NEXT(e)) {
+		vs = ELEMENT_DATA(e);
+		for (f = LIST_HEAD(vs->rs); f; ELEMENT_NEXT(f)) {
+			rs = ELEMENT_DATA(f);
+			if (!ISALIVE(rs))
+				(*down)++;
+			if (ISALIVE(rs) == sim_failing(sim_index(&rs->addr))) {
+				fprintf(stderr, "real server %s is %s\n", FMT_RS(rs),
+					(ISALIVE(rs)) ? "up" : "down");
+				errors++;
+			}
+		}
+	}
+
+	return errors;
+}
+
+int
+main(int argc, char **argv)
+{
+	int servers = (argc > 1) ? atoi(argv[1]) : 100;
+	long hours = (argc > 2) ? atol(argv[2]) : 1;
+	timeval_t start;
+	thread_t thread;
+	char *conf;
+	int errors, down;
+
+	if (servers <= 0 || hours <= 0) {
+		fprintf(stderr, "Usage : %s [servers [hours]]\n", argv[0]);
+		return 1;
+	}
+	sim_duration = hours * 3600 * TIMER_HZ;
+
+	/* Peers close as they please */
+	signal(SIGPIPE, SIG_IGN);
+	srand(1);
+
+	if (!(conf = sim_config(servers))) {
+		perror("checksim");
+		return 1;
+	}
+
+	master = thread_make_master();
+	thread_set_simulation(master, sim_start);
+
+	global_data = alloc_global_data();
+	check_data = alloc_check_data();
+	init_checkers_queue();
+	init_data(conf, check_init_keywords);
+	unlink(conf);
+	if (!check_data) {
+		fprintf(stderr, "checksim: configuration failed\n");
+		return 1;
+	}
+
+	sim_init_services();
+	tcp_connect_hook = sim_connect;
+	register_checkers_thread();
+	thread_add_timer(master, sim_end_thread, NULL, sim_duration);
+
+	start = timer_real_now();
+	while (thread_fetch(master, &thread))
+		thread_call(&thread);
+
+	errors = sim_verify(&down);
+	printf("%d servers, %ld s simulated in %ld ms, %lu connects, "
+	       "%lu transitions, %d down\n", servers, sim_duration / TIMER_HZ,
+	       timer_long(timer_sub(timer_real_now(), start)) / (TIMER_HZ / 1000),
+	       sim_connects, sim_transitions, down);
+
+	thread_destroy_master(master);
+	thread_pool_destroy();
+	return (errors) ? 1 : 0;
+}